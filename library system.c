@@ -23,13 +23,38 @@
                         - Name of person who took book out (0 if not currently out)
 */
 
-// Header files (all standard)
+// Header files (standard)
 #include <stdio.h>
 #include <time.h>
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+
+// Header files (platform, for memory mapped files, threads and the server's socket)
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include <pthread.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_KERNELS        // Vector search kernels can be built
+#endif
+
+#define MAX_PATH_LENGTH 1024     // Max length of file names
 
 // Book structure definition
 struct book {
@@ -37,42 +62,940 @@ struct book {
     char title[51];
     char author[51];
     int pub_year;
-    time_t date_added;
-    time_t date_out;
-    time_t date_due;
+    int date_added;     // Dates are day numbers (days since 1/1/1970), 0 if not set
+    int date_out;
+    int date_due;
     char name[51];
 };
+#define BOOK_DELETED -1     // Index of a deleted row (book IDs never change, so rows of deleted books are left as tombstones and reused)
+
+// Search index structure definitions (trigram inverted index over upper-case title and author, each trigram maps to the rows that contain it)
+enum search_field { FIELD_TITLE, FIELD_AUTHOR };
+struct posting_list {
+    uint32_t trigram;       // Three chars packed into a number (0 if slot in hash table is empty)
+    int count;      // Number of rows in list
+    int capacity;       // Size of rows array
+    int *rows;      // Rows containing trigram (in order)
+};
+struct trigram_index {
+    struct posting_list *lists;     // Hash table of posting lists (open addressing)
+    int tableSize;      // Size of hash table (power of 2)
+    int numLists;       // Number of posting lists in hash table
+    long long postings;     // Total number of rows in all posting lists
+};
+struct search_index {
+    int built;      // Set to 1 once index has been built
+    struct trigram_index title;     // Index of titles
+    struct trigram_index author;        // Index of authors
+};
+
+// Fuzzy search structure definitions (books sharing enough trigrams with the term are candidates, ranked by how many edits the term is from their text, and the best k kept in a bounded heap)
+#define FUZZY_DEFAULT_RESULTS 10        // Number of closest matches shown when a search finds nothing
+#define FUZZY_MAX_RESULTS 1000      // Max number of results of a fuzzy search
+struct fuzzy_match {
+    int row;        // Row of book
+    int distance;       // Number of edits (insert, delete, change or swap two chars) between term and the closest part of the text
+    int shared;     // Number of trigrams of term in text
+};
+
+// Year index structure definitions (ordered directory of every publication year in the catalog, each with the rows published that year)
+struct year_list {
+    int year;       // Publication year
+    int count;      // Number of rows in list
+    int capacity;       // Size of rows array
+    int *rows;      // Rows of books published this year (in order)
+};
+struct year_index {
+    int built;      // Set to 1 once index has been built
+    struct year_list *years;        // Years, in order
+    int numYears;       // Number of years
+    int maxYears;       // Size of years array
+};
+struct year_cursor {
+    int yearPos;        // Position in year directory
+    int rowPos;     // Position in that year's rows
+    int toYear;     // Last year wanted
+};
+
+// Due date index structure definitions (min-heap of books on loan, earliest date due at the top)
+struct due_entry {
+    int due;        // Date due
+    int row;        // Row of book
+};
+struct due_index {
+    int built;      // Set to 1 once index has been built
+    struct due_entry *heap;     // Books on loan
+    int count;      // Number of books in heap
+    int capacity;       // Size of heap array
+    int *positions;     // Position in heap of each row (-1 if not on loan)
+    int numPositions;       // Size of positions array
+};
+
+// Patron index structure definitions (hash table from each borrower's name to the rows of the books they have out)
+#define PATRON_MAX_LOANS 10     // Max number of books one person can have out at once
+struct patron_loans {
+    uint32_t name;      // Handle of borrower's name in catalog's string pool (STRING_NONE if slot in hash table is empty)
+    int count;      // Number of books they have out
+    int capacity;       // Size of rows array
+    int *rows;      // Rows of books they have out (in no particular order)
+};
+struct patron_index {
+    int built;      // Set to 1 once index has been built
+    struct patron_loans *patrons;       // Hash table of borrowers (open addressing, entries are kept when they have nothing out)
+    int tableSize;      // Size of hash table (power of 2)
+    int numPatrons;     // Number of borrowers in hash table
+};
+
+// Loan history structure definitions (each finished loan is appended to "<file>.history.<yyyymm>", the file for the month the book came back, with the months listed in "<file>.history",
+// and loans are counted per book, per author and per day as they happen, so popularity reports only read the counts)
+#define HISTORY_RECORD_SIZE 24      // Loan number (8 bytes), then book ID, date out, date due and date returned (4 bytes each); borrowers' names are not kept
+#define HISTORY_MAX_MONTHS 1200     // Max number of monthly files (100 years)
+#define HISTORY_PATH_LENGTH (MAX_PATH_LENGTH + 16)      // Max length of a monthly file's name (room for ".<yyyymm>" after the list's name)
+#define LOAN_TOP_DEFAULT 10     // Number of books/authors in a popularity report, unless told otherwise
+#define LOAN_TOP_MAX 1000
+#define LOAN_USAGE_MAX_DAYS 3660        // Max number of days in a usage report
+struct loan_record {
+    long long loan;     // Number of loan (numbered from 1, in the order books came back)
+    int id;     // ID of book
+    int date_out;       // Date book was taken out
+    int date_due;       // Date book was due
+    int date_returned;      // Date book came back
+};
+struct loan_history {
+    char path[MAX_PATH_LENGTH];     // File listing the months (monthly files are named after it)
+    int months[HISTORY_MAX_MONTHS];     // Months that have a file (year*12 + month-1)
+    int numMonths;      // Number of months that have a file
+    FILE *file;     // File of month last written to (NULL if none is open)
+    int fileMonth;      // Month of file
+    long long lastLoan;     // Number of last loan written
+};
+struct loan_count {
+    uint32_t key;       // Book ID, author's string handle or day
+    int used;       // Set to 1 if slot is in use
+    long long loans;        // Number of times taken out (on that day, for a day)
+    long long returns;      // Number of times returned (on that day, for a day)
+    long long daysOut;      // Total days out of the loans returned
+};
+struct loan_counts {
+    struct loan_count *slots;       // Hash table (open addressing)
+    int tableSize;      // Size of hash table (power of 2)
+    int count;      // Number of slots in use
+};
+struct loan_stats {
+    int built;      // Set to 1 once counts have been made from the history (and the books out now)
+    struct loan_counts books;       // Counts per book ID
+    struct loan_counts authors;     // Counts per author
+    struct loan_counts days;        // Counts per day
+};
+
+// Sort order structure definitions (rows of every book in title, author, year or date added order, kept in blocks so a change only moves rows within one block,
+// and read a page at a time from a cursor holding the place of the last book read, so any page takes the same time and changes in between do not upset it)
+#define SORT_BLOCK_ROWS 512     // Max rows in a block (a full block is split in two)
+#define SORT_BUILD_ROWS 384     // Rows put in each block when an order is built (leaves room for adds)
+#define PAGE_DEFAULT_BOOKS 20       // Number of books in a page, unless told otherwise
+#define PAGE_MAX_BOOKS 1000
+#define PAGE_CURSOR_LENGTH 128      // Max length of a cursor as text (hex digits, incl. '\0')
+#define WRITER_BUFFER_SIZE 65536        // Size of buffer of a text writer
+#define WRITER_MAX_ENTRY 512        // Max length of one entry written to a text writer
+enum sort_field {SORT_TITLE, SORT_AUTHOR, SORT_YEAR, SORT_ADDED, SORT_FIELDS};
+struct sort_key {
+    const char *text;       // Title or author (NULL for an order by number)
+    int number;     // Year or date added (0 for an order by text)
+    int id;     // Book ID (so every book has its own place in the order)
+};
+struct sort_entry {
+    struct sort_key key;        // Place of book in order
+    int row;        // Row of book
+};
+struct sort_block {
+    int count;      // Number of rows in block
+    int rows[SORT_BLOCK_ROWS];      // Rows of books, in order
+};
+struct sort_order {
+    int built;      // Set to 1 once order has been built
+    struct sort_block **blocks;     // Blocks, in order
+    int numBlocks;      // Number of blocks
+    int maxBlocks;      // Size of blocks array
+};
+struct page_cursor {
+    int field;      // Order being read (a sort_field)
+    int started;        // Set to 1 once a page has been read (then the next page starts after the key below)
+    char text[51];      // Title/author of last book read (its place in the order, with the two below)
+    int number;     // Year/date added of last book read
+    int id;     // ID of last book read
+};
+struct text_writer {
+    FILE *out;      // File written to when buffer is full, and when flushed
+    size_t length;      // Number of chars in buffer
+    char data[WRITER_BUFFER_SIZE];
+};
+
+// Query structure definitions (a query is one or more alternatives joined by '|', each a list of predicates joined by '&' that must all hold)
+// Each alternative is read through one access path (an index, or a scan of every book) picked by how many rows it would give, and the rows it gives are checked against every predicate
+#define QUERY_MAX_PREDICATES 8      // Max number of predicates in an alternative
+#define QUERY_MAX_ALTERNATIVES 8        // Max number of alternatives in a query
+enum predicate_kind { PRED_TITLE = 1, PRED_AUTHOR, PRED_YEAR, PRED_AVAILABLE, PRED_OUT, PRED_OVERDUE };
+enum access_path { PATH_SCAN, PATH_TITLE_INDEX, PATH_AUTHOR_INDEX, PATH_YEAR_INDEX, PATH_DUE_INDEX };
+struct predicate {
+    int kind;       // Type of predicate
+    char text[51];      // Text title/author must contain (upper-case)
+    size_t textLength;      // Length of text
+    int fromYear;       // First publication year wanted
+    int toYear;     // Last publication year wanted
+};
+struct conjunction {
+    struct predicate predicates[QUERY_MAX_PREDICATES];      // Predicates that must all hold
+    int numPredicates;      // Number of predicates
+};
+struct query {
+    struct conjunction alternatives[QUERY_MAX_ALTERNATIVES];        // Alternatives (a book matches if it matches any of them)
+    int numAlternatives;        // Number of alternatives
+    int current_date;       // Date books are overdue from
+};
+struct query_plan {
+    int path;       // Access path picked
+    int driver;     // Predicate access path comes from (-1 for a scan)
+    long long estimate;     // Number of rows access path was expected to give
+    long long examined;     // Number of rows access path gave (each checked against every predicate)
+    int matched;        // Number of rows that matched every predicate
+    double seconds;     // Time taken to plan and run alternative
+};
+
+// ID map structure definitions (open addressing hash table from book ID to the row it is in)
+struct id_entry {
+    int id;     // Book ID (-1 for an empty entry)
+    int row;        // Row of book
+};
+struct id_map {
+    int built;      // Set to 1 once map has been built
+    struct id_entry *entries;       // Table of entries (size is a power of 2)
+    int size;       // Size of table
+    int count;      // Number of entries in use
+};
+
+// String pool structure definitions (each distinct author and borrower name is stored once, in an arena, and books keep 32-bit handles to them)
+#define STRING_BLOCK_BITS 16
+#define STRING_BLOCK_SIZE (1 << STRING_BLOCK_BITS)      // Size of each block of arena (a handle is block number, then position in block)
+#define STRING_BLOCK_PADDING 64     // Zeroed bytes after each block, so match kernels can read 49 chars from any string in it
+#define STRING_MAX_BLOCKS 65535     // Max number of blocks (so no handle is STRING_NONE)
+#define STRING_NONE 0xFFFFFFFFu     // Handle of a string that is not in the pool (also marks empty hash set slots)
+#define STRING_EMPTY 0      // Handle of "" (first string added to every pool)
+struct string_pool {
+    char *blocks[STRING_MAX_BLOCKS];        // Arena blocks (never move, so strings can be read while others are added)
+    int numBlocks;      // Number of blocks allocated
+    uint32_t used;      // Bytes used in last block
+    uint32_t *slots;        // Hash set of handles (open addressing, STRING_NONE if empty)
+    uint32_t *hashes;       // Hash of the string in each slot
+    uint32_t numSlots;      // Size of hash set (power of 2)
+    uint32_t count;     // Number of strings in pool
+    int references;     // Number of catalogs using pool (a catalog shares it with its copies)
+    pthread_mutex_t lock;       // Lock for adding/finding strings (loader threads add them at the same time)
+};
+
+// Catalog structure definitions (books are stored in fixed-size chunks on the heap, so a book never moves once added)
+// Each chunk keeps the numbers that scans look at in their own arrays, and the text of each book in a side table, so scans only read the bytes they need
+#define CATALOG_CHUNK_ROWS 4096     // Number of books in each chunk
+struct book_text {
+    char title[51];
+    uint32_t author;        // Handle of author in catalog's string pool
+    uint32_t name;      // Handle of borrower's name in catalog's string pool ("0" if not out)
+    int date_added;
+};
+struct catalog_chunk {
+    int references;     // Number of catalogs using chunk (a catalog shares its chunks with the copy being saved, and copies a chunk before changing it while it is shared)
+    int index[CATALOG_CHUNK_ROWS];      // Book IDs (BOOK_DELETED for deleted rows)
+    int pub_year[CATALOG_CHUNK_ROWS];
+    int date_out[CATALOG_CHUNK_ROWS];
+    int date_due[CATALOG_CHUNK_ROWS];
+    struct book_text text[CATALOG_CHUNK_ROWS];      // Rest of each book (only read to show or search text)
+};
+struct catalog {
+    struct catalog_chunk **chunks;      // Table of pointers to chunks
+    struct string_pool *strings;        // Authors and borrowers' names of books (NULL until first chunk is made)
+    int numChunks;      // Number of chunks allocated
+    int maxChunks;      // Size of the chunk pointer table
+    int numRows;        // Number of rows in the catalog (books, and tombstones of deleted books)
+    int *freeRows;      // Rows of deleted books, to be reused
+    int numFree;        // Number of rows of deleted books
+    int maxFree;        // Size of freeRows array
+    struct id_map ids;      // Map from book ID to row
+    int nextId;     // ID for next book added
+    int numShards;      // Number of files the database is split into (1 if it is a single file)
+    struct journal *journal;        // Journal changes are written to (NULL if changes are only kept in memory)
+    struct snapshot *snapshot;      // Snapshot file that chunks not read yet (NULL in chunk table) are in (NULL if none)
+    struct search_index search;     // Index for title/author searches
+    struct year_index years;        // Index for publication year searches
+    struct due_index due;       // Index for overdue checks
+    struct patron_index patrons;        // Index for what each person has out
+    struct loan_history *history;       // Finished loans (NULL if they are not kept, e.g. with no journal)
+    struct loan_stats loans;        // Loan counts per book, author and day
+    struct sort_order sorts[SORT_FIELDS];       // Orders for listing books a page at a time
+};
+
+// Change structure definition (every change to the catalog is one of these, so it can be written to the journal)
+enum mutation_op { OP_ADD = 1, OP_EDIT, OP_DELETE, OP_BORROW, OP_RETURN };
+struct mutation {
+    int op;     // Type of change
+    int id;     // ID of book changed
+    struct book book;       // New values (add: whole book, edit: title/author/pub_year, borrow: name/date_out/date_due)
+    int date_returned;      // Date book came back (return only)
+    long long loan;     // Number of loan in the history (return only, so it is written there once however often the journal is replayed; 0 if not kept)
+};
+
+// Journal structure definitions (changes are appended to "<file>.journal", then folded into the database file in the background)
+#define JOURNAL_HEADER "LIBJRNL3"       // Start of every journal file
+#define JOURNAL_HEADER_SIZE 8
+#define JOURNAL_MAX_RECORD 256      // Max size of one journal record
+#define JOURNAL_SYNC_MS 20      // Max time a change waits before being synced to disk
+#define JOURNAL_SYNC_RECORDS 256        // Number of waiting changes that causes an immediate sync
+#define JOURNAL_COMPACT_RECORDS 100000      // Number of changes in journal that causes a fold into the database file
+#define JOURNAL_CHECKPOINT_SECONDS 300      // Default max time changes stay only in the journal before a fold (a checkpoint)
+#define SHARD_MAX 256       // Max number of files the database can be split into
+#define SHARD_PATH_LENGTH (MAX_PATH_LENGTH + 20)        // Max length of a shard file's name (room for ".shard<n>" after the database file's name)
+struct compaction {
+    struct journal *journal;        // Journal being folded
+    struct catalog books;       // Copy of catalog to be written (shares chunks with the catalog until they change)
+    unsigned char dirty[SHARD_MAX];     // Shard files to be written (1 for each shard with changes)
+    int success;        // Set to 1 once database file is written
+    int done;       // Set to 1 (atomically) once fold has finished
+};
+struct save_stats {
+    long long saves;        // Number of folds that wrote the database file
+    long long failures;     // Number of folds that could not write it
+    double lastSeconds;     // Time taken to write files in last fold (in the background, unless saving on quit)
+    double totalSeconds;        // Time taken to write files in every fold
+    double lastPauseSeconds;        // Time changes were held up to start last fold (copying catalog and starting a new journal)
+    long long lastBytes;        // Bytes written in last fold (database and snapshot files)
+    long long totalBytes;       // Bytes written in every fold
+};
+struct journal {
+    char fileName[MAX_PATH_LENGTH];        // Database file
+    char path[MAX_PATH_LENGTH];        // Journal file
+    char oldPath[MAX_PATH_LENGTH];     // Journal file being folded into the database file
+    char tmpPath[MAX_PATH_LENGTH];     // Database file being written
+    char snapshotPath[MAX_PATH_LENGTH];        // Snapshot file
+    FILE *file;     // Open journal file
+    pthread_mutex_t lock;       // Lock for everything below
+    pthread_cond_t wake;        // Wakes sync thread
+    pthread_t syncThread;       // Thread that syncs journal to disk
+    int pending;        // Number of changes not yet synced to disk
+    double firstPendingTime;        // Time oldest unsynced change was written
+    long long records;      // Number of changes since last fold
+    long long syncs;        // Number of syncs done
+    int stopping;       // Set to 1 to stop sync thread
+    pthread_t compactThread;        // Thread folding journal into database file
+    int compacting;     // Set to 1 while compactThread is running
+    struct compaction compaction;       // Fold being done by compactThread
+    double lastCheckpoint;      // Time last fold was started
+    struct save_stats stats;        // Folds done since journal was opened
+    int numShards;      // Number of files database is split into
+    unsigned char dirtyShards[SHARD_MAX];       // Set to 1 for each shard changed since last fold
+};
+
+// Sharding structure definitions (a database can be split by book ID into "<file>.shard<n>" files, named in "<file>.shards", so they are read and written in parallel and only changed ones are written)
+struct shard_writer {
+    struct catalog *catalog;        // Catalog being written
+    char *fileName;     // Database file (shard files are named after it)
+    int numShards;      // Number of shard files
+    const unsigned char *dirty;     // Set to 1 for each shard to be written (NULL to write every shard)
+    int next;       // Next shard for a thread to take (taken atomically)
+    int failed;     // Set to 1 if any shard cannot be written
+    long long bytes;        // Bytes written (added atomically)
+};
+static uint32_t crcTable[256];      // Lookup table for CRC-32 checksums
+static int checkpointSeconds = JOURNAL_CHECKPOINT_SECONDS;     // Max time changes stay only in the journal (set with --checkpoint, 0 for no limit)
+
+// Memory mapped file structure definition
+struct mapped_file {
+    const char *data;       // Contents of file
+    size_t size;        // Size of file in bytes
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+};
+
+// Loading structure definitions (the CSV file, or each shard file, is split into parts, parsed by a pool of threads)
+#define CSV_FIELDS 8        // Number of fields in each row of CSV file
+#define LOAD_MAX_THREADS 64     // Max number of threads used to load file (or write shard files)
+#define LOAD_MIN_BYTES_PER_THREAD (1 << 20)     // Smallest part of file worth giving its own thread
+#define LOAD_MAX_REPORTED_ERRORS 10     // Max number of invalid rows reported for each part of file
+struct load_task {
+    struct catalog *catalog;        // Catalog being read to
+    char *fileName;     // File part is in (for error messages)
+    const char *start;      // Start of part of file (always the start of a row)
+    const char *end;        // End of part of file (always the end of a row)
+    int numLines;       // Number of lines in part of file
+    int firstLine;      // Line number of first line in part of file
+    int firstRow;       // First catalog row for part of file to be read to
+    int numRead;        // Number of rows successfully read
+    int numErrors;      // Number of rows that could not be read
+    int errorLines[LOAD_MAX_REPORTED_ERRORS];       // Line numbers of rows that could not be read
+    const char *errors[LOAD_MAX_REPORTED_ERRORS];       // Reasons rows could not be read
+};
+struct load_pool {
+    void* (*function)(void*);       // Pass being run on each part
+    struct load_task *tasks;        // Parts of file(s)
+    int numTasks;       // Number of parts
+    int next;       // Next part for a thread to take (taken atomically)
+};
+struct load_stats {
+    int rows;       // Number of rows read
+    int errors;     // Number of rows that could not be read
+    int threads;        // Number of threads used
+    size_t bytes;       // Size of file
+    double seconds;     // Time taken to read file
+    int fromSnapshot;       // Set to 1 if read from snapshot file instead of CSV file
+};
+
+// Snapshot structure definitions (binary copy of the database file that is memory mapped and read a chunk at a time, when first used)
+// File layout: header, fixed-width records, string table, block table (where each block's strings start and a checksum for each block)
+#define SNAPSHOT_MAGIC "LIBSNAP"        // Start of every snapshot file (8 bytes including '\0')
+#define SNAPSHOT_VERSION 2      // Changed whenever the layout changes
+#define SNAPSHOT_HEADER_SIZE 64
+#define SNAPSHOT_RECORD_SIZE 32
+#define SNAPSHOT_BLOCK_SIZE 12
+struct file_stamp {
+    long long size;     // Size of file
+    long long modified;     // Time file was last modified
+};
+struct snapshot {
+    struct mapped_file map;     // Mapped snapshot file
+    int numRows;        // Number of books in snapshot
+    int numBlocks;      // Number of blocks (of CATALOG_CHUNK_ROWS books) in snapshot
+    const unsigned char *records;       // Start of records
+    const unsigned char *strings;       // Start of string table
+    long long stringSize;       // Size of string table
+    const unsigned char *blocks;        // Start of block table
+    pthread_mutex_t lock;       // Lock for reading chunks
+};
+
+// Date definitions (dates are kept as day numbers, so showing and comparing them needs no memory or time zone code; only converting to/from the seconds in the database file does)
+#define DATE_LENGTH 11      // Length of date string (dd/mm/yyyy, including '\0')
+#define DATE_SECONDS_PER_DAY 86400
+#define DATE_CACHE_SIZE 4096        // Number of days whose time zone offset is remembered (power of 2)
+#define DATE_OFFSET_VARIES LONG_MIN     // Offset of a day in which the clocks change
+struct date_cache {
+    int day[DATE_CACHE_SIZE];       // Day (since 1/1/1970 UTC) each slot is for (INT_MIN if empty)
+    long offset[DATE_CACHE_SIZE];       // Local time minus UTC all through that day, in seconds (DATE_OFFSET_VARIES if clocks change during it)
+};
+
+// Import structure definitions (books from an external CSV file of title,author,pub_year lines are added in batches, one journal sync each,
+// read through a fixed-size buffer and skipping any already in the catalog, so memory use does not grow with the size of the file)
+#define IMPORT_BUFFER_SIZE (1 << 20)        // Size of buffer file is read through (longer lines are skipped)
+#define IMPORT_BATCH_BOOKS 10000        // Books added per batch, unless told otherwise
+#define IMPORT_MAX_REPORTED_ERRORS 10       // Max number of invalid lines reported
+struct import_entry {
+    uint64_t hash;      // Hash of book's title, author and year (ignoring case)
+    int id;     // ID of book (-1 if slot is empty)
+};
+struct import_set {
+    struct import_entry *entries;       // Hash set of every book in catalog or batch (open addressing)
+    int numSlots;       // Size of entries (power of 2)
+    int count;      // Number of books in set
+};
+struct import_stats {
+    long long lines;        // Number of lines read
+    long long added;        // Number of books added
+    long long duplicates;       // Number of books skipped as already in catalog (or earlier in file)
+    long long invalid;      // Number of lines skipped as not valid books
+    int batches;        // Number of batches committed
+    double seconds;     // Time taken
+};
+
+// Metrics structure definitions (each thread counts its own operations and their latencies, added together only when read, so counting never waits on a lock)
+// Latencies go in log-linear buckets: 16 per power of 2 nanoseconds, so each percentile is within about 3% of the true value
+#define METRIC_SUB_BITS 4       // Buckets per power of 2 is 2^METRIC_SUB_BITS
+#define METRIC_MAX_EXPONENT 40      // Latencies of 2^40 ns (about 18 minutes) or more go in the last bucket
+#define METRIC_BUCKETS ((METRIC_MAX_EXPONENT - METRIC_SUB_BITS + 2) << METRIC_SUB_BITS)
+enum metric_op { METRIC_LOAD, METRIC_SAVE, METRIC_JOURNAL_APPEND, METRIC_JOURNAL_SYNC, METRIC_SEARCH, METRIC_FUZZY, METRIC_QUERY, METRIC_CHECK,
+                 METRIC_ADD, METRIC_EDIT, METRIC_DELETE, METRIC_BORROW, METRIC_RETURN, METRIC_IMPORT, METRIC_REPORT, METRIC_OPS };     // (METRIC_ADD to METRIC_RETURN in the same order as mutation_op)
+struct metric_histogram {
+    uint64_t count;     // Number of operations
+    uint64_t errors;        // Number of operations that failed
+    uint64_t totalNanoseconds;      // Time taken by all of them
+    uint64_t maxNanoseconds;        // Time taken by slowest one
+    uint64_t buckets[METRIC_BUCKETS];       // Number of operations taking each range of times
+};
+struct metrics_shard {
+    struct metric_histogram ops[METRIC_OPS];        // Counts for each kind of operation
+    struct metrics_shard *next;     // Next shard in list of every shard
+    int inUse;      // Set to 1 while a thread is counting in it (shards of threads that have finished are reused, keeping their counts)
+};
+static const char *metricNames[METRIC_OPS] = {"load", "save", "journal_append", "journal_sync", "search", "fuzzy", "query", "check", "add", "edit", "delete", "borrow", "return", "import", "report"};
+static struct metrics_shard *metricsShards;     // Every shard
+static pthread_mutex_t metricsLock = PTHREAD_MUTEX_INITIALIZER;        // Lock for metricsShards (only taken when a thread starts counting, and to read counts)
+static pthread_key_t metricsKey;        // Hands shard back when its thread finishes
+static pthread_once_t metricsOnce = PTHREAD_ONCE_INIT;
+static __thread struct metrics_shard *threadMetrics;        // Shard this thread counts in (NULL until it first counts)
+static int metricsSeconds = 0;      // Time between writes of metrics to "<database>.metrics" (set with --metrics, 0 to not write them)
+static char metricsPath[MAX_PATH_LENGTH];       // File metrics are written to
+struct metrics_writer {
+    pthread_mutex_t lock;       // Lock for stopping
+    pthread_cond_t wake;        // Signalled to stop thread
+    int stopping;       // Set to 1 when program ends (thread then stops, and the last write is done by the program)
+    pthread_t thread;       // Thread that writes metrics file
+};
+static struct metrics_writer metricsWriter = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+struct metrics_bench {
+    int numRecords;     // Number of operations for thread to count
+    double seconds;     // Time thread took
+};
+
+// Benchmark definitions (suite run with --bench, on synthetic catalogs)
+#define BENCH_NOW 1750000000LL      // Current date of synthetic catalogs (fixed, so they are the same whenever they are made)
+#define BENCH_MAX_RESULTS 256       // Max number of results in one run
+#define BENCH_SEARCHES 200      // Number of searches of each kind
+#define BENCH_CHECKS 20     // Number of overdue checks
+#define BENCH_SCANS 10      // Number of full scans of each layout
+#define BENCH_DELETES 10000     // Number of deletes
+#define BENCH_SHARDS 16     // Number of shard files catalog is split into for the sharded load/save
+#define BENCH_REGRESSION_RATIO 1.2      // Time per op more than this many times the baseline is a regression
+#define BENCH_MIN_DIFFERENCE 0.005      // Differences smaller than this many seconds are ignored (timer noise)
+struct bench_result {
+    char name[32];      // Name of benchmark
+    int rows;       // Number of books in catalog
+    int ops;        // Number of operations timed
+    double seconds;     // Total time taken
+};
+
+#ifndef _WIN32
+// Server structure definitions (daemon mode: clients send batch commands over a Unix domain socket)
+#define SERVER_MAX_CLIENTS 1024     // Max number of clients connected at once
+#define SERVER_MAX_WORKERS 64       // Max number of worker threads
+#define SERVER_RECORD_LOCKS 256     // Number of locks books are spread across (by index)
+#define SERVER_BUFFER_SIZE 4096     // Size of each client's request buffer
+struct connection {
+    int fd;     // Client socket
+    char buffer[SERVER_BUFFER_SIZE];        // Data read from client that is not a whole command yet
+    size_t length;      // Amount of data in buffer
+    int current_date;       // Date used for client's commands
+};
+struct server {
+    struct catalog *catalog;        // Catalog being served
+    pthread_rwlock_t lock;      // Shared by searches, taken alone to change catalog
+    pthread_mutex_t recordLocks[SERVER_RECORD_LOCKS];       // Held while a book is checked and changed (so two clients cannot both borrow it)
+    pthread_mutex_t queueLock;      // Lock for queue and returned
+    pthread_cond_t queueWake;       // Signalled when a client is added to queue (or server is stopping)
+    struct connection *queue[SERVER_MAX_CLIENTS];       // Clients with data waiting for a worker
+    int queueStart;     // Position of first client in queue
+    int queueCount;     // Number of clients in queue
+    struct connection *returned[SERVER_MAX_CLIENTS];        // Clients workers have finished with, for dispatcher to wait on again
+    int numReturned;        // Number of clients in returned
+    int wakePipe[2];        // Pipe used to wake dispatcher
+    int stopping;       // Set to 1 to stop workers
+    pthread_t workers[SERVER_MAX_WORKERS];      // Worker threads
+    int numWorkers;     // Number of worker threads
+    int numClients;     // Number of clients connected
+    long long requests;     // Number of commands run
+};
+struct load_client {
+    char *socketPath;       // Server socket
+    int number;     // Client number (used in names of borrowers)
+    unsigned seed;      // Random seed
+    int numBooks;       // Highest book index to borrow/return
+    double endTime;     // Time to stop sending requests
+    double *latencies;      // Time taken by each request
+    int numLatencies;       // Number of requests sent
+    int maxLatencies;       // Size of latencies array
+    int failed;     // Set to 1 if connection failed
+    int reporter;       // Set to 1 to only send list commands (long reports, which are not timed)
+};
+#endif
 
 // Function prototypes
-int csvToStructs(char* fileName, int maxRowLength, int maxRows, struct book *books, int *numRows);
-time_t getDate(void);
-void printBooks(struct book *books, int numRows);
-int string_to_time(char* date);
-char* time_to_string(time_t timeFormatted);
-void borrowBook(struct book *books, int *numRows, time_t current_date);
-void returnBook(struct book *books, int *numRows);
-void addBook(struct book *books, int *numRows, time_t current_date);
-void deleteBook(struct book *books, int *numRows);
-void editBook(struct book *books, int *numRows, time_t current_date);
-void saveFile(char* fileName, struct book *books, int numRows);
-void searchBooks(struct book *books, int *numRows, time_t current_date);
-void checkBooks(struct book *books, int *numRows, time_t current_date);
+void catalogInit(struct catalog *catalog);
+struct catalog_chunk* catalogChunk(struct catalog *catalog, int row);
+int catalogId(struct catalog *catalog, int row);
+struct book_text* catalogText(struct catalog *catalog, int row);
+void catalogRead(struct catalog *catalog, int row, struct book *book);
+int catalogWrite(struct catalog *catalog, int row, const struct book *book);
+void catalogCopyRow(struct catalog *from, int fromRow, struct catalog *to, int toRow);
+struct catalog_chunk* catalogChunkForWrite(struct catalog *catalog, int row);
+void catalogChunkRelease(struct catalog_chunk *chunk);
+int catalogReserveChunkTable(struct catalog *catalog, int numChunks);
+int catalogReserve(struct catalog *catalog, int numRows);
+int catalogAppend(struct catalog *catalog);
+size_t catalogMemoryUsage(struct catalog *catalog);
+void catalogFree(struct catalog *catalog);
+struct string_pool* stringPoolCreate(void);
+void stringPoolRelease(struct string_pool *pool);
+const char* stringGet(struct string_pool *pool, uint32_t handle);
+uint32_t stringHash(const char *text);
+uint32_t stringSlot(struct string_pool *pool, const char *text, uint32_t hash);
+uint32_t stringFind(struct string_pool *pool, const char *text);
+uint32_t stringIntern(struct string_pool *pool, const char *text);
+int* findBooksByAuthor(struct catalog *catalog, const char *author, int *numMatches);
+int fuzzyDistance(const char *term, size_t termLength, const char *text, int maxDistance);
+int fuzzyWorse(struct fuzzy_match *a, struct fuzzy_match *b);
+void fuzzyOffer(struct fuzzy_match *heap, int *count, int k, struct fuzzy_match *match);
+int compareFuzzyMatches(const void *a, const void *b);
+struct fuzzy_match* fuzzyFindBooks(struct catalog *catalog, int field, char *term, int k, int *numMatches);
+int idHome(struct id_map *map, int id);
+int idMapFind(struct id_map *map, int id);
+int idMapReserve(struct id_map *map, int count);
+void idMapPut(struct id_map *map, int id, int row);
+void idMapRemove(struct id_map *map, int id);
+int idMapReady(struct catalog *catalog);
+void idMapFree(struct catalog *catalog);
+int catalogFind(struct catalog *catalog, int id);
+int catalogNewId(struct catalog *catalog);
+int catalogNewRow(struct catalog *catalog);
+int catalogDeleteRow(struct catalog *catalog, int row);
+void catalogCompact(struct catalog *catalog);
+int cpuCount(void);
+double nowSeconds(void);
+void metricsThreadDone(void *shard);
+void metricsKeyInit(void);
+struct metrics_shard* metricsShard(void);
+void metricAdd(uint64_t *counter, uint64_t value);
+int metricBucket(uint64_t nanoseconds);
+uint64_t metricBucketStart(int bucket);
+void metricsRecord(int op, double start, int success);
+void metricsRead(struct metric_histogram *totals);
+double metricPercentile(struct metric_histogram *histogram, double fraction);
+int metricsWrite(FILE *out);
+int metricsWriteFile(void);
+void metricsWriteAtExit(void);
+void* metricsTask(void *argument);
+int metricsStart(char *fileName);
+void* benchMetricsTask(void *argument);
+int benchmarkMetrics(int numRecords);
+int mapFile(char *fileName, struct mapped_file *map);
+void unmapFile(struct mapped_file *map);
+int parseNumber(const char *start, const char *end, long long *value);
+const char* parseRow(const char *start, const char *end, struct book *book, struct date_cache *dates);
+void* countRowsTask(void *argument);
+void* parseRowsTask(void *argument);
+void* loadPoolTask(void *argument);
+void runLoadTasks(void* (*function)(void*), struct load_task *tasks, int numTasks);
+int csvToStructs(char* fileName, struct catalog *catalog, struct load_stats *stats);
+int csvFilesToStructs(char **fileNames, int numFiles, struct catalog *catalog, struct load_stats *stats);
+void makeCrcTable(void);
+uint32_t crc32(uint32_t crc, const void *data, size_t size);
+int syncFile(FILE *file);
+int replaceFile(char *from, char *to);
+int fileExists(char *fileName);
+void putNumber(unsigned char **pos, long long value, int bytes);
+void putText(unsigned char **pos, const char *text);
+int getNumber(const unsigned char **pos, const unsigned char *end, long long *value, int bytes);
+int getText(const unsigned char **pos, const unsigned char *end, char *text);
+size_t encodeMutation(struct mutation *mutation, unsigned char *record);
+int decodeMutation(const unsigned char *pos, const unsigned char *end, struct mutation *mutation);
+int applyMutation(struct catalog *catalog, struct mutation *mutation);
+int commitMutation(struct catalog *catalog, struct mutation *mutation);
+size_t replayJournal(char *fileName, struct catalog *catalog, struct journal *journal, int *numRecords);
+int truncateFile(char *fileName, size_t size);
+int appendJournal(char *fromName, char *toName);
+FILE* openJournalFile(char *fileName);
+void* journalSyncTask(void *argument);
+struct journal* journalOpen(char *fileName, struct catalog *catalog);
+int journalAppend(struct journal *journal, struct mutation *mutation);
+int journalAppendBatch(struct journal *journal, struct mutation *mutations, int numMutations);
+void journalWaitForCompaction(struct journal *journal);
+int journalCompacting(struct journal *journal);
+void journalClose(struct journal *journal);
+int catalogCopy(struct catalog *from, struct catalog *to);
+int catalogShare(struct catalog *from, struct catalog *to);
+int writeCsvFile(char *fileName, struct catalog *catalog);
+int writeShardFile(char *fileName, struct catalog *catalog, int shard, int numShards);
+int bookShard(int id, int numShards);
+int shardPath(char *fileName, int shard, int numShards, char *path);
+int shardCount(char *fileName);
+int writeShardCount(char *fileName, int numShards);
+void* shardWriteTask(void *argument);
+int writeShards(char *fileName, struct catalog *catalog, int numShards, const unsigned char *dirty, long long *bytes);
+int reshardDatabase(char *fileName, int numShards);
+void* compactTask(void *argument);
+int compactJournal(struct catalog *catalog, int background);
+int getFileStamp(char *fileName, struct file_stamp *stamp);
+int writeSnapshotFile(char *fileName, struct catalog *catalog, struct file_stamp *stamp);
+int snapshotOpen(char *fileName, struct catalog *catalog, struct file_stamp *stamp);
+int snapshotBlockValid(struct snapshot *snapshot, int chunkNum);
+struct catalog_chunk* snapshotLoadChunk(struct catalog *catalog, int chunkNum);
+void snapshotClose(struct snapshot *snapshot);
+int loadCatalog(char *fileName, struct catalog *catalog, struct load_stats *stats);
+int loadCatalogFiles(char *fileName, struct catalog *catalog, struct load_stats *stats);
+int convertFile(char *from, char *to, int toSnapshot);
+int getTrigrams(const char *text, uint32_t *trigrams);
+struct posting_list* trigramList(struct trigram_index *index, uint32_t trigram, int create);
+int postingFind(struct posting_list *list, int row);
+int trigramAdd(struct trigram_index *index, int row, const char *text);
+void trigramRemove(struct trigram_index *index, int row, const char *text);
+void trigramFree(struct trigram_index *index);
+int* trigramCandidates(struct trigram_index *index, const char *term, int *numCandidates);
+int searchIndexReady(struct catalog *catalog);
+void searchIndexUpdate(struct catalog *catalog, int row, struct book *oldBook, struct book *newBook);
+void searchIndexFree(struct catalog *catalog);
+int* findBooks(struct catalog *catalog, int field, char *term, int *numMatches);
+int matchAt(const char *text, const char *term, size_t termLength);
+int containsScalar(const char *text, const char *term, size_t termLength);
+#ifdef HAVE_X86_KERNELS
+unsigned candidatesSse2(const char *text, __m128i firstFold, __m128i firstChar, __m128i secondFold, __m128i secondChar, unsigned *nulls);
+int checkCandidates(const char *text, unsigned candidates, unsigned nulls, const char *term, size_t termLength);
+int containsSse2(const char *text, const char *term, size_t termLength);
+int containsAvx2(const char *text, const char *term, size_t termLength);
+#endif
+void chooseMatchKernel(void);
+int matchKernelSupported(int kernel);
+int containsIgnoreCase(const char *text, const char *term, size_t termLength);
+int benchmarkKernels(int numRows);
+void catalogIndexesUpdate(struct catalog *catalog, int row, struct book *oldBook, struct book *newBook);
+int catalogIndexesReady(struct catalog *catalog);
+int yearFind(struct year_index *index, int year);
+int yearAdd(struct year_index *index, int row, int year);
+void yearRemove(struct year_index *index, int row, int year);
+int yearIndexReady(struct catalog *catalog);
+void yearIndexUpdate(struct catalog *catalog, int row, struct book *oldBook, struct book *newBook);
+void yearIndexFree(struct catalog *catalog);
+int yearCursorStart(struct catalog *catalog, struct year_cursor *cursor, int fromYear, int toYear);
+int yearCursorNext(struct catalog *catalog, struct year_cursor *cursor);
+void parseYearRange(char *term, int *fromYear, int *toYear);
+int dueBefore(struct due_entry *a, struct due_entry *b);
+void dueSiftUp(struct due_index *index, int pos);
+void dueSiftDown(struct due_index *index, int pos);
+int dueAdd(struct due_index *index, int row, int due);
+void dueRemove(struct due_index *index, int row);
+int dueIndexReady(struct catalog *catalog);
+void dueIndexUpdate(struct catalog *catalog, int row, struct book *oldBook, struct book *newBook);
+void dueIndexFree(struct catalog *catalog);
+int* findDueBooks(struct catalog *catalog, int before, int *numMatches);
+struct patron_loans* patronFind(struct patron_index *index, uint32_t name, int create);
+int patronAdd(struct patron_index *index, int row, uint32_t name);
+void patronRemove(struct patron_index *index, int row, uint32_t name);
+int patronIndexReady(struct catalog *catalog);
+void patronIndexUpdate(struct catalog *catalog, int row, struct book *oldBook, struct book *newBook);
+void patronIndexFree(struct catalog *catalog);
+int historyMonth(int date);
+int historyFilePath(struct loan_history *history, int month, char *path);
+struct loan_history* historyOpen(char *fileName);
+int historyAppend(struct loan_history *history, struct loan_record *record);
+int historySync(struct loan_history *history);
+void historyClose(struct loan_history *history);
+struct loan_record* historyLoad(struct loan_history *history, int month, int *numRecords);
+struct loan_count* loanCountFind(struct loan_counts *counts, uint32_t key, int create);
+int loanCountAdd(struct loan_counts *counts, uint32_t key, long long loans, long long returns, long long daysOut);
+uint32_t loanAuthor(struct catalog *catalog, const char *author);
+int loanStatsReady(struct catalog *catalog);
+void loanStatsBorrow(struct catalog *catalog, struct book *book, int sign);
+void loanStatsMoveAuthor(struct catalog *catalog, int id, const char *fromAuthor, const char *toAuthor);
+void loanReturned(struct catalog *catalog, struct book *book, struct mutation *mutation);
+void loanStatsFree(struct catalog *catalog);
+int compareLoanCounts(const void *a, const void *b);
+struct loan_count* loanTop(struct loan_counts *counts, int n, struct catalog *catalog, int *numTop);
+int compareFolded(const char *a, const char *b);
+void sortKeyOfRow(struct catalog *catalog, int field, int row, struct sort_key *key);
+void sortKeyOfBook(int field, struct book *book, struct sort_key *key);
+int compareSortKeys(const struct sort_key *a, const struct sort_key *b);
+int compareSortEntries(const void *a, const void *b);
+int sortFind(struct catalog *catalog, int field, struct sort_key *key, int skipRow, int *blockNum);
+int sortAdd(struct catalog *catalog, int field, int row);
+void sortRemove(struct catalog *catalog, int field, int row, struct sort_key *key);
+int sortOrderReady(struct catalog *catalog, int field);
+int sortOrdersReady(struct catalog *catalog);
+void sortOrdersUpdate(struct catalog *catalog, int row, struct book *oldBook, struct book *newBook);
+void sortOrderFree(struct catalog *catalog, int field);
+void sortOrdersFree(struct catalog *catalog);
+int sortFieldFromName(const char *name);
+void pageCursorStart(struct page_cursor *cursor, int field);
+void pageCursorEncode(struct page_cursor *cursor, char *text);
+int pageCursorDecode(const char *text, struct page_cursor *cursor);
+int* sortPage(struct catalog *catalog, struct page_cursor *cursor, int size, int *numRows, int *more);
+struct patron_loans* patronLoans(struct catalog *catalog, const char *name);
+int patronLoanCount(struct catalog *catalog, const char *name);
+int compareRows(const void *a, const void *b);
+int compareDueEntries(const void *a, const void *b);
+int* scanLoans(struct catalog *catalog, int *numMatches);
+int* findPatronBooks(struct catalog *catalog, const char *name, int before, int *numMatches);
+const char* parseQuery(char *text, int current_date, struct query *query);
+void describePredicate(struct predicate *predicate, char *buffer, size_t size);
+long long trigramEstimate(struct trigram_index *index, const char *term);
+long long yearEstimate(struct catalog *catalog, int fromYear, int toYear);
+void planConjunction(struct catalog *catalog, struct conjunction *conjunction, struct query_plan *plan);
+int rowMatches(struct catalog *catalog, int row, struct conjunction *conjunction, int current_date);
+int* runConjunction(struct catalog *catalog, struct query *query, struct conjunction *conjunction, struct query_plan *plan, int *numMatches);
+int* runQuery(struct catalog *catalog, struct query *query, struct query_plan *plans, int *numMatches);
+const char* accessPathName(int path);
+void explainQuery(FILE *out, struct query *query, struct query_plan *plans);
+int getDate(void);
+void writerInit(struct text_writer *writer, FILE *out);
+void writerFlush(struct text_writer *writer);
+void writerBook(struct text_writer *writer, struct catalog *catalog, int row);
+void printBooks(struct catalog *catalog);
+int askForBook(struct catalog *catalog, char *prompt);
+int dateFromCalendar(int year, int month, int day);
+void dateToCalendar(int date, int *year, int *month, int *day);
+int dateToday(void);
+int string_to_date(const char *stringFormatted, int *date);
+char* date_to_string(int date, char *buffer);
+long localOffset(long long seconds);
+void dateCacheInit(struct date_cache *cache);
+long dateOffset(struct date_cache *cache, long long seconds);
+int dateFromSeconds(struct date_cache *cache, long long seconds);
+long long dateToSeconds(struct date_cache *cache, int date);
+void borrowBook(struct catalog *catalog, int current_date);
+void returnBook(struct catalog *catalog, int current_date);
+void addBook(struct catalog *catalog, int current_date);
+void deleteBook(struct catalog *catalog);
+void editBook(struct catalog *catalog, int current_date);
+void saveFile(char* fileName, struct catalog *catalog);
+int writeDatabase(char *fileName, struct catalog *catalog);
+void searchBooks(struct catalog *catalog, int current_date);
+void checkBooks(struct catalog *catalog, int current_date);
+int splitFields(char *line, char **fields, int maxFields);
+int parseField(char *field, int *value);
+int textFieldValid(char *field);
+int batchFindBook(struct catalog *catalog, char *field);
+int batchOk(FILE *out);
+int batchError(FILE *out, const char *message);
+void batchWriteBook(FILE *out, struct catalog *catalog, int row);
+void batchWriteLoan(FILE *out, struct catalog *catalog, int row, int current_date);
+int batchIsChange(char *command);
+int batchIsReport(char *command);
+const char* batchPrepare(struct catalog *catalog, char **fields, int numFields, int current_date, struct mutation *mutation);
+int batchChangeResult(FILE *out, struct mutation *mutation, int success);
+int batchQuery(struct catalog *catalog, char **fields, int numFields, FILE *out, int *current_date);
+int batchMetric(char *command);
+int batchTimedQuery(struct catalog *catalog, char **fields, int numFields, FILE *out, int *current_date);
+int batchCommand(struct catalog *catalog, char *line, FILE *out, int *current_date);
+int runBatch(char *fileName, char *inName, char *outName);
+uint64_t importHash(const char *title, const char *author, int pub_year);
+int importSameText(const char *a, const char *b);
+int importSetAdd(struct import_set *set, uint64_t hash, int id);
+int importSetReady(struct import_set *set, struct catalog *catalog);
+int importSetFind(struct import_set *set, struct catalog *catalog, struct mutation *batch, int firstBatchId, struct book *book, uint64_t hash);
+int importCommit(struct catalog *catalog, struct mutation *batch, int numBatch);
+int importBooks(struct catalog *catalog, char *importName, int batchBooks, int current_date, struct import_stats *stats);
+int runImport(char *fileName, char *importName, int batchBooks);
+uint64_t benchRandom(uint64_t *state);
+int benchSkewed(uint64_t *state, int n);
+int benchGenerate(char *fileName, int numRows);
+void benchRecord(struct bench_result *results, int *numResults, const char *name, int rows, int ops, double seconds);
+int benchScale(int numRows, struct bench_result *results, int *numResults);
+int runBenchmarks(char *scales, char *baselineName);
+#ifndef _WIN32
+void serverSignal(int signal);
+int writeAll(int fd, const char *data, size_t size);
+void serverCommand(struct server *server, struct connection *connection, char *line, FILE *out);
+void* serverWorker(void *argument);
+int runServer(char *fileName, char *socketPath);
+int serverConnect(char *socketPath);
+int serverRequest(int fd, const char *command, char *buffer, size_t bufferSize, size_t *length);
+void* loadTestClient(void *argument);
+int compareDoubles(const void *a, const void *b);
+int runLoadTest(char *socketPath, int maxClients, double seconds, int numReporters);
+#endif
+
+// Search kernels (each checks if a 51 char book field contains a term, ignoring case; the fastest one the CPU supports is used)
+struct match_kernel {
+    const char *name;
+    int (*function)(const char *text, const char *term, size_t termLength);
+};
+static const struct match_kernel matchKernels[] = {
+    {"scalar", containsScalar},
+#ifdef HAVE_X86_KERNELS
+    {"sse2", containsSse2},
+    {"avx2", containsAvx2},
+#endif
+    {NULL, NULL}
+};
+static int (*fieldContains)(const char *text, const char *term, size_t termLength) = containsScalar;        // Kernel in use
 
 // Main
-void main(void){
+int main(int argc, char *argv[]){
+
+    // Set max time between checkpoints (folds of the journal into the database file, in the background), and how often metrics are written to a file, if asked to, before any other option
+    while(argc >= 3 && (strcmp(argv[1], "--checkpoint") == 0 || strcmp(argv[1], "--metrics") == 0)){
+        if(strcmp(argv[1], "--checkpoint") == 0){
+            checkpointSeconds = atoi(argv[2]);
+        }
+        else{
+            metricsSeconds = atoi(argv[2]);
+        }
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
+
+    // Convert between database file and snapshot file if asked to (instead of running program)
+    if(argc == 4 && strcmp(argv[1], "--to-snapshot") == 0){
+        return convertFile(argv[2], argv[3], 1) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if(argc == 4 && strcmp(argv[1], "--to-csv") == 0){
+        return convertFile(argv[2], argv[3], 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Run search kernel microbenchmark if asked to
+    if(argc >= 2 && strcmp(argv[1], "--bench-kernels") == 0){
+        return benchmarkKernels(argc >= 3 ? atoi(argv[2]) : 1000000) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Run metrics microbenchmark (cost of counting an operation) if asked to
+    if(argc >= 2 && strcmp(argv[1], "--bench-metrics") == 0){
+        return benchmarkMetrics(argc >= 3 ? atoi(argv[2]) : 10000000) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Run benchmark suite (on synthetic catalogs of each size given, comparing to a baseline results file if given), or just write a synthetic catalog, if asked to
+    if(argc >= 2 && strcmp(argv[1], "--bench") == 0){
+        return runBenchmarks(argc >= 3 ? argv[2] : "1000000", argc >= 4 ? argv[3] : NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if(argc == 4 && strcmp(argv[1], "--generate") == 0){
+        return benchGenerate(argv[3], atoi(argv[2])) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
     char fileName[] = "data.txt";       // File name to be read from
-    int maxRowLength = 500;     // Max length for row in CSV file
-    int maxRows = 100;      // Max number of rows in CSV file
-    struct book books[maxRows];     // Array of structures for data to be read to
-    int numRows;
 
-    int file_successfully_read = csvToStructs(fileName, maxRowLength, maxRows, books, &numRows);     // Read data to the structure from txt file (in CSV format)
+    // Split database file into shard files (or join them back into one) if asked to
+    if(argc >= 3 && strcmp(argv[1], "--reshard") == 0){
+        return reshardDatabase(argc >= 4 ? argv[3] : fileName, atoi(argv[2])) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Write metrics to "data.txt.metrics" every metricsSeconds seconds if asked to
+    if(metricsSeconds > 0 && !metricsStart(fileName)){
+        fprintf(stderr, "Metrics cannot be written to a file.\n");
+    }
+
+    // Add books from an external CSV file (title,author,pub_year lines) if asked to
+    if(argc >= 3 && strcmp(argv[1], "--import") == 0){
+        return runImport(fileName, argv[2], argc >= 4 ? atoi(argv[3]) : IMPORT_BATCH_BOOKS) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Run batch of commands (from file or stdin) instead of menus if asked to
+    if(argc >= 2 && strcmp(argv[1], "--batch") == 0){
+        return runBatch(fileName, argc >= 3 && strcmp(argv[2], "-") != 0 ? argv[2] : NULL, argc >= 4 ? argv[3] : NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+#ifndef _WIN32
+    // Serve many clients over a Unix domain socket (until stopped with Ctrl+C), or load test a running server, if asked to
+    if(argc >= 2 && strcmp(argv[1], "--serve") == 0){
+        return runServer(fileName, argc >= 3 ? argv[2] : "data.txt.sock") ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if(argc >= 2 && strcmp(argv[1], "--load-test") == 0){
+        return runLoadTest(argc >= 3 ? argv[2] : "data.txt.sock", argc >= 4 ? atoi(argv[3]) : 16, argc >= 5 ? atof(argv[4]) : 2, argc >= 6 ? atoi(argv[5]) : 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+#endif
+
+    struct catalog catalog;     // Catalog for data to be read to
+    struct load_stats load_stats;       // Information about how fast file was read
+    catalogInit(&catalog);
+
+    int file_successfully_read = loadCatalog(fileName, &catalog, &load_stats);     // Read data to the catalog from txt file (in CSV format), or its snapshot if up to date
 
     if(file_successfully_read){     // If file has been read
-        printf("Database file, \"%s\", successfully read.\n\n", fileName);      // Tell user
+        printf("Database file, \"%s\", successfully read.\n", fileName);      // Tell user
+        printf("%d books loaded (%.1f KB of memory used).\n", catalog.numRows, catalogMemoryUsage(&catalog)/1024.0);
+        printf("Read %.1f KB from %s in %.3f s using %d threads (%.0f rows/s, %.1f MB/s).\n\n", load_stats.bytes/1024.0, load_stats.fromSnapshot ? "snapshot" : "CSV file", load_stats.seconds, load_stats.threads,
+            load_stats.rows / (load_stats.seconds > 0 ? load_stats.seconds : 1e-9), load_stats.bytes / 1048576.0 / (load_stats.seconds > 0 ? load_stats.seconds : 1e-9));
+
+        // Open journal (replays changes made since database file was last written), so changes are saved as they are made
+        catalog.journal = journalOpen(fileName, &catalog);
+        if(catalog.journal == NULL){
+            printf("Journal file cannot be opened. Changes will only be saved on quit.\n\n");
+        }
 
-        time_t current_date = getDate();        // Get current date
+        int current_date = getDate();        // Get current date
 
         int running = 1;        // Set running variable (used for exiting program)
         while(running){     // Repeat until user quits program
@@ -90,633 +1013,7508 @@ void main(void){
             // Run function associated to user's choice/set running to 0 (quit program)
             switch(choice){
                 case 's':
-                    searchBooks(books, &numRows, current_date);
+                    searchBooks(&catalog, current_date);
                     break;
                 case 'l':
-                    printBooks(books, numRows);
+                    printBooks(&catalog);
                     break;
                 case 'a':
-                    addBook(books, &numRows, current_date);
+                    addBook(&catalog, current_date);
                     break;
                 case 'c':
-                    checkBooks(books, &numRows, current_date);
+                    checkBooks(&catalog, current_date);
                     break;
                 case 'q':
-                    saveFile(fileName, books, numRows);
+                    saveFile(fileName, &catalog);
                     running = 0;
                     break;
             }
         }
+        if(catalog.journal != NULL){
+            journalClose(catalog.journal);      // Make sure journal is on disk
+        }
     }
     else{       // Error message if file not found
         printf("Database file, \"%s\", cannot be found.", fileName);
     }
+    catalogFree(&catalog);      // Free catalog memory
+    return EXIT_SUCCESS;
 }
 
-// Convert txt file in CSV format into array of book structures
-int csvToStructs(char* fileName, int maxRowLength, int maxRows, struct book *books, int *numRows) {
-
-    // Open file
-    FILE* fin;
-
-    // If file can be found
-    if(fin = fopen(fileName, "r")) {
-
-        char row[maxRowLength];     // Make temporary row storage
-        char * currentValue;        // Make temporary current value storage
-        int rowNum = 0;      // Set up array iterator
-
-        fgets(row, maxRowLength, fin);      // Skip past first row (column headings)
-        while( fgets(row, maxRowLength, fin) != NULL){      // Read rows until end of file
-            currentValue = strtok(row, ",");        // Split row by "," delimeter
-
-            // Copy data to relevant part of structure, then split by next "," delimeter
-            books[rowNum].index = atoi(currentValue); currentValue = strtok(NULL, ",\n");
-            strcpy(books[rowNum].title, currentValue); currentValue = strtok(NULL, ",\n");
-            strcpy(books[rowNum].author, currentValue); currentValue = strtok(NULL, ",\n");
-            books[rowNum].pub_year = atoi(currentValue); currentValue = strtok(NULL, ",\n");
-            books[rowNum].date_added = atoi(currentValue); currentValue = strtok(NULL, ",\n");
-            books[rowNum].date_out = atoi(currentValue); currentValue = strtok(NULL, ",\n");
-            books[rowNum].date_due = atoi(currentValue); currentValue = strtok(NULL, ",\n");
-            strcpy(books[rowNum].name, currentValue);
+// Set up an empty catalog
+void catalogInit(struct catalog *catalog){
+    catalog->chunks = NULL;
+    catalog->strings = NULL;
+    catalog->numChunks = 0;
+    catalog->maxChunks = 0;
+    catalog->numRows = 0;
+    catalog->freeRows = NULL;
+    catalog->numFree = 0;
+    catalog->maxFree = 0;
+    memset(&catalog->ids, 0, sizeof(catalog->ids));
+    catalog->nextId = 0;
+    catalog->numShards = 1;
+    catalog->journal = NULL;
+    catalog->snapshot = NULL;
+    memset(&catalog->search, 0, sizeof(catalog->search));
+    memset(&catalog->years, 0, sizeof(catalog->years));
+    memset(&catalog->due, 0, sizeof(catalog->due));
+    memset(&catalog->patrons, 0, sizeof(catalog->patrons));
+    catalog->history = NULL;
+    memset(&catalog->loans, 0, sizeof(catalog->loans));
+    memset(catalog->sorts, 0, sizeof(catalog->sorts));
+}
 
-            rowNum++;       // Go to next index in array
-        }
-        *numRows = rowNum;      // Set numRows (used throughout)
-        fclose(fin);        // Close file
-        return 1;       // Return 1 (successfully read)
-    }
-    else {
-        return 0;       // Return 0 (unsuccessfully read)
+// Get chunk that holds given row of catalog (row % CATALOG_CHUNK_ROWS is its position in the chunk's arrays)
+struct catalog_chunk* catalogChunk(struct catalog *catalog, int row){
+    struct catalog_chunk *chunk = catalog->chunks[row / CATALOG_CHUNK_ROWS];
+    if(chunk == NULL){      // Chunk not read from snapshot file yet
+        chunk = snapshotLoadChunk(catalog, row / CATALOG_CHUNK_ROWS);
     }
+    return chunk;
 }
 
-time_t getDate(void){
-    system("cls");      // Clear screen
+// Get ID of book in given row of catalog (BOOK_DELETED if row is deleted)
+int catalogId(struct catalog *catalog, int row){
+    return catalogChunk(catalog, row)->index[row % CATALOG_CHUNK_ROWS];
+}
 
-    // Get current date (from computer's time)
-    time_t current_date = time(NULL);
-    localtime(&current_date);
+// Get pointer to text of book in given row of catalog
+struct book_text* catalogText(struct catalog *catalog, int row){
+    return &catalogChunk(catalog, row)->text[row % CATALOG_CHUNK_ROWS];
+}
 
-    // Check that is correct date
-    char choice;
-    do{
-        printf("Todays date is: %s\nIs this correct? (y/n)\n", time_to_string(current_date));
-        fflush(stdin);
-        scanf("%c", &choice);
-    } while(!(choice=='y' || choice=='n'));      // Ensure user picks one of the options
+// Copy book in given row of catalog out into a book structure
+void catalogRead(struct catalog *catalog, int row, struct book *book){
+    struct catalog_chunk *chunk = catalogChunk(catalog, row);
+    int i = row % CATALOG_CHUNK_ROWS;
+    struct book_text *text = &chunk->text[i];
+    book->index = chunk->index[i];
+    strcpy(book->title, text->title);
+    strcpy(book->author, stringGet(catalog->strings, text->author));
+    book->pub_year = chunk->pub_year[i];
+    book->date_added = text->date_added;
+    book->date_out = chunk->date_out[i];
+    book->date_due = chunk->date_due[i];
+    strcpy(book->name, stringGet(catalog->strings, text->name));
+}
 
-    printf("\n");
+// Store book structure in given row of catalog, returning 0 if out of memory (row is then left as it was)
+int catalogWrite(struct catalog *catalog, int row, const struct book *book){
+    uint32_t author = stringIntern(catalog->strings, book->author);
+    uint32_t name = stringIntern(catalog->strings, book->name);
+    struct catalog_chunk *chunk = catalogChunkForWrite(catalog, row);
+    if(author == STRING_NONE || name == STRING_NONE || chunk == NULL){
+        return 0;
+    }
+    int i = row % CATALOG_CHUNK_ROWS;
+    struct book_text *text = &chunk->text[i];
+    chunk->index[i] = book->index;
+    strcpy(text->title, book->title);
+    text->author = author;
+    chunk->pub_year[i] = book->pub_year;
+    text->date_added = book->date_added;
+    chunk->date_out[i] = book->date_out;
+    chunk->date_due[i] = book->date_due;
+    text->name = name;
+    return 1;
+}
 
-    if(choice == 'n'){      // If date not correct
-        int newDay, newMonth, newYear;
-        char newDate[11];
-        do{
-            // Get dd/mm/yyyy data from user
-            do{
-                printf("Day (dd): ");
-                fflush(stdin); scanf("%d", &newDay);
-            } while(!(newDay>=1 && newDay <= 31));
-            do{
-                printf("Month (mm): ");
-                fflush(stdin); scanf("%d", &newMonth);
-            } while(!(newMonth>=1 && newMonth <= 12));
-            do{
-                printf("Year (yyyy): ");
-                fflush(stdin); scanf("%d", &newYear);
-            } while(!(newYear>=2023 && newYear < 2038));
+// Copy book from one row to another (in the same catalog, or a copy of it sharing its string pool; the chunk written to must not be shared)
+void catalogCopyRow(struct catalog *from, int fromRow, struct catalog *to, int toRow){
+    struct catalog_chunk *fromChunk = catalogChunk(from, fromRow), *toChunk = catalogChunk(to, toRow);
+    int i = fromRow % CATALOG_CHUNK_ROWS, j = toRow % CATALOG_CHUNK_ROWS;
+    toChunk->index[j] = fromChunk->index[i];
+    toChunk->pub_year[j] = fromChunk->pub_year[i];
+    toChunk->date_out[j] = fromChunk->date_out[i];
+    toChunk->date_due[j] = fromChunk->date_due[i];
+    toChunk->text[j] = fromChunk->text[i];
+}
 
-            // Store new dd//mm/yyyy, making sure right # digits used
-            snprintf(newDate, 11, "%.2d/%.2d/%.4d", newDay, newMonth, newYear);
+// Get chunk that holds given row of catalog, ready to be changed (if it is shared with a copy being saved, the catalog gets its own copy of it first)
+// Returns NULL if out of memory
+struct catalog_chunk* catalogChunkForWrite(struct catalog *catalog, int row){
+    struct catalog_chunk *chunk = catalogChunk(catalog, row);
+    if(__atomic_load_n(&chunk->references, __ATOMIC_ACQUIRE) == 1){     // (only this catalog has it, and a copy can only be made by this thread)
+        return chunk;
+    }
+    struct catalog_chunk *copy = malloc(sizeof(struct catalog_chunk));
+    if(copy == NULL){
+        return NULL;
+    }
+    memcpy(copy, chunk, sizeof(struct catalog_chunk));
+    copy->references = 1;
+    catalog->chunks[row / CATALOG_CHUNK_ROWS] = copy;
+    catalogChunkRelease(chunk);
+    return copy;
+}
 
-        } while(strcmp(newDate, time_to_string(string_to_time(newDate))));      // Repeat until date is valid (convert to string form and back, and check it is the same)
-        current_date = string_to_time(newDate);     // Current date variable
-        printf("\n");
+// Stop using chunk, freeing it once no catalog uses it
+void catalogChunkRelease(struct catalog_chunk *chunk){
+    if(chunk != NULL && __atomic_sub_fetch(&chunk->references, 1, __ATOMIC_ACQ_REL) == 0){
+        free(chunk);
     }
-    return current_date;        // Return current date
 }
 
-void printBooks(struct book *books, int numRows){
-    system("cls");
-    // Repeat # times as there are rows, printing all data for each
-    for(int i=0; i<numRows; i++){
-        printf("Book %d\n", books[i].index+1);
-        printf("Title: %s\n", books[i].title);
-        printf("Author: %s\n", books[i].author);
-        printf("Publication year: %d\n", books[i].pub_year);
-        printf("Date added: %s\n", time_to_string(books[i].date_added));
-        printf("Status: ");
+// Make sure chunk pointer table has room for numChunks chunks, returning 0 if out of memory
+int catalogReserveChunkTable(struct catalog *catalog, int numChunks){
+    if(catalog->strings == NULL && (catalog->strings = stringPoolCreate()) == NULL){     // (made along with the first chunk)
+        return 0;
+    }
 
-        // Check if book is out at the moment (if true, would have a date out)
-        if(books[i].date_out != 0){
-            printf("Out\n");
-        }
-        else{
-            printf("Available\n");
+    // Double size of chunk pointer table until it is big enough (only the pointers move, never the books)
+    int newMaxChunks = catalog->maxChunks ? catalog->maxChunks : 16;
+    while(newMaxChunks < numChunks){
+        newMaxChunks *= 2;
+    }
+    if(newMaxChunks != catalog->maxChunks){
+        struct catalog_chunk **newChunks = realloc(catalog->chunks, newMaxChunks * sizeof(struct catalog_chunk*));
+        if(newChunks == NULL){
+            return 0;
         }
-        printf("\n");
+        catalog->chunks = newChunks;
+        catalog->maxChunks = newMaxChunks;
     }
-
-    // Allow user to return to main menu
-    printf("[q] Go back\n");
-    char input;
-    do{
-        fflush(stdin);
-        input = getchar();
-    } while(input != 'q');
+    return 1;
 }
 
-int string_to_time(char* stringFormatted){
-    // Split date into variables
-    int dd, mm, yyyy;
-    sscanf_s(stringFormatted, "%d/%d/%d", &dd, &mm, &yyyy);
+// Make sure catalog has room for numRows rows (without changing number of rows), returning 0 if out of memory
+int catalogReserve(struct catalog *catalog, int numRows){
+    while(numRows > catalog->numChunks * CATALOG_CHUNK_ROWS){     // While all chunks are full
+        if(!catalogReserveChunkTable(catalog, catalog->numChunks + 1)){
+            return 0;
+        }
 
-    // Split put date into tm struct
-    struct tm when = {0};
-    when.tm_mday = dd;
-    when.tm_mon = mm - 1;
-    when.tm_year = yyyy - 1900;
+        // Allocate next chunk
+        struct catalog_chunk *chunk = malloc(sizeof(struct catalog_chunk));
+        if(chunk == NULL){
+            return 0;
+        }
+        chunk->references = 1;
+        catalog->chunks[catalog->numChunks] = chunk;
+        catalog->numChunks++;
+    }
+    return 1;
+}
 
-    // Convert into time_t form
-    time_t converted;
-    converted = mktime(&when);
+// Add a new row to the end of the catalog, returning the row (-1 if out of memory)
+int catalogAppend(struct catalog *catalog){
+    if(!catalogReserve(catalog, catalog->numRows + 1)){
+        return -1;
+    }
+    return catalog->numRows++;
+}
 
-    return converted;       // return converted time
+// Get number of bytes of memory used by catalog
+size_t catalogMemoryUsage(struct catalog *catalog){
+    size_t usage = sizeof(struct catalog) + catalog->maxChunks * sizeof(struct catalog_chunk*);
+    for(int i=0; i<catalog->numChunks; i++){
+        if(catalog->chunks[i] != NULL){     // (chunks still in snapshot file do not use any memory)
+            usage += sizeof(struct catalog_chunk);
+        }
+    }
+    usage += catalog->maxFree * sizeof(int) + catalog->ids.size * sizeof(struct id_entry);
+    if(catalog->strings != NULL){
+        usage += sizeof(struct string_pool) + (size_t)catalog->strings->numBlocks * (STRING_BLOCK_SIZE + STRING_BLOCK_PADDING) + catalog->strings->numSlots * 2 * sizeof(uint32_t);
+    }
+    return usage;
 }
 
-char* time_to_string(time_t timetFormatted){
-    // Convert from time_t form
-    struct tm *giverTime;
-    giverTime = localtime(&timetFormatted);
+// Free all memory used by catalog
+void catalogFree(struct catalog *catalog){
+    for(int i=0; i<catalog->numChunks; i++){
+        catalogChunkRelease(catalog->chunks[i]);
+    }
+    free(catalog->chunks);
+    stringPoolRelease(catalog->strings);
+    free(catalog->freeRows);
+    idMapFree(catalog);
+    searchIndexFree(catalog);
+    yearIndexFree(catalog);
+    dueIndexFree(catalog);
+    patronIndexFree(catalog);
+    loanStatsFree(catalog);
+    sortOrdersFree(catalog);
+    if(catalog->history != NULL){
+        historyClose(catalog->history);
+    }
+    if(catalog->snapshot != NULL){
+        snapshotClose(catalog->snapshot);
+    }
+    catalogInit(catalog);
+}
 
-    // Split into different variables
-    struct tm given = {0};
-    given.tm_mday = giverTime->tm_mday;
-    given.tm_mon = giverTime->tm_mon+1; /* simply add instead of increment */
-    given.tm_year = giverTime->tm_year+1900;
+// Make an empty string pool, returning NULL if out of memory
+struct string_pool* stringPoolCreate(void){
+    struct string_pool *pool = calloc(1, sizeof(struct string_pool));
+    if(pool == NULL){
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->references = 1;
+    if(stringIntern(pool, "") != STRING_EMPTY){      // (so tombstones can always be written)
+        stringPoolRelease(pool);
+        return NULL;
+    }
+    return pool;
+}
 
-    // Form string again
-    char* converted = malloc(11);
-    snprintf(converted, 11, "%.2d/%.2d/%.4d", given.tm_mday, given.tm_mon, given.tm_year);
+// Stop using string pool (shared by a catalog and its copies), freeing it once nothing uses it
+void stringPoolRelease(struct string_pool *pool){
+    if(pool == NULL || __atomic_sub_fetch(&pool->references, 1, __ATOMIC_ACQ_REL) > 0){
+        return;
+    }
+    for(int i=0; i<pool->numBlocks; i++){
+        free(pool->blocks[i]);
+    }
+    free(pool->slots);
+    free(pool->hashes);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
 
-    return converted;       // Return converted time
+// Get text of string from its handle
+const char* stringGet(struct string_pool *pool, uint32_t handle){
+    return pool->blocks[handle >> STRING_BLOCK_BITS] + (handle & (STRING_BLOCK_SIZE - 1));
 }
 
-void addBook(struct book *books, int *numRows, time_t current_date){
-    system("cls");
+// Hash text (FNV-1a)
+uint32_t stringHash(const char *text){
+    uint32_t hash = 2166136261u;
+    for(; *text != '\0'; text++){
+        hash = (hash ^ (unsigned char)*text) * 16777619u;
+    }
+    return hash;
+}
 
-    // Add new index
-    int new_index = *numRows;
+// Find slot of text in hash set (the slot it would go in if it is not there)
+uint32_t stringSlot(struct string_pool *pool, const char *text, uint32_t hash){
+    uint32_t slot = hash & (pool->numSlots - 1);
+    while(pool->slots[slot] != STRING_NONE && (pool->hashes[slot] != hash || strcmp(stringGet(pool, pool->slots[slot]), text) != 0)){
+        slot = (slot + 1) & (pool->numSlots - 1);       // Linear probing
+    }
+    return slot;
+}
 
-    // User input for title (takes max 50 chars)
-    char new_title[51];
-    printf("Title (max 50 chars, cannot include ','): ");
-    fflush(stdin);
-    fgets(new_title,51,stdin);
-    int size = strlen(new_title);
-    new_title[size-1]='\0';     // Remove '\n' from end of string
+// Find handle of text without adding it (STRING_NONE if it is not in pool)
+uint32_t stringFind(struct string_pool *pool, const char *text){
+    pthread_mutex_lock(&pool->lock);
+    uint32_t handle = pool->numSlots ? pool->slots[stringSlot(pool, text, stringHash(text))] : STRING_NONE;
+    pthread_mutex_unlock(&pool->lock);
+    return handle;
+}
 
-    // User input for author (takes max 50 chars)
-    char new_author[51];
-    printf("Author (max 50 chars, cannot include ','): ");
-    fflush(stdin);
-    fgets(new_author,51,stdin);
-    size = strlen(new_author);
-    new_author[size-1]='\0';     // Remove '\n' from end of string
+// Get handle of text, adding it to pool if it is not there yet (STRING_NONE if out of memory)
+// Strings are never moved or removed, so handles (and pointers from stringGet) stay valid while other threads add strings
+uint32_t stringIntern(struct string_pool *pool, const char *text){
+    uint32_t hash = stringHash(text);
+    size_t length = strlen(text) + 1;
+    pthread_mutex_lock(&pool->lock);
 
-    // Get max year for publication date (current year)
-    time_t seconds=time(NULL);
-    struct tm* current_time=localtime(&seconds);
-    int maxYear = current_time->tm_year + 1900;
+    // Grow hash set (doubling) once it is half full
+    if((pool->count + 1) * 2 > pool->numSlots){
+        uint32_t newNumSlots = pool->numSlots ? pool->numSlots * 2 : 1024;
+        uint32_t *newSlots = malloc(newNumSlots * sizeof(uint32_t));
+        uint32_t *newHashes = malloc(newNumSlots * sizeof(uint32_t));
+        if(newSlots == NULL || newHashes == NULL){
+            free(newSlots);
+            free(newHashes);
+            pthread_mutex_unlock(&pool->lock);
+            return STRING_NONE;
+        }
+        memset(newSlots, 0xFF, newNumSlots * sizeof(uint32_t));     // (all STRING_NONE)
+        for(uint32_t i=0; i<pool->numSlots; i++){
+            if(pool->slots[i] != STRING_NONE){
+                uint32_t slot = pool->hashes[i] & (newNumSlots - 1);
+                while(newSlots[slot] != STRING_NONE){
+                    slot = (slot + 1) & (newNumSlots - 1);
+                }
+                newSlots[slot] = pool->slots[i];
+                newHashes[slot] = pool->hashes[i];
+            }
+        }
+        free(pool->slots);
+        free(pool->hashes);
+        pool->slots = newSlots;
+        pool->hashes = newHashes;
+        pool->numSlots = newNumSlots;
+    }
 
-    // Ask user for publication year
-    int new_pub_year;
-    do{
-        printf("Publication year (minimum 0 AD): ");
-        fflush(stdin); scanf("%d", &new_pub_year);        // Read max of 50 chars
-    } while(!(new_pub_year > 0 && new_pub_year < maxYear));     // Check within range (0-current year)
+    uint32_t slot = stringSlot(pool, text, hash);
+    if(pool->slots[slot] == STRING_NONE){
+        // Copy text to end of arena, starting a new block if it does not fit in the last one
+        if(pool->numBlocks == 0 || pool->used + length > STRING_BLOCK_SIZE){
+            char *block = pool->numBlocks < STRING_MAX_BLOCKS ? malloc(STRING_BLOCK_SIZE + STRING_BLOCK_PADDING) : NULL;
+            if(block == NULL){
+                pthread_mutex_unlock(&pool->lock);
+                return STRING_NONE;
+            }
+            memset(block + STRING_BLOCK_SIZE, 0, STRING_BLOCK_PADDING);
+            pool->blocks[pool->numBlocks++] = block;
+            pool->used = 0;
+        }
+        uint32_t handle = ((uint32_t)(pool->numBlocks - 1) << STRING_BLOCK_BITS) | pool->used;
+        memcpy(pool->blocks[pool->numBlocks - 1] + pool->used, text, length);
+        pool->used += length;
+        pool->slots[slot] = handle;
+        pool->hashes[slot] = hash;
+        pool->count++;
+    }
+    uint32_t handle = pool->slots[slot];
+    pthread_mutex_unlock(&pool->lock);
+    return handle;
+}
 
-    // Set other variables
-    int new_date_added = current_date;      // Set date added to be today's date
-    int new_date_out = 0;       // Set date out to be blank
-    int new_date_due = 0;       // Set date due to be black
-    char new_name[] = "0";      // Set name to be blank
-
-    // Copy all the data into next location the array of books
-    books[*numRows].index = new_index;
-    strcpy(books[*numRows].title, new_title);
-    strcpy(books[*numRows].author, new_author);
-    books[*numRows].pub_year = new_pub_year;
-    books[*numRows].date_added = new_date_added;
-    books[*numRows].date_out = new_date_out;
-    books[*numRows].date_due = new_date_due;
-    strcpy(books[*numRows].name, new_name);
-
-    // Update number of rows in database
-    *numRows = *numRows + 1;
-}
-
-void deleteBook(struct book *books, int *numRows){
-    // Get index for book to be deleted
-    int index_to_delete;
-    do{
-        printf("Index to delete: ");
-        fflush(stdin); scanf("%d", &index_to_delete);
-        index_to_delete -= 1;
-    } while(!(index_to_delete>=0 && index_to_delete<*numRows));     // Ensure in range of list of structs
-    printf("\n");
+// Get home position of book ID in ID map (table size is a power of 2)
+int idHome(struct id_map *map, int id){
+    return (int)(((uint32_t)id * 2654435761u) & (map->size - 1));
+}
 
-    // Print book info
-    printf("Title: %s\n", books[index_to_delete].title);
-    printf("Author: %s\n", books[index_to_delete].author);
-    printf("Publication year: %d\n", books[index_to_delete].pub_year);
-    printf("\n");
+// Find row of book ID in ID map (-1 if it is not there)
+int idMapFind(struct id_map *map, int id){
+    if(map->size == 0){
+        return -1;
+    }
+    for(int pos = idHome(map, id); map->entries[pos].id != -1; pos = (pos + 1) & (map->size - 1)){      // Probe until an empty entry
+        if(map->entries[pos].id == id){
+            return map->entries[pos].row;
+        }
+    }
+    return -1;
+}
 
-    // Check this is the right book
-    printf("Delete this book? (permanent) [y/n]\n");
-    char choice;
-    do{
-        fflush(stdin);
-        scanf("%c", &choice);
-    } while(!(choice=='y' || choice=='n'));      // Ensure user picks one of the options
+// Make sure ID map has room for count books (kept at most half full), returning 0 if out of memory
+int idMapReserve(struct id_map *map, int count){
+    if(count * 2 < map->size){
+        return 1;
+    }
+    int newSize = map->size ? map->size : 64;
+    while(count * 2 >= newSize){
+        newSize *= 2;
+    }
+    struct id_entry *newEntries = malloc(newSize * sizeof(struct id_entry));
+    if(newEntries == NULL){
+        return 0;
+    }
+    for(int i=0; i<newSize; i++){
+        newEntries[i].id = -1;
+    }
 
-    // If index is correct
-    if(choice == 'y'){
-        // Shift all books along one, up to the delete index
-        for(int i = index_to_delete; i < *numRows; i++){
-            books[i] = books[i + 1];
-            books[i].index = books[i].index-1;
+    // Move every entry to its place in the new table
+    struct id_map newMap = {map->built, newEntries, newSize, 0};
+    for(int i=0; i<map->size; i++){
+        if(map->entries[i].id != -1){
+            idMapPut(&newMap, map->entries[i].id, map->entries[i].row);
         }
-        *numRows -= 1;      // Update length of array
     }
-    printf("\n");
+    free(map->entries);
+    *map = newMap;
+    return 1;
 }
 
-void editBook(struct book *books, int *numRows, time_t current_date){
-    // Get index to edit from user
-    int index_to_edit;
-    do{
-        printf("Index to edit: ");
-        fflush(stdin); scanf("%d", &index_to_edit);
-        index_to_edit -= 1;     // -1 to get index for list of structs
-    } while(!(index_to_edit>=0 && index_to_edit<*numRows));     // Ensure in range
-    printf("\n");
-
+// Set row of book ID in ID map (room must already be reserved)
+void idMapPut(struct id_map *map, int id, int row){
+    int pos = idHome(map, id);
+    while(map->entries[pos].id != -1 && map->entries[pos].id != id){
+        pos = (pos + 1) & (map->size - 1);
+    }
+    if(map->entries[pos].id == -1){
+        map->count++;
+    }
+    map->entries[pos].id = id;
+    map->entries[pos].row = row;
+}
+
+// Remove book ID from ID map
+void idMapRemove(struct id_map *map, int id){
+    if(map->size == 0){
+        return;
+    }
+    int mask = map->size - 1;
+    int pos = idHome(map, id);
+    while(map->entries[pos].id != id){
+        if(map->entries[pos].id == -1){
+            return;     // Not in map
+        }
+        pos = (pos + 1) & mask;
+    }
+    map->count--;
+
+    // Move later entries of the same probe run back into the gap, so no lookup stops early (no tombstones needed in the map itself)
+    for(int next = (pos + 1) & mask; map->entries[next].id != -1; next = (next + 1) & mask){
+        int home = idHome(map, map->entries[next].id);
+        if(((next - home) & mask) >= ((next - pos) & mask)){        // Entry can move back to the gap (gap is between its home and where it is)
+            map->entries[pos] = map->entries[next];
+            pos = next;
+        }
+    }
+    map->entries[pos].id = -1;
+}
+
+// Make sure ID map has been built (it is built the first time a book is looked up or changed, then kept up to date by every change), returning 0 if out of memory
+int idMapReady(struct catalog *catalog){
+    struct id_map *map = &catalog->ids;
+    if(map->built){
+        return 1;
+    }
+    if(!idMapReserve(map, catalog->numRows - catalog->numFree)){
+        return 0;
+    }
+    int numDuplicates = 0;
+    for(int i=0; i<catalog->numRows; i++){
+        int id = catalogId(catalog, i);
+        if(id == BOOK_DELETED){        // Skip deleted rows
+            continue;
+        }
+        if(idMapFind(map, id) != -1){      // ID already used by an earlier book (database file edited by hand), so given a new ID below
+            numDuplicates++;
+            continue;
+        }
+        idMapPut(map, id, i);
+        if(id >= catalog->nextId){     // (never goes down, so IDs of books deleted this session are not reused)
+            catalog->nextId = id + 1;
+        }
+    }
+
+    // Give books with duplicate IDs new IDs after the highest one
+    for(int i=0; i<catalog->numRows && numDuplicates > 0; i++){
+        int *id = &catalogChunk(catalog, i)->index[i % CATALOG_CHUNK_ROWS];
+        if(*id != BOOK_DELETED && idMapFind(map, *id) != i){
+            struct catalog_chunk *chunk = catalogChunkForWrite(catalog, i);     // (chunk may be shared with a copy being saved)
+            if(chunk == NULL){
+                return 0;
+            }
+            id = &chunk->index[i % CATALOG_CHUNK_ROWS];
+            *id = catalog->nextId++;
+            idMapPut(map, *id, i);
+            numDuplicates--;
+        }
+    }
+    map->built = 1;
+    return 1;
+}
+
+// Free ID map
+void idMapFree(struct catalog *catalog){
+    free(catalog->ids.entries);
+    memset(&catalog->ids, 0, sizeof(catalog->ids));
+}
+
+// Find row of book with given ID (-1 if there is no such book, or out of memory)
+int catalogFind(struct catalog *catalog, int id){
+    if(id < 0 || !idMapReady(catalog)){
+        return -1;
+    }
+    return idMapFind(&catalog->ids, id);
+}
+
+// Get ID for a new book (-1 if out of memory)
+int catalogNewId(struct catalog *catalog){
+    if(!idMapReady(catalog)){
+        return -1;
+    }
+    return catalog->nextId;
+}
+
+// Get a row for a new book, reusing the row of a deleted book if there is one (-1 if out of memory)
+int catalogNewRow(struct catalog *catalog){
+    if(catalog->numFree > 0){
+        return catalog->freeRows[--catalog->numFree];
+    }
+    return catalogAppend(catalog);
+}
+
+// Mark row as deleted (a tombstone, reused by a later add), returning 0 if out of memory
+int catalogDeleteRow(struct catalog *catalog, int row){
+    if(catalogChunkForWrite(catalog, row) == NULL){        // (so writing the tombstone cannot fail)
+        return 0;
+    }
+    if(row < catalog->numRows - 1){     // Remember row so it can be reused (the last row is simply dropped)
+        if(catalog->numFree == catalog->maxFree){
+            int newMaxFree = catalog->maxFree ? catalog->maxFree * 2 : 64;
+            int *newFreeRows = realloc(catalog->freeRows, newMaxFree * sizeof(int));
+            if(newFreeRows == NULL){
+                return 0;
+            }
+            catalog->freeRows = newFreeRows;
+            catalog->maxFree = newMaxFree;
+        }
+        catalog->freeRows[catalog->numFree++] = row;
+    }
+    else{
+        catalog->numRows--;
+    }
+    struct book tombstone = {0};
+    idMapRemove(&catalog->ids, catalogId(catalog, row));
+    tombstone.index = BOOK_DELETED;
+    catalogWrite(catalog, row, &tombstone);
+    return 1;
+}
+
+// Move books down over deleted rows, so the catalog has no tombstones (every row moves, so indexes are rebuilt when next needed; nothing moves if out of memory)
+void catalogCompact(struct catalog *catalog){
+    for(int row=0; row<catalog->numRows; row+=CATALOG_CHUNK_ROWS){     // Every chunk may change, so none can be shared with a copy being saved
+        if(catalogChunkForWrite(catalog, row) == NULL){
+            return;     // (tombstones are left for a later delete to reclaim)
+        }
+    }
+    int numRows = 0;
+    for(int i=0; i<catalog->numRows; i++){
+        if(catalogId(catalog, i) != BOOK_DELETED){
+            if(numRows != i){
+                catalogCopyRow(catalog, i, catalog, numRows);
+            }
+            numRows++;
+        }
+    }
+    catalog->numRows = numRows;
+    catalog->numFree = 0;
+    searchIndexFree(catalog);
+    yearIndexFree(catalog);
+    dueIndexFree(catalog);
+    patronIndexFree(catalog);
+    sortOrdersFree(catalog);
+    idMapFree(catalog);
+}
+
+// Get number of processors available for worker threads
+int cpuCount(void){
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+#endif
+}
+
+// Get time in seconds from a monotonic clock (for measuring how long things take)
+double nowSeconds(void){
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+// Hand shard of a finished thread back, so the next thread to start counts in it
+void metricsThreadDone(void *shard){
+    pthread_mutex_lock(&metricsLock);
+    ((struct metrics_shard*)shard)->inUse = 0;
+    pthread_mutex_unlock(&metricsLock);
+}
+
+void metricsKeyInit(void){
+    pthread_key_create(&metricsKey, metricsThreadDone);
+}
+
+// Get shard for this thread to count in (one handed back by a finished thread, or a new one), returning NULL if out of memory
+struct metrics_shard* metricsShard(void){
+    pthread_once(&metricsOnce, metricsKeyInit);
+    pthread_mutex_lock(&metricsLock);
+    struct metrics_shard *shard = metricsShards;
+    while(shard != NULL && shard->inUse){
+        shard = shard->next;
+    }
+    if(shard == NULL && (shard = calloc(1, sizeof(struct metrics_shard))) != NULL){
+        shard->next = metricsShards;
+        metricsShards = shard;
+    }
+    if(shard != NULL){
+        shard->inUse = 1;
+    }
+    pthread_mutex_unlock(&metricsLock);
+    if(shard != NULL){
+        pthread_setspecific(metricsKey, shard);
+        threadMetrics = shard;
+    }
+    return shard;
+}
+
+// Add to a counter only this thread changes (a plain add, but never torn for a thread reading it)
+void metricAdd(uint64_t *counter, uint64_t value){
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+// Get histogram bucket for a latency (exact below 32 ns, then 16 buckets for each power of 2)
+int metricBucket(uint64_t nanoseconds){
+    if(nanoseconds < (1 << METRIC_SUB_BITS)){
+        return nanoseconds;
+    }
+    int exponent = 63 - __builtin_clzll(nanoseconds);
+    if(exponent > METRIC_MAX_EXPONENT){
+        return METRIC_BUCKETS - 1;
+    }
+    return ((exponent - METRIC_SUB_BITS + 1) << METRIC_SUB_BITS) + ((nanoseconds >> (exponent - METRIC_SUB_BITS)) & ((1 << METRIC_SUB_BITS) - 1));
+}
+
+// Get smallest latency that goes in a histogram bucket
+uint64_t metricBucketStart(int bucket){
+    if(bucket < (1 << METRIC_SUB_BITS)){
+        return bucket;
+    }
+    int exponent = (bucket >> METRIC_SUB_BITS) + METRIC_SUB_BITS - 1;
+    return (uint64_t)((1 << METRIC_SUB_BITS) + (bucket & ((1 << METRIC_SUB_BITS) - 1))) << (exponent - METRIC_SUB_BITS);
+}
+
+// Count an operation that started at start (from nowSeconds) and has just finished
+void metricsRecord(int op, double start, int success){
+    struct metrics_shard *shard = threadMetrics != NULL ? threadMetrics : metricsShard();
+    if(shard == NULL){
+        return;
+    }
+    double seconds = nowSeconds() - start;
+    uint64_t nanoseconds = seconds > 0 ? (uint64_t)(seconds * 1e9) : 0;
+    struct metric_histogram *histogram = &shard->ops[op];
+    metricAdd(&histogram->count, 1);
+    if(!success){
+        metricAdd(&histogram->errors, 1);
+    }
+    metricAdd(&histogram->totalNanoseconds, nanoseconds);
+    if(nanoseconds > histogram->maxNanoseconds){
+        __atomic_store_n(&histogram->maxNanoseconds, nanoseconds, __ATOMIC_RELAXED);
+    }
+    metricAdd(&histogram->buckets[metricBucket(nanoseconds)], 1);
+}
+
+// Add up counts of every thread (totals has METRIC_OPS histograms)
+void metricsRead(struct metric_histogram *totals){
+    memset(totals, 0, METRIC_OPS * sizeof(struct metric_histogram));
+    pthread_mutex_lock(&metricsLock);
+    for(struct metrics_shard *shard = metricsShards; shard != NULL; shard = shard->next){
+        for(int op=0; op<METRIC_OPS; op++){
+            struct metric_histogram *from = &shard->ops[op], *to = &totals[op];
+            to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+            to->errors += __atomic_load_n(&from->errors, __ATOMIC_RELAXED);
+            to->totalNanoseconds += __atomic_load_n(&from->totalNanoseconds, __ATOMIC_RELAXED);
+            uint64_t max = __atomic_load_n(&from->maxNanoseconds, __ATOMIC_RELAXED);
+            if(max > to->maxNanoseconds){
+                to->maxNanoseconds = max;
+            }
+            for(int i=0; i<METRIC_BUCKETS; i++){
+                to->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&metricsLock);
+}
+
+// Get latency (in nanoseconds) that the given fraction of operations took no longer than (middle of its bucket)
+double metricPercentile(struct metric_histogram *histogram, double fraction){
+    uint64_t target = (uint64_t)ceil(fraction * histogram->count), seen = 0;
+    for(int i=0; i<METRIC_BUCKETS && target > 0; i++){
+        seen += histogram->buckets[i];
+        if(seen >= target){
+            double middle = i == METRIC_BUCKETS - 1 ? histogram->maxNanoseconds : (metricBucketStart(i) + metricBucketStart(i + 1)) / 2.0;
+            return middle < histogram->maxNanoseconds ? middle : histogram->maxNanoseconds;
+        }
+    }
+    return 0;
+}
+
+// Write a line for each kind of operation: stat,name,count,errors,mean,p50,p90,p99,p99.9,max (times in microseconds), returning 0 if out of memory
+int metricsWrite(FILE *out){
+    struct metric_histogram *totals = malloc(METRIC_OPS * sizeof(struct metric_histogram));
+    if(totals == NULL){
+        return 0;
+    }
+    metricsRead(totals);
+    for(int op=0; op<METRIC_OPS; op++){
+        struct metric_histogram *histogram = &totals[op];
+        fprintf(out, "stat,%s,%llu,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", metricNames[op], (unsigned long long)histogram->count, (unsigned long long)histogram->errors,
+            histogram->count > 0 ? histogram->totalNanoseconds / 1000.0 / histogram->count : 0, metricPercentile(histogram, 0.5) / 1000, metricPercentile(histogram, 0.9) / 1000,
+            metricPercentile(histogram, 0.99) / 1000, metricPercentile(histogram, 0.999) / 1000, histogram->maxNanoseconds / 1000.0);
+    }
+    free(totals);
+    return 1;
+}
+
+// Write metrics to metrics file (to a temp file first, so it is never seen half written), returning 1 if successful
+int metricsWriteFile(void){
+    char tmpPath[MAX_PATH_LENGTH + 4];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", metricsPath);
+    FILE *file = fopen(tmpPath, "w");
+    if(file == NULL){
+        return 0;
+    }
+    fprintf(file, "time,%lld\n", (long long)time(NULL));
+    int success = metricsWrite(file);
+    success = fclose(file) == 0 && success;
+    return success && replaceFile(tmpPath, metricsPath);
+}
+
+// Stop thread that writes metrics file (waiting for any write it is doing), then write it one last time
+void metricsWriteAtExit(void){
+    pthread_mutex_lock(&metricsWriter.lock);
+    metricsWriter.stopping = 1;
+    pthread_cond_signal(&metricsWriter.wake);
+    pthread_mutex_unlock(&metricsWriter.lock);
+    pthread_join(metricsWriter.thread, NULL);
+    metricsWriteFile();
+}
+
+// Thread that writes metrics file every metricsSeconds seconds (until metricsWriteAtExit stops it)
+void* metricsTask(void *argument){
+    struct metrics_writer *writer = argument;
+    pthread_mutex_lock(&writer->lock);
+    while(!writer->stopping){
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += metricsSeconds;
+        while(!writer->stopping && pthread_cond_timedwait(&writer->wake, &writer->lock, &until) == 0){     // (woken early spuriously, or to stop)
+        }
+        if(writer->stopping){
+            break;
+        }
+        pthread_mutex_unlock(&writer->lock);
+        if(!metricsWriteFile()){
+            fprintf(stderr, "Metrics file, \"%s\", cannot be written.\n", metricsPath);
+        }
+        pthread_mutex_lock(&writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// Start writing metrics to "<database>.metrics" every metricsSeconds seconds, and once more when program ends, returning 1 if successful
+int metricsStart(char *fileName){
+    snprintf(metricsPath, MAX_PATH_LENGTH, "%s.metrics", fileName);
+    if(pthread_create(&metricsWriter.thread, NULL, metricsTask, &metricsWriter) != 0){
+        return 0;
+    }
+    atexit(metricsWriteAtExit);
+    return 1;
+}
+
+// Map whole file into memory (read only), returning 1 if successful
+int mapFile(char *fileName, struct mapped_file *map){
+    map->data = NULL;
+    map->size = 0;
+#ifdef _WIN32
+    map->file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    map->mapping = NULL;
+    if(map->file == INVALID_HANDLE_VALUE){
+        return 0;
+    }
+    LARGE_INTEGER size;
+    GetFileSizeEx(map->file, &size);
+    map->size = size.QuadPart;
+    if(map->size > 0){      // Empty files cannot be mapped (nothing to read anyway)
+        map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(map->mapping == NULL || (map->data = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0)) == NULL){
+            unmapFile(map);
+            return 0;
+        }
+    }
+#else
+    struct stat info;
+    if((map->fd = open(fileName, O_RDONLY)) < 0){
+        return 0;
+    }
+    if(fstat(map->fd, &info) != 0){
+        unmapFile(map);
+        return 0;
+    }
+    map->size = info.st_size;
+    if(map->size > 0){      // Empty files cannot be mapped (nothing to read anyway)
+        void *data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, map->fd, 0);
+        if(data == MAP_FAILED){
+            unmapFile(map);
+            return 0;
+        }
+        madvise(data, map->size, MADV_SEQUENTIAL);      // File is read front to back
+        map->data = data;
+    }
+#endif
+    return 1;
+}
+
+// Unmap file mapped by mapFile()
+void unmapFile(struct mapped_file *map){
+#ifdef _WIN32
+    if(map->data != NULL) UnmapViewOfFile(map->data);
+    if(map->mapping != NULL) CloseHandle(map->mapping);
+    if(map->file != INVALID_HANDLE_VALUE) CloseHandle(map->file);
+    map->file = INVALID_HANDLE_VALUE;
+    map->mapping = NULL;
+#else
+    if(map->data != NULL) munmap((void*)map->data, map->size);
+    if(map->fd >= 0) close(map->fd);
+    map->fd = -1;
+#endif
+    map->data = NULL;
+    map->size = 0;
+}
+
+// Parse whole number from text between start and end, returning 1 if it is a valid number
+int parseNumber(const char *start, const char *end, long long *value){
+    int negative = 0;
+    long long result = 0;
+    if(start < end && *start == '-'){       // Allow minus sign
+        negative = 1;
+        start++;
+    }
+    if(start == end){       // Must have at least one digit
+        return 0;
+    }
+    for(; start < end; start++){
+        if(*start < '0' || *start > '9' || result > (LLONG_MAX - 9) / 10){      // Only digits, and must fit in a long long
+            return 0;
+        }
+        result = result*10 + (*start - '0');
+    }
+    *value = negative ? -result : result;
+    return 1;
+}
+
+// Parse one CSV row (without its '\n') straight from the file into a book, returning NULL if successful or the reason it is not valid
+const char* parseRow(const char *start, const char *end, struct book *book, struct date_cache *dates){
+    const char *fields[CSV_FIELDS + 1];     // Start of each field (fields[i+1]-1 is the ',' ending field i)
+    int numFields = 0;
+
+    // Find where each field starts
+    fields[numFields++] = start;
+    for(const char *pos = start; pos < end; pos++){
+        if(*pos == ','){
+            if(numFields == CSV_FIELDS){
+                return "too many fields";
+            }
+            fields[numFields++] = pos + 1;
+        }
+    }
+    if(numFields != CSV_FIELDS){
+        return "too few fields";
+    }
+    fields[CSV_FIELDS] = end + 1;
+
+    // Copy data to relevant part of structure, checking every value fits
+    long long value;
+    const char *fieldEnd;
+    for(int i=0; i<CSV_FIELDS; i++){
+        fieldEnd = fields[i+1] - 1;
+        switch(i){
+            case 1: case 2: case 7: ;        // Text fields (title, author, name)
+                size_t length = fieldEnd - fields[i];
+                if(length > 50){
+                    return "text longer than 50 chars";
+                }
+                char *text = (i == 1) ? book->title : (i == 2) ? book->author : book->name;
+                memcpy(text, fields[i], length);
+                text[length] = '\0';
+                break;
+            default:        // Number fields
+                if(!parseNumber(fields[i], fieldEnd, &value)){
+                    return "invalid number";
+                }
+                if((i == 0 || i == 3) && (value < INT_MIN || value > INT_MAX)){
+                    return "number out of range";
+                }
+                if(i == 0 && value < 0){
+                    return "negative index";
+                }
+                switch(i){
+                    case 0: book->index = value; break;
+                    case 3: book->pub_year = value; break;
+                    case 4: book->date_added = dateFromSeconds(dates, value); break;        // (dates are in seconds in the file)
+                    case 5: book->date_out = dateFromSeconds(dates, value); break;
+                    case 6: book->date_due = dateFromSeconds(dates, value); break;
+                }
+                break;
+        }
+    }
+    return NULL;
+}
+
+// Thread for first pass of loading (count rows in part of file, so each part knows which catalog rows to write to)
+void* countRowsTask(void *argument){
+    struct load_task *task = argument;
+    const char *pos = task->start;
+    task->numLines = 0;
+    while(pos < task->end){
+        const char *newline = memchr(pos, '\n', task->end - pos);
+        task->numLines++;
+        pos = newline ? newline + 1 : task->end;
+    }
+    return NULL;
+}
+
+// Thread for second pass of loading (parse rows in part of file straight into catalog rows)
+void* parseRowsTask(void *argument){
+    struct load_task *task = argument;
+    const char *pos = task->start;
+    int line = task->firstLine;
+    task->numRead = 0;
+    task->numErrors = 0;
+    struct date_cache dates;
+    dateCacheInit(&dates);
+    struct book book;
+
+    while(pos < task->end){
+        const char *newline = memchr(pos, '\n', task->end - pos);
+        const char *rowEnd = newline ? newline : task->end;
+        const char *next = newline ? newline + 1 : task->end;
+        if(rowEnd > pos && rowEnd[-1] == '\r'){      // Ignore '\r' of Windows line endings
+            rowEnd--;
+        }
+
+        if(rowEnd > pos){       // Skip blank lines
+            const char *error = parseRow(pos, rowEnd, &book, &dates);
+            if(error == NULL && !catalogWrite(task->catalog, task->firstRow + task->numRead, &book)){
+                error = "out of memory";
+            }
+            if(error == NULL){
+                task->numRead++;
+            }
+            else{
+                if(task->numErrors < LOAD_MAX_REPORTED_ERRORS){     // Remember error to be reported once all threads are done
+                    task->errorLines[task->numErrors] = line;
+                    task->errors[task->numErrors] = error;
+                }
+                task->numErrors++;
+            }
+        }
+        line++;
+        pos = next;
+    }
+    return NULL;
+}
+
+// Thread that runs a load pass over parts of the file(s), taking the next part not yet started until there are none left
+void* loadPoolTask(void *argument){
+    struct load_pool *pool = argument;
+    int i;
+    while((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->numTasks){
+        pool->function(&pool->tasks[i]);
+    }
+    return NULL;
+}
+
+// Run a load pass over every part of the file(s), using up to one thread per processor
+void runLoadTasks(void* (*function)(void*), struct load_task *tasks, int numTasks){
+    struct load_pool pool = {function, tasks, numTasks, 0};
+    pthread_t threads[LOAD_MAX_THREADS];
+    int numThreads = cpuCount();
+    if(numThreads > LOAD_MAX_THREADS){
+        numThreads = LOAD_MAX_THREADS;
+    }
+    if(numThreads > numTasks){
+        numThreads = numTasks;
+    }
+    int started[LOAD_MAX_THREADS];
+    for(int i=1; i<numThreads; i++){
+        started[i] = (pthread_create(&threads[i], NULL, loadPoolTask, &pool) == 0);
+    }
+    loadPoolTask(&pool);        // Use this thread too (and it finishes every part if no thread could be started)
+    for(int i=1; i<numThreads; i++){
+        if(started[i]){
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+// Convert txt file in CSV format into catalog of book structures
+int csvToStructs(char* fileName, struct catalog *catalog, struct load_stats *stats) {
+    return csvFilesToStructs(&fileName, 1, catalog, stats);
+}
+
+// Convert txt files in CSV format (a database file, or every shard of one) into catalog of book structures
+// (files are memory mapped, split into parts at row boundaries and the parts parsed in parallel straight into the catalog, in file order)
+int csvFilesToStructs(char **fileNames, int numFiles, struct catalog *catalog, struct load_stats *stats){
+    double start_time = nowSeconds();
+    memset(stats, 0, sizeof(*stats));
+
+    // Map files (if files can be found)
+    struct mapped_file *maps = calloc(numFiles, sizeof(struct mapped_file));
+    if(maps == NULL){
+        return 0;
+    }
+    size_t totalBytes = 0;
+    for(int i=0; i<numFiles; i++){
+        if(!mapFile(fileNames[i], &maps[i])){
+            while(--i >= 0){
+                unmapFile(&maps[i]);
+            }
+            free(maps);
+            return 0;       // Return 0 (unsuccessfully read)
+        }
+        totalBytes += maps[i].size;
+    }
+
+    // Pick number of parts (about one per processor in all, shared between files by size, and every part gets at least LOAD_MIN_BYTES_PER_THREAD of its file)
+    int numThreads = cpuCount();
+    if(numThreads > LOAD_MAX_THREADS){
+        numThreads = LOAD_MAX_THREADS;
+    }
+    struct load_task *tasks = malloc((numThreads + numFiles) * sizeof(struct load_task));
+    if(tasks == NULL){
+        for(int i=0; i<numFiles; i++){
+            unmapFile(&maps[i]);
+        }
+        free(maps);
+        return 0;
+    }
+    int numTasks = 0;
+    for(int file=0; file<numFiles; file++){
+
+        // Skip past first row (column headings)
+        const char *data = maps[file].data;
+        const char *end = data + maps[file].size;
+        const char *newline = maps[file].size ? memchr(data, '\n', maps[file].size) : NULL;
+        data = newline ? newline + 1 : end;
+
+        int numParts = totalBytes > 0 ? (int)((double)numThreads * maps[file].size / totalBytes) : 0;
+        if(numParts > (end - data) / LOAD_MIN_BYTES_PER_THREAD + 1){
+            numParts = (end - data) / LOAD_MIN_BYTES_PER_THREAD + 1;
+        }
+        if(numParts < 1){
+            numParts = 1;
+        }
+
+        // Split file into parts, moving each split point forward to the start of the next row
+        const char *split = data;
+        for(int i=0; i<numParts; i++){
+            struct load_task *task = &tasks[numTasks++];
+            task->catalog = catalog;
+            task->fileName = fileNames[file];
+            task->start = split;
+            task->firstLine = (i == 0) ? 2 : 0;     // (line 1 is column headings; other parts are numbered on from the part before)
+            split = data + (end - data) * (i + 1) / numParts;
+            if(split < task->start){
+                split = task->start;
+            }
+            if(i == numParts-1){
+                split = end;
+            }
+            else if(split > data && split < end && split[-1] != '\n'){
+                newline = memchr(split, '\n', end - split);
+                split = newline ? newline + 1 : end;
+            }
+            task->end = split;
+        }
+    }
+
+    // First pass: count rows in each part, then give each part its own range of catalog rows
+    runLoadTasks(countRowsTask, tasks, numTasks);
+    int firstRow = catalog->numRows;
+    int line = 2;       // Line numbers for error messages
+    for(int i=0; i<numTasks; i++){
+        if(tasks[i].firstLine == 2){        // First part of a file
+            line = 2;
+        }
+        tasks[i].firstRow = firstRow;
+        tasks[i].firstLine = line;
+        firstRow += tasks[i].numLines;
+        line += tasks[i].numLines;
+    }
+    if(!catalogReserve(catalog, firstRow)){
+        fprintf(stderr, "Out of memory reading database file.\n");
+        for(int i=0; i<numFiles; i++){
+            unmapFile(&maps[i]);
+        }
+        free(maps);
+        free(tasks);
+        return 0;
+    }
+
+    // Second pass: parse every part into its rows of the catalog
+    runLoadTasks(parseRowsTask, tasks, numTasks);
+    for(int i=0; i<numFiles; i++){
+        unmapFile(&maps[i]);
+    }
+    free(maps);
+
+    // Move rows down over any gaps left by rows that could not be read, and report those rows
+    int numRows = catalog->numRows;
+    for(int i=0; i<numTasks; i++){
+        for(int j=0; j<tasks[i].numRead; j++){
+            if(numRows != tasks[i].firstRow + j){
+                catalogCopyRow(catalog, tasks[i].firstRow + j, catalog, numRows);
+            }
+            numRows++;
+        }
+        for(int j=0; j<tasks[i].numErrors && j<LOAD_MAX_REPORTED_ERRORS; j++){
+            fprintf(stderr, "Skipped line %d of \"%s\": %s\n", tasks[i].errorLines[j], tasks[i].fileName, tasks[i].errors[j]);
+        }
+        if(tasks[i].numErrors > LOAD_MAX_REPORTED_ERRORS){
+            fprintf(stderr, "Skipped %d more invalid lines of \"%s\"\n", tasks[i].numErrors - LOAD_MAX_REPORTED_ERRORS, tasks[i].fileName);
+        }
+        stats->errors += tasks[i].numErrors;
+    }
+    stats->rows = numRows - catalog->numRows;
+    catalog->numRows = numRows;     // Set numRows (used throughout)
+    free(tasks);
+
+    // Record how long loading took
+    stats->bytes = totalBytes;
+    stats->threads = numThreads < numTasks ? numThreads : numTasks;
+    stats->seconds = nowSeconds() - start_time;
+    return 1;       // Return 1 (successfully read)
+}
+
+// Make CRC-32 lookup table (called once, before first checksum)
+void makeCrcTable(void){
+    for(uint32_t i=0; i<256; i++){
+        uint32_t value = i;
+        for(int bit=0; bit<8; bit++){
+            value = (value & 1) ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+        }
+        crcTable[i] = value;
+    }
+}
+
+// Get CRC-32 checksum of data (continuing from a previous checksum, or 0 to start a new one)
+uint32_t crc32(uint32_t crc, const void *data, size_t size){
+    static pthread_once_t tableMade = PTHREAD_ONCE_INIT;
+    pthread_once(&tableMade, makeCrcTable);
+
+    const unsigned char *bytes = data;
+    crc = ~crc;
+    for(size_t i=0; i<size; i++){
+        crc = crcTable[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Write file's buffered data all the way to disk, returning 1 if successful
+int syncFile(FILE *file){
+    if(fflush(file) != 0){
+        return 0;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Atomically replace file "to" with file "from" (and make sure the rename reaches the disk), returning 1 if successful
+int replaceFile(char *from, char *to){
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    if(rename(from, to) != 0){
+        return 0;
+    }
+
+    // Sync directory holding the file, so the new directory entry is durable
+    char directory[MAX_PATH_LENGTH];
+    const char *slash = strrchr(to, '/');
+    if(slash == NULL){
+        strcpy(directory, ".");
+    }
+    else{
+        snprintf(directory, sizeof(directory), "%.*s", (int)(slash - to + 1), to);
+    }
+    int fd = open(directory, O_RDONLY);
+    if(fd >= 0){
+        fsync(fd);
+        close(fd);
+    }
+    return 1;
+#endif
+}
+
+// Check if file exists
+int fileExists(char *fileName){
+    FILE *file = fopen(fileName, "rb");
+    if(file != NULL){
+        fclose(file);
+        return 1;
+    }
+    return 0;
+}
+
+// Write number to buffer as little-endian bytes, moving buffer along
+void putNumber(unsigned char **pos, long long value, int bytes){
+    for(int i=0; i<bytes; i++){
+        *(*pos)++ = (unsigned long long)value >> (8*i);
+    }
+}
+
+// Write text to buffer (length then chars), moving buffer along
+void putText(unsigned char **pos, const char *text){
+    size_t length = strlen(text);
+    *(*pos)++ = length;
+    memcpy(*pos, text, length);
+    *pos += length;
+}
+
+// Read little-endian number from buffer, moving buffer along (returns 0 if it runs past end)
+int getNumber(const unsigned char **pos, const unsigned char *end, long long *value, int bytes){
+    if(end - *pos < bytes){
+        return 0;
+    }
+    unsigned long long result = 0;
+    for(int i=0; i<bytes; i++){
+        result |= (unsigned long long)*(*pos)++ << (8*i);
+    }
+    if(bytes < 8 && (result >> (8*bytes - 1))){     // Sign extend
+        result |= ~0ULL << (8*bytes);
+    }
+    *value = result;
+    return 1;
+}
+
+// Read text from buffer into 51 char field, moving buffer along (returns 0 if it runs past end or is too long)
+int getText(const unsigned char **pos, const unsigned char *end, char *text){
+    if(*pos >= end || **pos > 50 || end - *pos - 1 < **pos){
+        return 0;
+    }
+    int length = *(*pos)++;
+    memcpy(text, *pos, length);
+    text[length] = '\0';
+    *pos += length;
+    return 1;
+}
+
+// Write change to buffer in journal record format (length, checksum, then change), returning size of record
+size_t encodeMutation(struct mutation *mutation, unsigned char *record){
+    unsigned char *pos = record + 8;        // Leave room for length and checksum
+    putNumber(&pos, mutation->op, 1);
+    putNumber(&pos, mutation->id, 4);
+    switch(mutation->op){
+        case OP_ADD:
+            putNumber(&pos, mutation->book.index, 4);
+            putNumber(&pos, mutation->book.date_added, 4);
+            // Fall through - add also sets title/author/publication year
+        case OP_EDIT:
+            putText(&pos, mutation->book.title);
+            putText(&pos, mutation->book.author);
+            putNumber(&pos, mutation->book.pub_year, 4);
+            break;
+        case OP_BORROW:
+            putText(&pos, mutation->book.name);
+            putNumber(&pos, mutation->book.date_out, 4);
+            putNumber(&pos, mutation->book.date_due, 4);
+            break;
+        case OP_RETURN:
+            putNumber(&pos, mutation->date_returned, 4);
+            putNumber(&pos, mutation->loan, 8);
+            break;
+    }
+    size_t size = pos - (record + 8);
+    pos = record;
+    putNumber(&pos, size, 4);
+    putNumber(&pos, crc32(0, record + 8, size), 4);
+    return size + 8;
+}
+
+// Read change from journal record data (without length and checksum), returning 0 if record is not valid
+int decodeMutation(const unsigned char *pos, const unsigned char *end, struct mutation *mutation){
+    long long op, id, index = 0, pub_year = 0, date_added = 0, date_out = 0, date_due = 0;
+    memset(mutation, 0, sizeof(*mutation));
+    if(!getNumber(&pos, end, &op, 1) || !getNumber(&pos, end, &id, 4)){
+        return 0;
+    }
+    switch(op){
+        case OP_ADD:
+            if(!getNumber(&pos, end, &index, 4) || !getNumber(&pos, end, &date_added, 4)){
+                return 0;
+            }
+            // Fall through - add also sets title/author/publication year
+        case OP_EDIT:
+            if(!getText(&pos, end, mutation->book.title) || !getText(&pos, end, mutation->book.author) || !getNumber(&pos, end, &pub_year, 4)){
+                return 0;
+            }
+            strcpy(mutation->book.name, "0");
+            break;
+        case OP_BORROW:
+            if(!getText(&pos, end, mutation->book.name) || !getNumber(&pos, end, &date_out, 4) || !getNumber(&pos, end, &date_due, 4)){
+                return 0;
+            }
+            break;
+        case OP_RETURN:
+            if(pos < end){      // (returns from before the loan history have no date or loan number)
+                long long date_returned, loan;
+                if(!getNumber(&pos, end, &date_returned, 4) || !getNumber(&pos, end, &loan, 8)){
+                    return 0;
+                }
+                mutation->date_returned = date_returned;
+                mutation->loan = loan;
+            }
+            break;
+        case OP_DELETE:
+            break;
+        default:
+            return 0;
+    }
+    mutation->op = op;
+    mutation->id = id;
+    mutation->book.index = index;
+    mutation->book.pub_year = pub_year;
+    mutation->book.date_added = date_added;
+    mutation->book.date_out = date_out;
+    mutation->book.date_due = date_due;
+    return pos == end;
+}
+
+// Make change to book in catalog, returning 0 if it cannot be made (row out of range or out of memory)
+int applyMutation(struct catalog *catalog, struct mutation *mutation){
+    if(!idMapReady(catalog)){
+        return 0;
+    }
+    int row = idMapFind(&catalog->ids, mutation->id);
+    if(mutation->op == OP_ADD){
+        if(mutation->id < 0 || row != -1 || !idMapReserve(&catalog->ids, catalog->ids.count + 1)){     // Each book has its own ID
+            return 0;
+        }
+        row = catalogNewRow(catalog);       // Reuses row of a deleted book if there is one
+        if(row == -1){
+            return 0;
+        }
+        struct book book = mutation->book;
+        book.index = mutation->id;
+        if(!catalogWrite(catalog, row, &book)){
+            catalogDeleteRow(catalog, row);     // (back on free list, as a tombstone)
+            return 0;
+        }
+        idMapPut(&catalog->ids, mutation->id, row);
+        if(mutation->id >= catalog->nextId){
+            catalog->nextId = mutation->id + 1;
+        }
+        catalogIndexesUpdate(catalog, row, NULL, &book);
+        return 1;
+    }
+    if(row == -1){
+        return 0;
+    }
+
+    struct book book, oldBook;
+    catalogRead(catalog, row, &book);
+    oldBook = book;
+    switch(mutation->op){
+        case OP_EDIT:
+            strcpy(book.title, mutation->book.title);
+            strcpy(book.author, mutation->book.author);
+            book.pub_year = mutation->book.pub_year;
+            if(!catalogWrite(catalog, row, &book)){
+                return 0;
+            }
+            catalogIndexesUpdate(catalog, row, &oldBook, &book);
+            if(strcmp(oldBook.author, book.author) != 0){
+                loanStatsMoveAuthor(catalog, book.index, oldBook.author, book.author);      // Loans are counted under the author the book has now (as when counts are made from the history)
+            }
+            break;
+        case OP_DELETE:
+            if(!catalogDeleteRow(catalog, row)){        // Leaves a tombstone, so no other book moves
+                return 0;
+            }
+            catalogIndexesUpdate(catalog, row, &oldBook, NULL);
+            if(oldBook.date_out != 0){
+                loanStatsBorrow(catalog, &oldBook, -1);     // Loan will never come back, so it is not counted (as when counts are made from the history)
+            }
+            loanStatsMoveAuthor(catalog, oldBook.index, oldBook.author, NULL);      // Past loans of deleted books are not counted under any author
+
+            // Reclaim tombstones once they are a large part of the catalog
+            if(catalog->numFree >= CATALOG_CHUNK_ROWS && catalog->numFree > catalog->numRows / 4){
+                catalogCompact(catalog);
+            }
+            break;
+        case OP_BORROW:
+            strcpy(book.name, mutation->book.name);
+            book.date_out = mutation->book.date_out;
+            book.date_due = mutation->book.date_due;
+            if(!catalogWrite(catalog, row, &book)){
+                return 0;
+            }
+            catalogIndexesUpdate(catalog, row, &oldBook, &book);
+            loanStatsBorrow(catalog, &book, 1);
+            break;
+        case OP_RETURN:
+            strcpy(book.name, "0");
+            book.date_out = 0;
+            book.date_due = 0;
+            if(!catalogWrite(catalog, row, &book)){     // (only if its chunk is being saved and cannot be copied)
+                return 0;
+            }
+            catalogIndexesUpdate(catalog, row, &oldBook, &book);
+            loanReturned(catalog, &oldBook, mutation);
+            break;
+    }
+    return 1;
+}
+
+// Keep every index up to date with a change to the catalog (called after the change is made, with oldBook NULL for an add and newBook NULL for a delete)
+void catalogIndexesUpdate(struct catalog *catalog, int row, struct book *oldBook, struct book *newBook){
+    searchIndexUpdate(catalog, row, oldBook, newBook);
+    yearIndexUpdate(catalog, row, oldBook, newBook);
+    dueIndexUpdate(catalog, row, oldBook, newBook);
+    patronIndexUpdate(catalog, row, oldBook, newBook);
+    sortOrdersUpdate(catalog, row, oldBook, newBook);
+}
+
+// Make sure every index is built (e.g. so searches shared between server workers never build one), returning 0 if out of memory
+int catalogIndexesReady(struct catalog *catalog){
+    return idMapReady(catalog) && searchIndexReady(catalog) && yearIndexReady(catalog) && dueIndexReady(catalog) && patronIndexReady(catalog) && loanStatsReady(catalog) && sortOrdersReady(catalog);
+}
+
+// Make change to catalog, writing it to the journal first so it survives a crash, returning 0 if it cannot be made
+int commitMutation(struct catalog *catalog, struct mutation *mutation){
+    double start = nowSeconds();
+    if(mutation->op == OP_RETURN && catalog->history != NULL){
+        mutation->loan = catalog->history->lastLoan + 1;        // Numbered before it goes in the journal, so a replay can tell if the history has it already
+    }
+    int success = (catalogFind(catalog, mutation->id) == -1) == (mutation->op == OP_ADD)       // Book must exist, unless it is being added
+        && !(mutation->op == OP_BORROW && patronLoanCount(catalog, mutation->book.name) >= PATRON_MAX_LOANS)       // Borrower must not have too many books out (checked again here, as server workers check changes before taking the catalog to themselves)
+        && (catalog->journal == NULL || journalAppend(catalog->journal, mutation))
+        && applyMutation(catalog, mutation);
+
+    // Fold journal back into database file once it gets long, or has held changes for too long (unless a fold is still running, so no change waits for one)
+    struct journal *journal = catalog->journal;
+    if(success && journal != NULL && journal->records > 0 && !journalCompacting(journal)
+       && (journal->records >= JOURNAL_COMPACT_RECORDS || (checkpointSeconds > 0 && nowSeconds() - journal->lastCheckpoint >= checkpointSeconds))){
+        compactJournal(catalog, 1);
+    }
+    metricsRecord(METRIC_ADD + mutation->op - OP_ADD, start, success);       // (includes starting a fold, which this change waits for)
+    return success;
+}
+
+// Apply every valid record in a journal file to the catalog (marking the shards they change in journal), returning number of bytes of valid records (0 if file cannot be read)
+size_t replayJournal(char *fileName, struct catalog *catalog, struct journal *journal, int *numRecords){
+    struct mapped_file map;
+    *numRecords = 0;
+    if(!mapFile(fileName, &map)){
+        return 0;
+    }
+    if(map.size < JOURNAL_HEADER_SIZE || memcmp(map.data, JOURNAL_HEADER, JOURNAL_HEADER_SIZE) != 0){
+        unmapFile(&map);
+        return 0;
+    }
+
+    // Read records until end of file, or until one is cut off/corrupt (write in progress during a crash)
+    const unsigned char *pos = (const unsigned char*)map.data + JOURNAL_HEADER_SIZE;
+    const unsigned char *end = (const unsigned char*)map.data + map.size;
+    const unsigned char *recordStart;
+    long long size, checksum;
+    struct mutation mutation;
+    while(1){
+        recordStart = pos;
+        if(!getNumber(&pos, end, &size, 4) || !getNumber(&pos, end, &checksum, 4)){
+            break;
+        }
+        size &= 0xFFFFFFFF;
+        checksum &= 0xFFFFFFFF;
+        if(size > end - pos || crc32(0, pos, size) != checksum || !decodeMutation(pos, pos + size, &mutation)){
+            break;
+        }
+        if(!applyMutation(catalog, &mutation)){
+            fprintf(stderr, "Journal record %d in \"%s\" cannot be applied, skipped.\n", *numRecords + 1, fileName);
+        }
+        journal->dirtyShards[bookShard(mutation.id, journal->numShards)] = 1;
+        (*numRecords)++;
+        pos += size;
+    }
+    size_t validSize = recordStart - (const unsigned char*)map.data;
+    unmapFile(&map);
+    return validSize;
+}
+
+// Cut file down to given size, returning 1 if successful
+int truncateFile(char *fileName, size_t size){
+#ifdef _WIN32
+    int fd = _open(fileName, _O_RDWR | _O_BINARY);
+    if(fd < 0){
+        return 0;
+    }
+    int result = _chsize_s(fd, size) == 0;
+    _close(fd);
+    return result;
+#else
+    return truncate(fileName, size) == 0;
+#endif
+}
+
+// Add the records of one journal file to the end of another (used when an older journal has not been folded into the database file yet)
+int appendJournal(char *fromName, char *toName){
+    FILE *from = fopen(fromName, "rb");
+    FILE *to = fopen(toName, "ab");
+    int success = (from != NULL && to != NULL);
+    if(success){
+        char buffer[65536];
+        size_t size;
+        fseek(from, JOURNAL_HEADER_SIZE, SEEK_SET);     // Records only, not header
+        while((size = fread(buffer, 1, sizeof(buffer), from)) > 0){
+            if(fwrite(buffer, 1, size, to) != size){
+                success = 0;
+                break;
+            }
+        }
+        success = success && syncFile(to);
+    }
+    if(from != NULL) fclose(from);
+    if(to != NULL) fclose(to);
+    return success;
+}
+
+// Open journal file for appending (creating it with its header if needed), returning NULL if it cannot be opened
+FILE* openJournalFile(char *fileName){
+    FILE *file = fopen(fileName, "ab");
+    if(file != NULL && ftell(file) == 0){       // New file, so write header
+        if(fwrite(JOURNAL_HEADER, 1, JOURNAL_HEADER_SIZE, file) != JOURNAL_HEADER_SIZE || !syncFile(file)){
+            fclose(file);
+            return NULL;
+        }
+    }
+    return file;
+}
+
+// Thread that syncs journal to disk in groups (group commit), at most JOURNAL_SYNC_MS after a record is written
+void* journalSyncTask(void *argument){
+    struct journal *journal = argument;
+    pthread_mutex_lock(&journal->lock);
+    while(!journal->stopping){
+        if(journal->pending == 0){
+            pthread_cond_wait(&journal->wake, &journal->lock);      // Wait for something to sync
+            continue;
+        }
+
+        // Wait until oldest unsynced record has waited long enough (unless lots of records are waiting)
+        double wait = journal->firstPendingTime + JOURNAL_SYNC_MS/1000.0 - nowSeconds();
+        if(wait > 0 && journal->pending < JOURNAL_SYNC_RECORDS){
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            long long nanoseconds = until.tv_nsec + (long long)(wait * 1e9);
+            until.tv_sec += nanoseconds / 1000000000;
+            until.tv_nsec = nanoseconds % 1000000000;
+            pthread_cond_timedwait(&journal->wake, &journal->lock, &until);
+            continue;
+        }
+
+        double start = nowSeconds();
+        int synced = journal->file == NULL || syncFile(journal->file);
+        metricsRecord(METRIC_JOURNAL_SYNC, start, synced);
+        if(!synced){
+            fprintf(stderr, "Journal file cannot be written to disk.\n");
+        }
+        journal->pending = 0;
+        journal->syncs++;
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return NULL;
+}
+
+// Open journal for database file, first replaying any changes left in it by the last run (returns NULL if journal cannot be opened)
+struct journal* journalOpen(char *fileName, struct catalog *catalog){
+    struct journal *journal = calloc(1, sizeof(struct journal));
+    if(journal == NULL){
+        return NULL;
+    }
+    snprintf(journal->fileName, MAX_PATH_LENGTH, "%s", fileName);
+    snprintf(journal->path, MAX_PATH_LENGTH, "%s.journal", fileName);
+    snprintf(journal->oldPath, MAX_PATH_LENGTH, "%s.journal.old", fileName);
+    snprintf(journal->tmpPath, MAX_PATH_LENGTH, "%s.tmp", fileName);
+    snprintf(journal->snapshotPath, MAX_PATH_LENGTH, "%s.snap", fileName);
+    journal->numShards = catalog->numShards;
+
+    // Open loan history first, so returns replayed below that it does not have yet are added to it
+    if(catalog->history == NULL){
+        catalog->history = historyOpen(fileName);
+    }
+
+    // Recover from a crash part way through folding journal into database file
+    // (the temp file exists from before the old journal is made until the new database file replaces the old one)
+    int numRecords;
+    if(fileExists(journal->oldPath)){
+        if(fileExists(journal->tmpPath)){       // New database file not written, so old journal still needed
+            replayJournal(journal->oldPath, catalog, journal, &numRecords);
+            fprintf(stderr, "%d changes recovered from \"%s\".\n", numRecords, journal->oldPath);
+        }
+        else{       // New database file already has these changes
+            remove(journal->oldPath);
+        }
+    }
+    if(!fileExists(journal->oldPath)){
+        remove(journal->tmpPath);
+    }
+
+    // Replay changes since database file was last written, dropping any record cut off by a crash
+    size_t validSize = replayJournal(journal->path, catalog, journal, &numRecords);
+    if(fileExists(journal->path)){
+        if(numRecords > 0){
+            fprintf(stderr, "%d changes recovered from \"%s\".\n", numRecords, journal->path);
+        }
+        if(validSize == 0){     // Not a valid journal at all
+            remove(journal->path);
+        }
+        else{
+            truncateFile(journal->path, validSize);
+        }
+    }
+    journal->records = numRecords;
+    journal->lastCheckpoint = nowSeconds();
+
+    // Open journal for new changes and start thread that syncs them
+    if((journal->file = openJournalFile(journal->path)) == NULL){
+        free(journal);
+        return NULL;
+    }
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->wake, NULL);
+    if(pthread_create(&journal->syncThread, NULL, journalSyncTask, journal) != 0){
+        fclose(journal->file);
+        free(journal);
+        return NULL;
+    }
+    return journal;
+}
+
+// Write change to end of journal (synced to disk by the sync thread), returning 1 if successful
+int journalAppend(struct journal *journal, struct mutation *mutation){
+    double start = nowSeconds();
+    unsigned char record[JOURNAL_MAX_RECORD];
+    size_t size = encodeMutation(mutation, record);
+
+    pthread_mutex_lock(&journal->lock);
+    if(journal->file == NULL){      // Reopen journal if it could not be opened after the last fold
+        journal->file = openJournalFile(journal->path);
+    }
+    int success = journal->file != NULL && fwrite(record, 1, size, journal->file) == size && fflush(journal->file) == 0;        // Hand record to OS straight away (survives program crash)
+    if(success){
+        if(journal->pending == 0){
+            journal->firstPendingTime = nowSeconds();
+        }
+        journal->pending++;
+        journal->records++;
+        journal->dirtyShards[bookShard(mutation->id, journal->numShards)] = 1;      // (its shard file is written by the next fold)
+        pthread_cond_signal(&journal->wake);        // Wake sync thread (syncs to disk after a short wait, together with any other records)
+    }
+    pthread_mutex_unlock(&journal->lock);
+    metricsRecord(METRIC_JOURNAL_APPEND, start, success);
+    return success;
+}
+
+// Write many changes to end of journal and sync them to disk straight away (one sync for all of them), returning 1 if successful
+int journalAppendBatch(struct journal *journal, struct mutation *mutations, int numMutations){
+    double start = nowSeconds();
+    pthread_mutex_lock(&journal->lock);
+    if(journal->file == NULL){
+        journal->file = openJournalFile(journal->path);
+    }
+    int success = journal->file != NULL;
+    for(int i=0; i<numMutations && success; i++){
+        unsigned char record[JOURNAL_MAX_RECORD];
+        size_t size = encodeMutation(&mutations[i], record);
+        success = fwrite(record, 1, size, journal->file) == size;
+    }
+    success = success && fflush(journal->file) == 0 && syncFile(journal->file);
+    if(success){
+        for(int i=0; i<numMutations; i++){
+            journal->dirtyShards[bookShard(mutations[i].id, journal->numShards)] = 1;
+        }
+        journal->records += numMutations;
+        journal->pending = 0;       // (records of other changes written before these are synced too)
+        journal->syncs++;
+    }
+    pthread_mutex_unlock(&journal->lock);
+    metricsRecord(METRIC_JOURNAL_SYNC, start, success);
+    return success;
+}
+
+// Wait for a fold of the journal into the database file to finish (if one is running)
+void journalWaitForCompaction(struct journal *journal){
+    if(journal->compacting){
+        pthread_join(journal->compactThread, NULL);
+        journal->compacting = 0;
+    }
+}
+
+// Check if a fold of the journal into the database file is still running
+int journalCompacting(struct journal *journal){
+    return journal->compacting && !__atomic_load_n(&journal->compaction.done, __ATOMIC_ACQUIRE);
+}
+
+// Sync journal, stop its thread and close it
+void journalClose(struct journal *journal){
+    journalWaitForCompaction(journal);
+
+    pthread_mutex_lock(&journal->lock);
+    journal->stopping = 1;
+    pthread_cond_signal(&journal->wake);
+    pthread_mutex_unlock(&journal->lock);
+    pthread_join(journal->syncThread, NULL);
+
+    if(journal->file != NULL){
+        syncFile(journal->file);
+        fclose(journal->file);
+    }
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->wake);
+    free(journal);
+}
+
+// Copy all books in catalog into a new catalog (without deleted rows), returning 0 if out of memory
+int catalogCopy(struct catalog *from, struct catalog *to){
+    catalogInit(to);
+    if(from->strings != NULL){      // Copy shares string pool (strings are only ever added, so both can use it)
+        __atomic_add_fetch(&from->strings->references, 1, __ATOMIC_RELAXED);
+        to->strings = from->strings;
+    }
+    if(!catalogReserve(to, from->numRows)){
+        catalogFree(to);
+        return 0;
+    }
+    if(from->numFree == 0){     // No deleted rows, so copy whole chunks
+        for(int row=0; row<from->numRows; row+=CATALOG_CHUNK_ROWS){
+            memcpy(to->chunks[row / CATALOG_CHUNK_ROWS], catalogChunk(from, row), sizeof(struct catalog_chunk));
+            to->chunks[row / CATALOG_CHUNK_ROWS]->references = 1;
+        }
+        to->numRows = from->numRows;
+        return 1;
+    }
+    for(int row=0; row<from->numRows; row++){       // Copy books only (leaving out tombstones)
+        if(catalogId(from, row) != BOOK_DELETED){
+            catalogCopyRow(from, row, to, to->numRows++);
+        }
+    }
+    return 1;
+}
+
+// Make a copy of catalog that shares its chunks (each is only copied once the catalog changes it), returning 0 if out of memory
+// Takes time proportional to the number of chunks, not books, so changes are held up only briefly when a save starts
+int catalogShare(struct catalog *from, struct catalog *to){
+    catalogInit(to);
+    if(from->strings != NULL){      // (string pool is shared too, as in catalogCopy)
+        __atomic_add_fetch(&from->strings->references, 1, __ATOMIC_RELAXED);
+        to->strings = from->strings;
+    }
+    int numChunks = (from->numRows + CATALOG_CHUNK_ROWS - 1) / CATALOG_CHUNK_ROWS;
+    if(!catalogReserveChunkTable(to, numChunks)){
+        catalogFree(to);
+        return 0;
+    }
+    for(int i=0; i<numChunks; i++){
+        struct catalog_chunk *chunk = catalogChunk(from, i * CATALOG_CHUNK_ROWS);       // (reads chunks still in the snapshot file)
+        __atomic_add_fetch(&chunk->references, 1, __ATOMIC_RELAXED);
+        to->chunks[i] = chunk;
+    }
+    to->numChunks = numChunks;
+    to->numRows = from->numRows;
+    to->numFree = from->numFree;        // (copy has the tombstones too, but not the list of them)
+    return 1;
+}
+
+// Write catalog to txt file in CSV format, returning 1 if the whole file reached the disk
+int writeCsvFile(char *fileName, struct catalog *catalog){
+    return writeShardFile(fileName, catalog, 0, 1);
+}
+
+// Write books in one shard of catalog (those whose IDs hash to it) to txt file in CSV format, returning 1 if the whole file reached the disk
+int writeShardFile(char *fileName, struct catalog *catalog, int shard, int numShards){
+    FILE *fout = fopen(fileName, "wb");
+    if(fout == NULL){
+        return 0;
+    }
+    int success = fprintf(fout, "index,title,author,pub_year,date_added,date_out,date_due,name\n") > 0;        // Add column titles
+    struct date_cache dates;
+    dateCacheInit(&dates);
+
+    // Write rows to txt file in CSV format
+    struct book book;
+    for(int i=0; i<catalog->numRows && success; i++){
+        int id = catalogId(catalog, i);
+        if(id == BOOK_DELETED || bookShard(id, numShards) != shard){        // Skip deleted rows, and books in other shards
+            continue;
+        }
+        catalogRead(catalog, i, &book);
+
+        // Replace any ',' with '.' as CSV is comma delimited in title/author/name
+        char *fields[] = {book.title, book.author, book.name};
+        for(int field=0; field<3; field++){
+            for(char *pos = fields[field]; *pos != '\0'; pos++){
+                if(*pos == ','){
+                    *pos = '.';
+                }
+            }
+        }
+
+        // Write row to file
+        success = fprintf(fout,"%d,%s,%s,%d,%lld,%lld,%lld,%s\n",book.index,book.title,book.author,book.pub_year,dateToSeconds(&dates, book.date_added),dateToSeconds(&dates, book.date_out),dateToSeconds(&dates, book.date_due),book.name) > 0;
+    }
+
+    success = syncFile(fout) && success;
+    return (fclose(fout) == 0) && success;
+}
+
+// Get shard that book with given ID is kept in
+int bookShard(int id, int numShards){
+    return (unsigned)id % numShards;
+}
+
+// Get name of a shard file (the database file itself if it is not split), returning 0 if it is too long (so a save never writes a file with a cut off name)
+int shardPath(char *fileName, int shard, int numShards, char *path){
+    int length;
+    if(numShards == 1){
+        length = snprintf(path, SHARD_PATH_LENGTH, "%s", fileName);
+    }
+    else{
+        length = snprintf(path, SHARD_PATH_LENGTH, "%s.shard%d", fileName, shard);
+    }
+    return length >= 0 && length < SHARD_PATH_LENGTH;
+}
+
+// Get number of files database is split into (from "<file>.shards", 1 if it has none)
+int shardCount(char *fileName){
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, MAX_PATH_LENGTH, "%s.shards", fileName);
+    FILE *file = fopen(path, "r");
+    int numShards = 1;
+    if(file != NULL){
+        if(fscanf(file, "%d", &numShards) != 1 || numShards < 1 || numShards > SHARD_MAX){
+            fprintf(stderr, "\"%s\" is not a valid number of shards, so \"%s\" is read as a single file.\n", path, fileName);
+            numShards = 1;
+        }
+        fclose(file);
+    }
+    return numShards;
+}
+
+// Record number of files database is split into (removing "<file>.shards" if it is a single file), returning 1 if successful
+int writeShardCount(char *fileName, int numShards){
+    char path[MAX_PATH_LENGTH], tmpPath[MAX_PATH_LENGTH + 4];
+    snprintf(path, MAX_PATH_LENGTH, "%s.shards", fileName);
+    if(numShards == 1){
+        return remove(path) == 0 || !fileExists(path);
+    }
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE *file = fopen(tmpPath, "wb");
+    if(file == NULL){
+        return 0;
+    }
+    int success = fprintf(file, "%d\n", numShards) > 0 && syncFile(file);
+    success = (fclose(file) == 0) && success;
+    if(!success || !replaceFile(tmpPath, path)){
+        remove(tmpPath);
+        return 0;
+    }
+    return 1;
+}
+
+// Thread that writes shard files (each to a temp file, then swapped in), taking the next shard until there are none left
+void* shardWriteTask(void *argument){
+    struct shard_writer *writer = argument;
+    char path[SHARD_PATH_LENGTH], tmpPath[SHARD_PATH_LENGTH + 4];
+    struct file_stamp stamp;
+    int shard;
+    while((shard = __atomic_fetch_add(&writer->next, 1, __ATOMIC_RELAXED)) < writer->numShards){
+        if(writer->dirty != NULL && !writer->dirty[shard]){     // Unchanged, so file already has its books
+            continue;
+        }
+        if(!shardPath(writer->fileName, shard, writer->numShards, path)){
+            __atomic_store_n(&writer->failed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+        if(writeShardFile(tmpPath, writer->catalog, shard, writer->numShards) && replaceFile(tmpPath, path)){
+            if(getFileStamp(path, &stamp)){
+                __atomic_add_fetch(&writer->bytes, stamp.size, __ATOMIC_RELAXED);
+            }
+        }
+        else{
+            remove(tmpPath);
+            __atomic_store_n(&writer->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// Write shard files of catalog in parallel (only those set in dirty, or all of them if it is NULL), returning 1 if every one reached the disk
+int writeShards(char *fileName, struct catalog *catalog, int numShards, const unsigned char *dirty, long long *bytes){
+    struct shard_writer writer = {catalog, fileName, numShards, dirty, 0, 0, 0};
+    int numThreads = cpuCount();
+    if(numThreads > LOAD_MAX_THREADS){
+        numThreads = LOAD_MAX_THREADS;
+    }
+    if(numThreads > numShards){
+        numThreads = numShards;
+    }
+    pthread_t threads[LOAD_MAX_THREADS];
+    int started[LOAD_MAX_THREADS];
+    for(int i=1; i<numThreads; i++){
+        started[i] = (pthread_create(&threads[i], NULL, shardWriteTask, &writer) == 0);
+    }
+    shardWriteTask(&writer);        // Use this thread too
+    for(int i=1; i<numThreads; i++){
+        if(started[i]){
+            pthread_join(threads[i], NULL);
+        }
+    }
+    if(bytes != NULL){
+        *bytes = writer.bytes;
+    }
+    return !writer.failed;
+}
+
+// Split database file into numShards shard files by book ID (or join its shard files back into one, if numShards is 1), returning 1 if successful
+// Changes still in the journal are folded in first. The program must not be using the database at the same time
+int reshardDatabase(char *fileName, int numShards){
+    if(numShards < 1 || numShards > SHARD_MAX){
+        printf("Number of shards must be from 1 to %d.\n", SHARD_MAX);
+        return 0;
+    }
+    struct catalog catalog;
+    struct load_stats stats;
+    catalogInit(&catalog);
+    if(!loadCatalog(fileName, &catalog, &stats)){
+        printf("Database file, \"%s\", cannot be found.\n", fileName);
+        return 0;
+    }
+
+    // Fold journal into the database as it is now, so it has every change
+    int success = (catalog.journal = journalOpen(fileName, &catalog)) != NULL && writeDatabase(fileName, &catalog);
+    if(catalog.journal != NULL){
+        journalClose(catalog.journal);
+        catalog.journal = NULL;
+    }
+
+    // Change layout one step at a time, so after a crash the shard count always names a complete set of files
+    // (shards to a single file: write file, then drop shard count, then shard files; a single file to shards: the reverse; shards to shards goes through a single file)
+    char path[SHARD_PATH_LENGTH];
+    int oldShards = catalog.numShards;
+    if(success && oldShards > 1 && oldShards != numShards){
+        success = writeShards(fileName, &catalog, 1, NULL, NULL) && writeShardCount(fileName, 1);
+        for(int i=0; i<oldShards && success; i++){
+            if(shardPath(fileName, i, oldShards, path)){
+                remove(path);
+            }
+        }
+        oldShards = 1;
+    }
+    if(success && oldShards == 1 && numShards > 1){
+        success = writeShards(fileName, &catalog, numShards, NULL, NULL) && writeShardCount(fileName, numShards) && remove(fileName) == 0;
+        snprintf(path, MAX_PATH_LENGTH, "%s.snap", fileName);       // (shard files have no snapshot)
+        remove(path);
+    }
+    if(success){
+        printf("%d books written to %d file%s.\n", catalog.numRows - catalog.numFree, numShards, numShards == 1 ? "" : "s");
+    }
+    else{
+        printf("Cannot reshard \"%s\".\n", fileName);
+    }
+    catalogFree(&catalog);
+    return success;
+}
+
+// Thread that writes a copy of the catalog to the database file, then deletes the journal records it now includes
+void* compactTask(void *argument){
+    struct compaction *compaction = argument;
+    struct journal *journal = compaction->journal;
+    double start = nowSeconds();
+    long long bytes = 0;
+
+    // Database split into shard files: write only shards with changes (each is swapped in as it is written), then remove the temp file that marks the fold as unfinished
+    if(journal->numShards > 1){
+        if(writeShards(journal->fileName, &compaction->books, journal->numShards, compaction->dirty, &bytes) && remove(journal->tmpPath) == 0){
+            remove(journal->oldPath);
+            compaction->success = 1;
+        }
+        else{       // Old journal is kept (and replayed on next start) until a later fold succeeds
+            fprintf(stderr, "Shard files of \"%s\" cannot be written.\n", journal->fileName);
+            compaction->success = 0;
+        }
+    }
+
+    // Otherwise write to temp file, then swap it in, so the database file is never half written
+    else{
+        // Leave out tombstones (snapshot files have none)
+        struct catalog dense;
+        if(compaction->books.numFree > 0 && catalogCopy(&compaction->books, &dense)){
+            catalogFree(&compaction->books);
+            compaction->books = dense;
+        }
+
+        if(writeCsvFile(journal->tmpPath, &compaction->books) && replaceFile(journal->tmpPath, journal->fileName)){
+            remove(journal->oldPath);
+            compaction->success = 1;
+
+            // Update snapshot to match new database file (if it cannot be replaced, e.g. while mapped on Windows, its stamp no longer matches and it is rebuilt on next start)
+            struct file_stamp stamp, snapshotStamp;
+            if(getFileStamp(journal->fileName, &stamp)){
+                bytes += stamp.size;
+                if(compaction->books.numFree == 0 && writeSnapshotFile(journal->snapshotPath, &compaction->books, &stamp) && getFileStamp(journal->snapshotPath, &snapshotStamp)){
+                    bytes += snapshotStamp.size;
+                }
+            }
+        }
+        else{       // Old journal is kept (and replayed on next start) until a later fold succeeds
+            fprintf(stderr, "Database file \"%s\" cannot be written.\n", journal->fileName);
+            compaction->success = 0;
+        }
+    }
+    catalogFree(&compaction->books);
+
+    // Record how long it took and how much was written
+    double seconds = nowSeconds() - start;
+    pthread_mutex_lock(&journal->lock);
+    if(compaction->success){
+        journal->stats.saves++;
+        journal->stats.lastSeconds = seconds;
+        journal->stats.totalSeconds += seconds;
+        journal->stats.lastBytes = bytes;
+        journal->stats.totalBytes += bytes;
+    }
+    else{
+        journal->stats.failures++;
+        for(int i=0; i<journal->numShards; i++){        // (shards not written are written by the next fold)
+            journal->dirtyShards[i] |= compaction->dirty[i];
+        }
+    }
+    pthread_mutex_unlock(&journal->lock);
+    metricsRecord(METRIC_SAVE, start, compaction->success);
+    __atomic_store_n(&compaction->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Fold journal into database file (writes whole catalog to database file, then empties journal), returning 1 if successful
+// In the background, only the copy of the catalog is made on this thread
+int compactJournal(struct catalog *catalog, int background){
+    struct journal *journal = catalog->journal;
+    journalWaitForCompaction(journal);      // Only one fold at a time
+    double start = nowSeconds();
+    journal->lastCheckpoint = start;
+
+    // Copy catalog (sharing its chunks until they change), so it can be written while changes carry on
+    struct catalog books;
+    if(!catalogShare(catalog, &books)){
+        return 0;
+    }
+
+    // Make temp file before moving journal out of the way (marks fold as started but not finished, in case of crash)
+    FILE *tmp = fopen(journal->tmpPath, "wb");
+    if(tmp == NULL){
+        catalogFree(&books);
+        return 0;
+    }
+    fclose(tmp);
+
+    // Put loan history on disk, as the journal records that would write it again after a crash are about to be dropped
+    if(catalog->history != NULL && !historySync(catalog->history)){
+        remove(journal->tmpPath);
+        catalogFree(&books);
+        return 0;
+    }
+
+    // Move current journal records to old journal (they stay there until new database file is in place) and start a new journal
+    pthread_mutex_lock(&journal->lock);
+    if(journal->file != NULL){
+        syncFile(journal->file);
+        fclose(journal->file);
+    }
+    int moved = fileExists(journal->oldPath) ? appendJournal(journal->path, journal->oldPath) && remove(journal->path) == 0
+                                             : replaceFile(journal->path, journal->oldPath);
+    journal->file = openJournalFile(journal->path);     // (if this fails, changes are refused until a later fold opens it)
+    journal->pending = 0;
+    journal->records = 0;
+    unsigned char dirty[SHARD_MAX];     // Shards changed by the records moved
+    memcpy(dirty, journal->dirtyShards, journal->numShards);
+    memset(journal->dirtyShards, 0, journal->numShards);
+    pthread_mutex_unlock(&journal->lock);
+    if(!moved || journal->file == NULL){
+        pthread_mutex_lock(&journal->lock);
+        for(int i=0; i<journal->numShards; i++){
+            journal->dirtyShards[i] |= dirty[i];
+        }
+        pthread_mutex_unlock(&journal->lock);
+        catalogFree(&books);
+        return 0;
+    }
+
+    // Write copy to database file
+    pthread_mutex_lock(&journal->lock);
+    journal->stats.lastPauseSeconds = nowSeconds() - start;
+    pthread_mutex_unlock(&journal->lock);
+    journal->compaction.journal = journal;
+    journal->compaction.books = books;
+    memcpy(journal->compaction.dirty, dirty, journal->numShards);
+    journal->compaction.done = 0;
+    if(background && pthread_create(&journal->compactThread, NULL, compactTask, &journal->compaction) == 0){
+        journal->compacting = 1;
+        return 1;
+    }
+    compactTask(&journal->compaction);
+    return journal->compaction.success;
+}
+
+// Get size and modification time of file (used to check a snapshot was made from the current database file), returning 1 if successful
+int getFileStamp(char *fileName, struct file_stamp *stamp){
+    memset(stamp, 0, sizeof(*stamp));
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if(!GetFileAttributesExA(fileName, GetFileExInfoStandard, &info)){
+        return 0;
+    }
+    stamp->size = ((long long)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    stamp->modified = ((long long)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat info;
+    if(stat(fileName, &info) != 0){
+        return 0;
+    }
+    stamp->size = info.st_size;
+    stamp->modified = (long long)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+    return 1;
+}
+
+// Write catalog to binary snapshot file (temp file first, then swapped in), returning 1 if successful
+int writeSnapshotFile(char *fileName, struct catalog *catalog, struct file_stamp *stamp){
+    char tmpPath[MAX_PATH_LENGTH];
+    snprintf(tmpPath, MAX_PATH_LENGTH, "%s.tmp", fileName);
+    FILE *fout = fopen(tmpPath, "wb");
+    if(fout == NULL){
+        return 0;
+    }
+
+    int numBlocks = (catalog->numRows + CATALOG_CHUNK_ROWS - 1) / CATALOG_CHUNK_ROWS;
+    uint32_t *checksums = calloc(numBlocks ? numBlocks : 1, sizeof(uint32_t));
+    unsigned long long *blockStrings = calloc(numBlocks ? numBlocks : 1, sizeof(unsigned long long));
+    unsigned char header[SNAPSHOT_HEADER_SIZE] = {0};
+    unsigned char record[SNAPSHOT_RECORD_SIZE];
+    int success = checksums != NULL && blockStrings != NULL && fwrite(header, 1, SNAPSHOT_HEADER_SIZE, fout) == SNAPSHOT_HEADER_SIZE;      // Header is filled in last
+
+    // Write fixed-width records (strings of each book are stored together in the string table, in order)
+    unsigned long long stringOffset = 0;
+    struct book book;
+    for(int i=0; i<catalog->numRows && success; i++){
+        catalogRead(catalog, i, &book);
+        unsigned char *pos = record;
+        if(i % CATALOG_CHUNK_ROWS == 0){
+            blockStrings[i / CATALOG_CHUNK_ROWS] = stringOffset;
+        }
+        putNumber(&pos, book.index, 4);
+        putNumber(&pos, book.pub_year, 4);
+        putNumber(&pos, book.date_added, 4);
+        putNumber(&pos, book.date_out, 4);
+        putNumber(&pos, book.date_due, 4);
+        putNumber(&pos, stringOffset, 8);
+        putNumber(&pos, strlen(book.title), 1);
+        putNumber(&pos, strlen(book.author), 1);
+        putNumber(&pos, strlen(book.name), 1);
+        putNumber(&pos, 0, 1);      // Padding
+        stringOffset += strlen(book.title) + strlen(book.author) + strlen(book.name);
+
+        checksums[i / CATALOG_CHUNK_ROWS] = crc32(checksums[i / CATALOG_CHUNK_ROWS], record, SNAPSHOT_RECORD_SIZE);
+        success = fwrite(record, 1, SNAPSHOT_RECORD_SIZE, fout) == SNAPSHOT_RECORD_SIZE;
+    }
+
+    // Write string table
+    for(int i=0; i<catalog->numRows && success; i++){
+        struct book_text *text = catalogText(catalog, i);
+        const char *strings[] = {text->title, stringGet(catalog->strings, text->author), stringGet(catalog->strings, text->name)};
+        for(int j=0; j<3 && success; j++){
+            size_t length = strlen(strings[j]);
+            checksums[i / CATALOG_CHUNK_ROWS] = crc32(checksums[i / CATALOG_CHUNK_ROWS], strings[j], length);
+            success = fwrite(strings[j], 1, length, fout) == length;
+        }
+    }
+
+    // Write block table (where each block's strings start, and checksum of each block's records and strings)
+    for(int i=0; i<numBlocks && success; i++){
+        unsigned char entry[SNAPSHOT_BLOCK_SIZE];
+        unsigned char *pos = entry;
+        putNumber(&pos, blockStrings[i], 8);
+        putNumber(&pos, checksums[i], 4);
+        success = fwrite(entry, 1, SNAPSHOT_BLOCK_SIZE, fout) == SNAPSHOT_BLOCK_SIZE;
+    }
+
+    // Fill in header (with its own checksum), then put file in place
+    unsigned char *pos = header;
+    memcpy(pos, SNAPSHOT_MAGIC, 8); pos += 8;
+    putNumber(&pos, SNAPSHOT_VERSION, 4);
+    putNumber(&pos, catalog->numRows, 4);
+    putNumber(&pos, SNAPSHOT_RECORD_SIZE, 4);
+    putNumber(&pos, CATALOG_CHUNK_ROWS, 4);
+    putNumber(&pos, stringOffset, 8);
+    putNumber(&pos, stamp->size, 8);
+    putNumber(&pos, stamp->modified, 8);
+    putNumber(&pos, crc32(0, header, pos - header), 4);
+    success = success && fseek(fout, 0, SEEK_SET) == 0 && fwrite(header, 1, SNAPSHOT_HEADER_SIZE, fout) == SNAPSHOT_HEADER_SIZE;
+    success = syncFile(fout) && success;
+    success = (fclose(fout) == 0) && success;
+    free(checksums);
+    free(blockStrings);
+    if(!success || !replaceFile(tmpPath, fileName)){
+        remove(tmpPath);
+        return 0;
+    }
+    return 1;
+}
+
+// Open binary snapshot file and use it to back the catalog (every block is checked when it is opened; books are read from the mapped file a chunk at a time, when first used)
+// If stamp is not NULL, the snapshot is only used if it was made from a database file with that stamp. Returns 1 if successful
+int snapshotOpen(char *fileName, struct catalog *catalog, struct file_stamp *stamp){
+    struct snapshot *snapshot = calloc(1, sizeof(struct snapshot));
+    if(snapshot == NULL || !mapFile(fileName, &snapshot->map)){
+        free(snapshot);
+        return 0;
+    }
+
+    // Check header
+    const unsigned char *pos = (const unsigned char*)snapshot->map.data;
+    const unsigned char *end = pos + snapshot->map.size;
+    long long version = 0, numRows = 0, recordSize = 0, blockRows = 0, stringSize = 0, stampSize = 0, stampModified = 0, checksum = 0;
+    int valid = snapshot->map.size >= SNAPSHOT_HEADER_SIZE && memcmp(pos, SNAPSHOT_MAGIC, 8) == 0;
+    if(valid){
+        pos += 8;
+        getNumber(&pos, end, &version, 4);
+        getNumber(&pos, end, &numRows, 4);
+        getNumber(&pos, end, &recordSize, 4);
+        getNumber(&pos, end, &blockRows, 4);
+        getNumber(&pos, end, &stringSize, 8);
+        getNumber(&pos, end, &stampSize, 8);
+        getNumber(&pos, end, &stampModified, 8);
+        size_t headerSize = pos - (const unsigned char*)snapshot->map.data;
+        getNumber(&pos, end, &checksum, 4);
+        valid = crc32(0, snapshot->map.data, headerSize) == (uint32_t)checksum && version == SNAPSHOT_VERSION
+                && recordSize == SNAPSHOT_RECORD_SIZE && blockRows == CATALOG_CHUNK_ROWS && numRows >= 0;
+    }
+    if(valid){      // Check file is big enough for everything the header says is in it
+        snapshot->numRows = numRows;
+        snapshot->numBlocks = (numRows + CATALOG_CHUNK_ROWS - 1) / CATALOG_CHUNK_ROWS;
+        snapshot->records = (const unsigned char*)snapshot->map.data + SNAPSHOT_HEADER_SIZE;
+        snapshot->strings = snapshot->records + (size_t)numRows * SNAPSHOT_RECORD_SIZE;
+        snapshot->stringSize = stringSize;
+        snapshot->blocks = snapshot->strings + stringSize;
+        valid = (size_t)stringSize <= snapshot->map.size && snapshot->blocks + (size_t)snapshot->numBlocks * SNAPSHOT_BLOCK_SIZE == end;
+    }
+    if(valid && stamp != NULL){     // Check snapshot is of current database file
+        valid = stamp->size == stampSize && stamp->modified == stampModified;
+    }
+    for(int i=0; i<snapshot->numBlocks && valid; i++){      // Check every block now, so reading a chunk later cannot fail on a corrupt one
+        valid = snapshotBlockValid(snapshot, i);
+        if(!valid){
+            fprintf(stderr, "Snapshot file is corrupt (block %d), so it is not used.\n", i);
+        }
+    }
+    if(!valid || !catalogReserveChunkTable(catalog, snapshot->numBlocks)){
+        unmapFile(&snapshot->map);
+        free(snapshot);
+        return 0;
+    }
+
+    // Catalog takes its rows from the snapshot (chunk table entries stay NULL until each chunk is read)
+    pthread_mutex_init(&snapshot->lock, NULL);
+    for(int i=0; i<snapshot->numBlocks; i++){
+        catalog->chunks[i] = NULL;
+    }
+    catalog->numChunks = snapshot->numBlocks;
+    catalog->numRows = snapshot->numRows;
+    catalog->snapshot = snapshot;
+    return 1;
+}
+
+// Check one block of snapshot file against its checksum, and that its records' strings are in its part of the string table, returning 1 if it is valid
+int snapshotBlockValid(struct snapshot *snapshot, int chunkNum){
+
+    // Find block's records and strings
+    int firstRow = chunkNum * CATALOG_CHUNK_ROWS;
+    int numRows = snapshot->numRows - firstRow < CATALOG_CHUNK_ROWS ? snapshot->numRows - firstRow : CATALOG_CHUNK_ROWS;
+    const unsigned char *records = snapshot->records + (size_t)firstRow * SNAPSHOT_RECORD_SIZE;
+    const unsigned char *pos = snapshot->blocks + (size_t)chunkNum * SNAPSHOT_BLOCK_SIZE;
+    long long stringStart = 0, stringEnd, checksum = 0;
+    getNumber(&pos, snapshot->blocks + snapshot->numBlocks * SNAPSHOT_BLOCK_SIZE, &stringStart, 8);
+    getNumber(&pos, snapshot->blocks + snapshot->numBlocks * SNAPSHOT_BLOCK_SIZE, &checksum, 4);
+    stringEnd = snapshot->stringSize;
+    if(chunkNum + 1 < snapshot->numBlocks){
+        const unsigned char *next = snapshot->blocks + (size_t)(chunkNum + 1) * SNAPSHOT_BLOCK_SIZE;
+        getNumber(&next, next + 8, &stringEnd, 8);
+    }
+    int valid = stringStart >= 0 && stringStart <= stringEnd && stringEnd <= snapshot->stringSize
+                && crc32(crc32(0, records, (size_t)numRows * SNAPSHOT_RECORD_SIZE), snapshot->strings + stringStart, stringEnd - stringStart) == (uint32_t)checksum;
+
+    // Check every string of every record fits in a book field and in the block's strings
+    for(int i=0; i<numRows && valid; i++){
+        long long offset = 0, length = 0;
+        pos = records + (size_t)i * SNAPSHOT_RECORD_SIZE + 20;      // (after ID, year and dates)
+        getNumber(&pos, pos + 8, &offset, 8);
+        for(int j=0; j<3 && valid; j++){
+            getNumber(&pos, pos + 1, &length, 1);
+            length &= 0xFF;
+            valid = length <= 50 && offset >= stringStart && offset + length <= stringEnd;
+            offset += length;
+        }
+    }
+    return valid;
+}
+
+// Read one chunk of the catalog from its snapshot file (already checked by snapshotOpen), returning the chunk (exits program if out of memory)
+struct catalog_chunk* snapshotLoadChunk(struct catalog *catalog, int chunkNum){
+    struct snapshot *snapshot = catalog->snapshot;
+    pthread_mutex_lock(&snapshot->lock);
+    struct catalog_chunk *chunk = catalog->chunks[chunkNum];
+    if(chunk != NULL){      // Another thread read it first
+        pthread_mutex_unlock(&snapshot->lock);
+        return chunk;
+    }
+    chunk = malloc(sizeof(struct catalog_chunk));
+    if(chunk == NULL){
+        fprintf(stderr, "Out of memory reading snapshot file.\n");
+        exit(EXIT_FAILURE);
+    }
+    chunk->references = 1;
+
+    // Decode block's records
+    int firstRow = chunkNum * CATALOG_CHUNK_ROWS;
+    int numRows = snapshot->numRows - firstRow < CATALOG_CHUNK_ROWS ? snapshot->numRows - firstRow : CATALOG_CHUNK_ROWS;
+    const unsigned char *records = snapshot->records + (size_t)firstRow * SNAPSHOT_RECORD_SIZE;
+    for(int i=0; i<numRows; i++){
+        struct book_text *text = &chunk->text[i];
+        long long index = 0, pub_year = 0, date_added = 0, date_out = 0, date_due = 0, offset = 0, lengths[3] = {0};
+        const unsigned char *pos = records + (size_t)i * SNAPSHOT_RECORD_SIZE;
+        const unsigned char *recordEnd = pos + SNAPSHOT_RECORD_SIZE;
+        getNumber(&pos, recordEnd, &index, 4);
+        getNumber(&pos, recordEnd, &pub_year, 4);
+        getNumber(&pos, recordEnd, &date_added, 4);
+        getNumber(&pos, recordEnd, &date_out, 4);
+        getNumber(&pos, recordEnd, &date_due, 4);
+        getNumber(&pos, recordEnd, &offset, 8);
+        for(int j=0; j<3; j++){
+            getNumber(&pos, recordEnd, &lengths[j], 1);
+            lengths[j] &= 0xFF;
+        }
+        chunk->index[i] = index;
+        chunk->pub_year[i] = pub_year;
+        text->date_added = date_added;
+        chunk->date_out[i] = date_out;
+        chunk->date_due[i] = date_due;
+
+        // Copy strings out of string table (author and name into the catalog's string pool)
+        char author[51], name[51];
+        char *strings[] = {text->title, author, name};
+        for(int j=0; j<3; j++){
+            memcpy(strings[j], snapshot->strings + offset, lengths[j]);
+            strings[j][lengths[j]] = '\0';
+            offset += lengths[j];
+        }
+        if((text->author = stringIntern(catalog->strings, author)) == STRING_NONE || (text->name = stringIntern(catalog->strings, name)) == STRING_NONE){
+            fprintf(stderr, "Out of memory reading snapshot file.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    catalog->chunks[chunkNum] = chunk;
+    pthread_mutex_unlock(&snapshot->lock);
+    return chunk;
+}
+
+// Close snapshot backing catalog
+void snapshotClose(struct snapshot *snapshot){
+    unmapFile(&snapshot->map);
+    pthread_mutex_destroy(&snapshot->lock);
+    free(snapshot);
+}
+
+// Read catalog from its snapshot file if it is up to date, otherwise from the database file (and then make a new snapshot), or from its shard files if it is split
+int loadCatalog(char *fileName, struct catalog *catalog, struct load_stats *stats){
+    double start = nowSeconds();
+    int loaded = loadCatalogFiles(fileName, catalog, stats);
+    metricsRecord(METRIC_LOAD, start, loaded);
+    return loaded;
+}
+
+int loadCatalogFiles(char *fileName, struct catalog *catalog, struct load_stats *stats){
+
+    // Database split into shard files: read them all in parallel (they have no snapshot, as only changed shards are written)
+    catalog->numShards = shardCount(fileName);
+    if(catalog->numShards > 1){
+        char (*paths)[SHARD_PATH_LENGTH] = malloc(catalog->numShards * sizeof(*paths));
+        char *fileNames[SHARD_MAX];
+        int success = paths != NULL;
+        for(int i=0; i<catalog->numShards && success; i++){
+            success = shardPath(fileName, i, catalog->numShards, paths[i]);
+            fileNames[i] = paths[i];
+        }
+        success = success && csvFilesToStructs(fileNames, catalog->numShards, catalog, stats);
+        free(paths);
+        return success;
+    }
+
+    char snapshotPath[MAX_PATH_LENGTH];
+    struct file_stamp stamp;
+    snprintf(snapshotPath, MAX_PATH_LENGTH, "%s.snap", fileName);
+    if(!getFileStamp(fileName, &stamp)){
+        return 0;
+    }
+
+    double start_time = nowSeconds();
+    if(snapshotOpen(snapshotPath, catalog, &stamp)){
+        memset(stats, 0, sizeof(*stats));
+        stats->rows = catalog->numRows;
+        stats->bytes = catalog->snapshot->map.size;
+        stats->threads = 1;
+        stats->seconds = nowSeconds() - start_time;
+        stats->fromSnapshot = 1;
+        return 1;
+    }
+
+    if(!csvToStructs(fileName, catalog, stats)){
+        return 0;
+    }
+    if(!writeSnapshotFile(snapshotPath, catalog, &stamp)){
+        fprintf(stderr, "Snapshot file, \"%s\", cannot be written.\n", snapshotPath);
+    }
+    return 1;
+}
+
+// Convert between database file (CSV) and binary snapshot file, returning 1 if successful
+int convertFile(char *from, char *to, int toSnapshot){
+    struct catalog catalog;
+    struct load_stats stats;
+    int success;
+    catalogInit(&catalog);
+    if(toSnapshot){
+        struct file_stamp stamp;
+        success = getFileStamp(from, &stamp) && csvToStructs(from, &catalog, &stats) && writeSnapshotFile(to, &catalog, &stamp);
+    }
+    else{
+        success = snapshotOpen(from, &catalog, NULL);       // (every block is checked against its checksum as it is opened)
+        if(success){
+            char tmpPath[MAX_PATH_LENGTH];
+            snprintf(tmpPath, MAX_PATH_LENGTH, "%s.tmp", to);
+            success = writeCsvFile(tmpPath, &catalog) && replaceFile(tmpPath, to);
+        }
+    }
+    if(success){
+        printf("%d books written to \"%s\".\n", catalog.numRows, to);
+    }
+    else{
+        printf("Cannot convert \"%s\" to \"%s\".\n", from, to);
+    }
+    catalogFree(&catalog);
+    return success;
+}
+
+// Get distinct trigrams (every 3 char run, upper-case, packed into a number) of text, returning number found
+int getTrigrams(const char *text, uint32_t *trigrams){
+    int numTrigrams = 0;
+    size_t length = strlen(text);
+    for(size_t i=0; i+2<length; i++){
+        uint32_t trigram = (uint32_t)toupper((unsigned char)text[i]) << 16 | (uint32_t)toupper((unsigned char)text[i+1]) << 8 | toupper((unsigned char)text[i+2]);
+
+        // Insert in order, skipping repeats (strings are short, so insertion sort is quickest)
+        int pos = numTrigrams;
+        while(pos > 0 && trigrams[pos-1] > trigram){
+            pos--;
+        }
+        if(pos > 0 && trigrams[pos-1] == trigram){
+            continue;
+        }
+        memmove(&trigrams[pos+1], &trigrams[pos], (numTrigrams - pos) * sizeof(uint32_t));
+        trigrams[pos] = trigram;
+        numTrigrams++;
+    }
+    return numTrigrams;
+}
+
+// Find posting list for trigram in index (creating it if create is 1), returning NULL if it is not there (or out of memory)
+struct posting_list* trigramList(struct trigram_index *index, uint32_t trigram, int create){
+    if(index->tableSize == 0 || (create && (index->numLists + 1) * 2 > index->tableSize)){
+        if(!create){
+            return NULL;
+        }
+
+        // Double size of hash table (only the list headers move, not the rows in them)
+        int newSize = index->tableSize ? index->tableSize * 2 : 1024;
+        struct posting_list *newLists = calloc(newSize, sizeof(struct posting_list));
+        if(newLists == NULL){
+            return NULL;
+        }
+        for(int i=0; i<index->tableSize; i++){
+            if(index->lists[i].trigram != 0){
+                uint32_t slot = (index->lists[i].trigram * 2654435761u) & (newSize - 1);
+                while(newLists[slot].trigram != 0){
+                    slot = (slot + 1) & (newSize - 1);
+                }
+                newLists[slot] = index->lists[i];
+            }
+        }
+        free(index->lists);
+        index->lists = newLists;
+        index->tableSize = newSize;
+    }
+
+    // Look up trigram (linear probing, trigram 0 marks an empty slot since text never contains '\0')
+    uint32_t slot = (trigram * 2654435761u) & (index->tableSize - 1);
+    while(index->lists[slot].trigram != trigram){
+        if(index->lists[slot].trigram == 0){
+            if(!create){
+                return NULL;
+            }
+            index->lists[slot].trigram = trigram;
+            index->numLists++;
+            break;
+        }
+        slot = (slot + 1) & (index->tableSize - 1);
+    }
+    return &index->lists[slot];
+}
+
+// Find position of row in posting list (or where it would go), using binary search
+int postingFind(struct posting_list *list, int row){
+    int low = 0, high = list->count;
+    while(low < high){
+        int middle = (low + high) / 2;
+        if(list->rows[middle] < row){
+            low = middle + 1;
+        }
+        else{
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Add row to index under every trigram of text, returning 0 if out of memory
+int trigramAdd(struct trigram_index *index, int row, const char *text){
+    uint32_t trigrams[64];
+    int numTrigrams = getTrigrams(text, trigrams);
+    for(int i=0; i<numTrigrams; i++){
+        struct posting_list *list = trigramList(index, trigrams[i], 1);
+        if(list == NULL){
+            return 0;
+        }
+        if(list->count == list->capacity){
+            int newCapacity = list->capacity ? list->capacity * 2 : 4;
+            int *newRows = realloc(list->rows, newCapacity * sizeof(int));
+            if(newRows == NULL){
+                return 0;
+            }
+            list->rows = newRows;
+            list->capacity = newCapacity;
+        }
+
+        // Keep rows in order (new books are added at the end, so this is normally an append)
+        int pos = (list->count == 0 || list->rows[list->count-1] < row) ? list->count : postingFind(list, row);
+        if(pos < list->count && list->rows[pos] == row){
+            continue;
+        }
+        memmove(&list->rows[pos+1], &list->rows[pos], (list->count - pos) * sizeof(int));
+        list->rows[pos] = row;
+        list->count++;
+        index->postings++;
+    }
+    return 1;
+}
+
+// Remove row from index under every trigram of text
+void trigramRemove(struct trigram_index *index, int row, const char *text){
+    uint32_t trigrams[64];
+    int numTrigrams = getTrigrams(text, trigrams);
+    for(int i=0; i<numTrigrams; i++){
+        struct posting_list *list = trigramList(index, trigrams[i], 0);
+        if(list != NULL){
+            int pos = postingFind(list, row);
+            if(pos < list->count && list->rows[pos] == row){
+                memmove(&list->rows[pos], &list->rows[pos+1], (list->count - pos - 1) * sizeof(int));
+                list->count--;
+                index->postings--;
+            }
+        }
+    }
+}
+
+// Free all memory used by trigram index
+void trigramFree(struct trigram_index *index){
+    for(int i=0; i<index->tableSize; i++){
+        free(index->lists[i].rows);
+    }
+    free(index->lists);
+    memset(index, 0, sizeof(*index));
+}
+
+// Find rows that have every trigram of term (term must be at least 3 chars), returning them in order (NULL if out of memory)
+int* trigramCandidates(struct trigram_index *index, const char *term, int *numCandidates){
+    uint32_t trigrams[64];
+    struct posting_list *lists[64];
+    int numTrigrams = getTrigrams(term, trigrams);
+    *numCandidates = 0;
+
+    // Get posting list of every trigram (if any trigram has no list, nothing can match)
+    for(int i=0; i<numTrigrams; i++){
+        lists[i] = trigramList(index, trigrams[i], 0);
+        if(lists[i] == NULL || lists[i]->count == 0){
+            return calloc(1, sizeof(int));
+        }
+    }
+
+    // Sort lists shortest first, so the intersection starts as small as possible
+    for(int i=1; i<numTrigrams; i++){
+        struct posting_list *list = lists[i];
+        int j = i;
+        while(j > 0 && lists[j-1]->count > list->count){
+            lists[j] = lists[j-1];
+            j--;
+        }
+        lists[j] = list;
+    }
+
+    // Intersect lists (keep rows of shortest list that are in every other list)
+    int *candidates = malloc(lists[0]->count * sizeof(int));
+    if(candidates == NULL){
+        return NULL;
+    }
+    memcpy(candidates, lists[0]->rows, lists[0]->count * sizeof(int));
+    int count = lists[0]->count;
+    for(int i=1; i<numTrigrams && count>0; i++){
+        int kept = 0;
+        for(int j=0; j<count; j++){
+            int pos = postingFind(lists[i], candidates[j]);
+            if(pos < lists[i]->count && lists[i]->rows[pos] == candidates[j]){
+                candidates[kept++] = candidates[j];
+            }
+        }
+        count = kept;
+    }
+    *numCandidates = count;
+    return candidates;
+}
+
+// Make sure search index has been built (it is built the first time it is needed, then kept up to date by every change), returning 0 if out of memory
+int searchIndexReady(struct catalog *catalog){
+    struct search_index *search = &catalog->search;
+    if(search->built){
+        return 1;
+    }
+    for(int i=0; i<catalog->numRows; i++){
+        if(catalogId(catalog, i) == BOOK_DELETED){        // Skip deleted rows
+            continue;
+        }
+        struct book_text *text = catalogText(catalog, i);
+        if(!trigramAdd(&search->title, i, text->title) || !trigramAdd(&search->author, i, stringGet(catalog->strings, text->author))){
+            searchIndexFree(catalog);
+            return 0;
+        }
+    }
+    search->built = 1;
+    return 1;
+}
+
+// Update search index for a change to the catalog (called after the change is made, with oldBook NULL for an add and newBook NULL for a delete)
+void searchIndexUpdate(struct catalog *catalog, int row, struct book *oldBook, struct book *newBook){
+    struct search_index *search = &catalog->search;
+    if(!search->built){
+        return;
+    }
+    if(oldBook != NULL && newBook != NULL && strcmp(oldBook->title, newBook->title) == 0 && strcmp(oldBook->author, newBook->author) == 0){
+        return;     // Nothing indexed has changed
+    }
+    if(oldBook != NULL){
+        trigramRemove(&search->title, row, oldBook->title);
+        trigramRemove(&search->author, row, oldBook->author);
+    }
+    if(newBook != NULL && (!trigramAdd(&search->title, row, newBook->title) || !trigramAdd(&search->author, row, newBook->author))){
+        searchIndexFree(catalog);       // Out of memory, so drop index (searches scan catalog instead)
+    }
+}
+
+// Free search index
+void searchIndexFree(struct catalog *catalog){
+    trigramFree(&catalog->search.title);
+    trigramFree(&catalog->search.author);
+    catalog->search.built = 0;
+}
+
+// Find rows of books whose title or author contains term, ignoring case (term must already be upper-case)
+// Uses the trigram index for terms of 3 or more chars, otherwise scans catalog with the search kernel. Returns rows in order (NULL if out of memory)
+int* findBooks(struct catalog *catalog, int field, char *term, int *numMatches){
+    int *matches;
+    int count = 0;
+    size_t termLength = strlen(term);
+    *numMatches = 0;
+
+    if(termLength >= 3 && searchIndexReady(catalog)){
+        // Only check books that have every trigram of term
+        int numCandidates;
+        matches = trigramCandidates(field == FIELD_TITLE ? &catalog->search.title : &catalog->search.author, term, &numCandidates);
+        if(matches == NULL){
+            return NULL;
+        }
+        for(int i=0; i<numCandidates; i++){
+            struct book_text *text = catalogText(catalog, matches[i]);
+            if(catalogId(catalog, matches[i]) != BOOK_DELETED && containsIgnoreCase(field == FIELD_TITLE ? text->title : stringGet(catalog->strings, text->author), term, termLength)){
+                matches[count++] = matches[i];
+            }
+        }
+    }
+    else{
+        // Go through every book
+        matches = malloc((catalog->numRows ? catalog->numRows : 1) * sizeof(int));
+        if(matches == NULL){
+            return NULL;
+        }
+        for(int i=0; i<catalog->numRows; i++){
+            struct book_text *text = catalogText(catalog, i);
+            if(catalogId(catalog, i) != BOOK_DELETED && containsIgnoreCase(field == FIELD_TITLE ? text->title : stringGet(catalog->strings, text->author), term, termLength)){
+                matches[count++] = i;
+            }
+        }
+    }
+    *numMatches = count;
+    return matches;
+}
+
+// Find rows of books by exactly the given author (compares string pool handles, so no text is read), returning rows in order (NULL if out of memory)
+int* findBooksByAuthor(struct catalog *catalog, const char *author, int *numMatches){
+    int count = 0;
+    *numMatches = 0;
+    int *matches = malloc((catalog->numRows ? catalog->numRows : 1) * sizeof(int));
+    if(matches == NULL){
+        return NULL;
+    }
+    uint32_t handle = STRING_NONE;
+    for(int first=0; first<catalog->numRows; first+=CATALOG_CHUNK_ROWS){
+        struct catalog_chunk *chunk = catalogChunk(catalog, first);
+        if(handle == STRING_NONE && (handle = stringFind(catalog->strings, author)) == STRING_NONE){     // No book read so far has that author (chunks still in the snapshot file are not in the pool yet)
+            continue;
+        }
+        int numRows = catalog->numRows - first < CATALOG_CHUNK_ROWS ? catalog->numRows - first : CATALOG_CHUNK_ROWS;
+        for(int i=0; i<numRows; i++){
+            if(chunk->text[i].author == handle && chunk->index[i] != BOOK_DELETED){
+                matches[count++] = first + i;
+            }
+        }
+    }
+    *numMatches = count;
+    return matches;
+}
+
+// Get fewest edits (insert, delete, change or swap two neighbouring chars) that turn term into some part of text, ignoring case (term must already be upper-case)
+// Returns maxDistance + 1 if it takes more than maxDistance
+int fuzzyDistance(const char *term, size_t termLength, const char *text, int maxDistance){
+    size_t textLength = strlen(text);
+    if(termLength > 50){
+        return maxDistance + 1;
+    }
+    int rows[3][52];        // Last three rows of edit distance table (one row per char of text, one column per char of term)
+    int *before = rows[0], *previous = rows[1], *current = rows[2];
+    for(size_t i=0; i<=termLength; i++){        // Before any text, term costs one edit per char
+        previous[i] = i;
+    }
+    int best = previous[termLength];
+    for(size_t j=1; j<=textLength; j++){
+        char c = toupper((unsigned char)text[j-1]);
+        current[0] = 0;     // Match can start anywhere in text
+        for(size_t i=1; i<=termLength; i++){
+            int cost = previous[i-1] + (term[i-1] != c);
+            if(previous[i] + 1 < cost){
+                cost = previous[i] + 1;
+            }
+            if(current[i-1] + 1 < cost){
+                cost = current[i-1] + 1;
+            }
+            if(i > 1 && j > 1 && term[i-1] == toupper((unsigned char)text[j-2]) && term[i-2] == c && before[i-2] + 1 < cost){      // Two chars swapped
+                cost = before[i-2] + 1;
+            }
+            current[i] = cost;
+        }
+        if(current[termLength] < best){
+            best = current[termLength];
+        }
+        if(best == 0){      // Term is in text, so nothing can be closer
+            break;
+        }
+        int *spare = before;
+        before = previous;
+        previous = current;
+        current = spare;
+    }
+    return best <= maxDistance ? best : maxDistance + 1;
+}
+
+// Check if fuzzy match a is worse than b (more edits, then fewer shared trigrams, then later row)
+int fuzzyWorse(struct fuzzy_match *a, struct fuzzy_match *b){
+    if(a->distance != b->distance){
+        return a->distance > b->distance;
+    }
+    if(a->shared != b->shared){
+        return a->shared < b->shared;
+    }
+    return a->row > b->row;
+}
+
+// Offer match to bounded heap of best k matches (worst at the top, so it is the one replaced by a better match)
+void fuzzyOffer(struct fuzzy_match *heap, int *count, int k, struct fuzzy_match *match){
+    int pos;
+    if(*count < k){     // Heap not full, so add match and sift it up
+        pos = (*count)++;
+        while(pos > 0 && fuzzyWorse(match, &heap[(pos-1)/2])){
+            heap[pos] = heap[(pos-1)/2];
+            pos = (pos - 1) / 2;
+        }
+        heap[pos] = *match;
+        return;
+    }
+    if(k == 0 || !fuzzyWorse(&heap[0], match)){       // No better than the worst kept
+        return;
+    }
+    pos = 0;        // Replace worst and sift it down
+    while(pos * 2 + 1 < *count){
+        int child = pos * 2 + 1;
+        if(child + 1 < *count && fuzzyWorse(&heap[child+1], &heap[child])){
+            child++;
+        }
+        if(!fuzzyWorse(&heap[child], match)){
+            break;
+        }
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = *match;
+}
+
+// Compare fuzzy matches for qsort (best first)
+int compareFuzzyMatches(const void *a, const void *b){
+    struct fuzzy_match *first = (struct fuzzy_match*)a, *second = (struct fuzzy_match*)b;
+    return fuzzyWorse(first, second) - fuzzyWorse(second, first);
+}
+
+// Find up to k books whose title or author is closest to term (a few typos allowed), best first (term must already be upper-case; NULL if out of memory)
+// A book with n edits can only have lost 4n of the term's trigrams (3 for a changed char, 4 for two swapped ones), so only books in enough of the term's
+// posting lists are checked. Terms too short to be sure of sharing any trigram check every book (terms under 3 chars must be contained exactly)
+struct fuzzy_match* fuzzyFindBooks(struct catalog *catalog, int field, char *term, int k, int *numMatches){
+    size_t termLength = strlen(term);
+    int maxDistance = termLength < 3 ? 0 : termLength < 6 ? 1 : 2;     // Edits allowed (more for longer terms)
+    *numMatches = 0;
+    if(k > FUZZY_MAX_RESULTS){
+        k = FUZZY_MAX_RESULTS;
+    }
+    struct fuzzy_match *heap = malloc((k + 1) * sizeof(struct fuzzy_match));
+    if(heap == NULL){
+        return NULL;
+    }
+    struct fuzzy_match match;
+    int count = 0;
+
+    // A match must share minShared of the term's trigrams
+    uint32_t trigrams[64];
+    int numTrigrams = getTrigrams(term, trigrams);
+    int minShared = numTrigrams - 4 * maxDistance;
+
+    // Short term (or no index): check every book
+    if(termLength < 3 || minShared < 1 || !searchIndexReady(catalog)){
+        for(int row=0; row<catalog->numRows; row++){
+            struct book_text *text = catalogText(catalog, row);
+            if(catalogId(catalog, row) == BOOK_DELETED){
+                continue;
+            }
+            match.row = row;
+            match.shared = 0;
+            match.distance = fuzzyDistance(term, termLength, field == FIELD_TITLE ? text->title : stringGet(catalog->strings, text->author), maxDistance);
+            if(match.distance <= maxDistance){
+                fuzzyOffer(heap, &count, k, &match);
+            }
+        }
+        qsort(heap, count, sizeof(struct fuzzy_match), compareFuzzyMatches);
+        *numMatches = count;
+        return heap;
+    }
+
+    // Get posting list of every trigram of term, shortest first
+    struct trigram_index *index = field == FIELD_TITLE ? &catalog->search.title : &catalog->search.author;
+    struct posting_list *lists[64];
+    int numLists = 0;
+    for(int i=0; i<numTrigrams; i++){
+        struct posting_list *list = trigramList(index, trigrams[i], 0);
+        if(list == NULL || list->count == 0){
+            continue;       // (no book has it, so it counts towards nobody)
+        }
+        int j = numLists++;
+        while(j > 0 && lists[j-1]->count > list->count){
+            lists[j] = lists[j-1];
+            j--;
+        }
+        lists[j] = list;
+    }
+
+    // A match must be in one of the shortest numLists - minShared + 1 lists: candidates are the rows of those lists
+    int numProbe = numLists - minShared + 1;        // Lists candidates are taken from (the rest are only searched)
+    if(numProbe <= 0){
+        *numMatches = 0;
+        return heap;
+    }
+    long long numCandidates = 0;
+    for(int i=0; i<numProbe; i++){
+        numCandidates += lists[i]->count;
+    }
+    int *candidates = malloc((numCandidates + 1) * sizeof(int));
+    if(candidates == NULL){
+        free(heap);
+        return NULL;
+    }
+    numCandidates = 0;
+    for(int i=0; i<numProbe; i++){
+        memcpy(candidates + numCandidates, lists[i]->rows, lists[i]->count * sizeof(int));
+        numCandidates += lists[i]->count;
+    }
+    qsort(candidates, numCandidates, sizeof(int), compareRows);
+
+    // Count trigrams each candidate shares with term (each run of a row is the lists it was taken from), then rank those with enough
+    for(long long i=0; i<numCandidates; ){
+        int row = candidates[i];
+        int shared = 0;
+        while(i < numCandidates && candidates[i] == row){
+            shared++;
+            i++;
+        }
+        for(int j=numProbe; j<numLists && shared + (numLists - j) >= minShared; j++){
+            int pos = postingFind(lists[j], row);
+            shared += pos < lists[j]->count && lists[j]->rows[pos] == row;
+        }
+        if(shared < minShared || catalogId(catalog, row) == BOOK_DELETED){
+            continue;
+        }
+        struct book_text *text = catalogText(catalog, row);
+        match.row = row;
+        match.shared = shared;
+        match.distance = fuzzyDistance(term, termLength, field == FIELD_TITLE ? text->title : stringGet(catalog->strings, text->author), maxDistance);
+        if(match.distance <= maxDistance){
+            fuzzyOffer(heap, &count, k, &match);
+        }
+    }
+    free(candidates);
+    qsort(heap, count, sizeof(struct fuzzy_match), compareFuzzyMatches);
+    *numMatches = count;
+    return heap;
+}
+
+// Check if text starts with term, ignoring case (term must already be upper-case)
+int matchAt(const char *text, const char *term, size_t termLength){
+    for(size_t i=0; i<termLength; i++){
+        if(toupper((unsigned char)text[i]) != (unsigned char)term[i]){     // (also stops at end of text, as term never contains '\\0')
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Scalar kernel: check if 51 char book field contains term, ignoring case (term must already be upper-case)
+int containsScalar(const char *text, const char *term, size_t termLength){
+    if(termLength == 0){
+        return 1;
+    }
+    int first = (unsigned char)term[0];
+    for(; *text != '\0'; text++){
+        if(toupper((unsigned char)*text) == first && matchAt(text, term, termLength)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#ifdef HAVE_X86_KERNELS
+// Find positions in 16 chars of text where first two chars of term could start (after case folding), for vector kernels
+// Letters are folded by setting bit 0x20, so "a" and "A" both become "a" (other chars are compared exactly)
+__attribute__((target("sse2")))
+unsigned candidatesSse2(const char *text, __m128i firstFold, __m128i firstChar, __m128i secondFold, __m128i secondChar, unsigned *nulls){
+    __m128i block = _mm_loadu_si128((const __m128i*)text);
+    __m128i next = _mm_loadu_si128((const __m128i*)(text + 1));
+    *nulls = _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_setzero_si128()));
+    return _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(_mm_or_si128(block, firstFold), firstChar),
+                                           _mm_cmpeq_epi8(_mm_or_si128(next, secondFold), secondChar)));
+}
+
+// Check candidate positions found by a vector kernel (only those before the end of the text), returning 1 if term is at any of them
+int checkCandidates(const char *text, unsigned candidates, unsigned nulls, const char *term, size_t termLength){
+    if(nulls){
+        candidates &= (nulls & -nulls) - 1;     // Only positions before first '\0'
+    }
+    while(candidates){
+        if(matchAt(text + __builtin_ctz(candidates), term, termLength)){
+            return 1;
+        }
+        candidates &= candidates - 1;       // Next candidate
+    }
+    return 0;
+}
+
+// SSE2 kernel: check if 51 char book field contains term, ignoring case, 16 chars at a time (term must already be upper-case)
+__attribute__((target("sse2")))
+int containsSse2(const char *text, const char *term, size_t termLength){
+    if(termLength < 2){     // Needs two chars to filter on
+        return containsScalar(text, term, termLength);
+    }
+    int first = (unsigned char)term[0], second = (unsigned char)term[1];
+    __m128i firstFold = _mm_set1_epi8(isupper(first) ? 0x20 : 0), firstChar = _mm_set1_epi8(isupper(first) ? first | 0x20 : first);
+    __m128i secondFold = _mm_set1_epi8(isupper(second) ? 0x20 : 0), secondChar = _mm_set1_epi8(isupper(second) ? second | 0x20 : second);
+
+    unsigned nulls;
+    for(int i=0; i<48; i+=16){
+        unsigned candidates = candidatesSse2(text + i, firstFold, firstChar, secondFold, secondChar, &nulls);
+        if(checkCandidates(text + i, candidates, nulls, term, termLength)){
+            return 1;
+        }
+        if(nulls){
+            return 0;
+        }
+    }
+    return containsScalar(text + 48, term, termLength);     // Last few chars of field
+}
+
+// AVX2 kernel: same as SSE2 kernel, but first 32 chars at once
+__attribute__((target("avx2")))
+int containsAvx2(const char *text, const char *term, size_t termLength){
+    if(termLength < 2){
+        return containsScalar(text, term, termLength);
+    }
+    int first = (unsigned char)term[0], second = (unsigned char)term[1];
+    __m256i block = _mm256_loadu_si256((const __m256i*)text);
+    __m256i next = _mm256_loadu_si256((const __m256i*)(text + 1));
+    unsigned nulls = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_setzero_si256()));
+    unsigned candidates = _mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(_mm256_or_si256(block, _mm256_set1_epi8(isupper(first) ? 0x20 : 0)), _mm256_set1_epi8(isupper(first) ? first | 0x20 : first)),
+        _mm256_cmpeq_epi8(_mm256_or_si256(next, _mm256_set1_epi8(isupper(second) ? 0x20 : 0)), _mm256_set1_epi8(isupper(second) ? second | 0x20 : second))));
+    if(checkCandidates(text, candidates, nulls, term, termLength)){
+        return 1;
+    }
+    if(nulls){
+        return 0;
+    }
+
+    // Chars 32-47 (SSE2), then last few chars of field
+    candidates = candidatesSse2(text + 32, _mm_set1_epi8(isupper(first) ? 0x20 : 0), _mm_set1_epi8(isupper(first) ? first | 0x20 : first),
+                                _mm_set1_epi8(isupper(second) ? 0x20 : 0), _mm_set1_epi8(isupper(second) ? second | 0x20 : second), &nulls);
+    if(checkCandidates(text + 32, candidates, nulls, term, termLength)){
+        return 1;
+    }
+    if(nulls){
+        return 0;
+    }
+    return containsScalar(text + 48, term, termLength);
+}
+#endif
+
+// Pick fastest kernel the CPU supports (called once, before first search)
+void chooseMatchKernel(void){
+    for(int i=0; matchKernels[i].name != NULL; i++){
+        if(matchKernelSupported(i)){
+            fieldContains = matchKernels[i].function;
+        }
+    }
+}
+
+// Check if CPU supports kernel
+int matchKernelSupported(int kernel){
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if(matchKernels[kernel].function == containsSse2){
+        return __builtin_cpu_supports("sse2");
+    }
+    if(matchKernels[kernel].function == containsAvx2){
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return 1;
+}
+
+// Check if 51 char book field contains term, ignoring case (term must already be upper-case), using fastest kernel
+int containsIgnoreCase(const char *text, const char *term, size_t termLength){
+    static pthread_once_t kernelChosen = PTHREAD_ONCE_INIT;
+    pthread_once(&kernelChosen, chooseMatchKernel);
+    return fieldContains(text, term, termLength);
+}
+
+// Microbenchmark for match kernels: checks every kernel gives the same results as the original search
+// (upper-case copy of field + strstr), then reports speed of each. Returns 1 if all kernels agree
+int benchmarkKernels(int numRows){
+    const char *words[] = {"The", "Lord", "of", "the", "Rings", "Harry", "Potter", "and", "Great", "Gatsby", "War", "Peace",
+                           "Mockingbird", "Pride", "Prejudice", "Hobbit", "Little", "Women", "Moby", "Dick", "Time", "Machine"};
+    const char *terms[] = {"THE", "LORD OF", "HARRY POTTER AND", "Q", "MOCKINGBIRD", "K. R", "ZZ"};
+    int numWords = sizeof(words) / sizeof(words[0]);
+    int numTerms = sizeof(terms) / sizeof(terms[0]);
+
+    // Make catalog of made-up books (same every run)
+    struct catalog catalog;
+    catalogInit(&catalog);
+    unsigned long long seed = 12345;
+    for(int i=0; i<numRows; i++){
+        struct book book = {0};
+        strcpy(book.name, "0");
+        for(int field=0; field<2; field++){
+            char *text = field ? book.author : book.title;
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            int numTextWords = 1 + (seed >> 33) % 6;
+            for(int j=0; j<numTextWords; j++){
+                seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                const char *word = words[(seed >> 33) % numWords];
+                if(strlen(text) + strlen(word) + 1 > 50) break;
+                if(j > 0) strcat(text, (seed >> 40) % 7 ? " " : ". ");
+                if(strlen(text) + strlen(word) > 50) break;
+                strcat(text, word);
+            }
+        }
+        int row = catalogAppend(&catalog);
+        if(row == -1 || !catalogWrite(&catalog, row, &book)){
+            printf("Out of memory.\n");
+            catalogFree(&catalog);
+            return 0;
+        }
+    }
+
+    // Get expected results the original way
+    char *expected = malloc((size_t)numRows * 2 * numTerms);
+    if(expected == NULL){
+        printf("Out of memory.\n");
+        catalogFree(&catalog);
+        return 0;
+    }
+    size_t textBytes = 0;
+    for(int i=0; i<numRows; i++){
+        struct book_text *book = catalogText(&catalog, i);
+        const char *author = stringGet(catalog.strings, book->author);
+        textBytes += strlen(book->title) + strlen(author);
+        for(int field=0; field<2; field++){
+            char temp[51];
+            strcpy(temp, field ? author : book->title);
+            for(int k=0; temp[k] != '\0'; k++){
+                temp[k] = toupper((unsigned char)temp[k]);
+            }
+            for(int t=0; t<numTerms; t++){
+                expected[((size_t)i*2 + field)*numTerms + t] = strstr(temp, terms[t]) != NULL;
+            }
+        }
+    }
+
+    // Run every kernel over every term, checking each result
+    int allAgree = 1;
+    printf("%-8s %-18s %10s %10s %s\n", "kernel", "term", "matches", "GB/s", "check");
+    for(int k=0; matchKernels[k].name != NULL; k++){
+        if(!matchKernelSupported(k)){
+            printf("%-8s (not supported by this CPU)\n", matchKernels[k].name);
+            continue;
+        }
+        double totalSeconds = 0;
+        for(int t=0; t<numTerms; t++){
+            size_t termLength = strlen(terms[t]);
+            int matches = 0, agree = 1;
+            double start_time = nowSeconds();
+            for(int i=0; i<numRows; i++){
+                struct book_text *book = catalogText(&catalog, i);
+                int inTitle = matchKernels[k].function(book->title, terms[t], termLength);
+                int inAuthor = matchKernels[k].function(stringGet(catalog.strings, book->author), terms[t], termLength);
+                matches += inTitle + inAuthor;
+                agree &= (inTitle == expected[((size_t)i*2)*numTerms + t]) && (inAuthor == expected[((size_t)i*2 + 1)*numTerms + t]);
+            }
+            double seconds = nowSeconds() - start_time;
+            totalSeconds += seconds;
+            allAgree &= agree;
+            printf("%-8s %-18s %10d %10.2f %s\n", matchKernels[k].name, terms[t], matches, textBytes / 1e9 / seconds, agree ? "ok" : "MISMATCH");
+        }
+        printf("%-8s %-18s %10s %10.2f\n\n", matchKernels[k].name, "(all terms)", "", textBytes * numTerms / 1e9 / totalSeconds);
+    }
+
+    free(expected);
+    catalogFree(&catalog);
+    return allAgree;
+}
+
+// Thread for metrics microbenchmark: counts made-up operations as fast as it can
+void* benchMetricsTask(void *argument){
+    struct metrics_bench *bench = argument;
+    double start_time = nowSeconds();
+    for(int i=0; i<bench->numRecords; i++){
+        metricsRecord(METRIC_SEARCH, nowSeconds(), 1);
+    }
+    bench->seconds = nowSeconds() - start_time;
+    return NULL;
+}
+
+// Metrics microbenchmark: times counting an operation (as each one is counted, with a clock read at its start), on one thread and then on every CPU at once,
+// against reading the clock alone and against the cheapest real operation (a borrow or return of a book in memory). Returns 1 if it ran
+int benchmarkMetrics(int numRecords){
+    if(numRecords < 1){
+        numRecords = 1;
+    }
+
+    // Clock read alone
+    double start_time = nowSeconds(), total = 0;
+    for(int i=0; i<numRecords; i++){
+        total += nowSeconds();
+    }
+    double clockNs = (nowSeconds() - start_time) * 1e9 / numRecords;
+    printf("%-28s %10.1f ns%s\n", "clock read", clockNs, total < 0 ? " " : "");        // (total used, so reads cannot be optimised away)
+
+    // Counting on 1 thread, then on 2, 4, ... up to every CPU at once (each thread counts in its own shard, so they should not slow each other down)
+    struct metrics_bench benches[LOAD_MAX_THREADS];
+    pthread_t threads[LOAD_MAX_THREADS];
+    int maxThreads = cpuCount() < LOAD_MAX_THREADS ? cpuCount() : LOAD_MAX_THREADS;
+    double recordNs = 0;
+    for(int numThreads=1; numThreads<=maxThreads; numThreads = numThreads < maxThreads && numThreads * 2 > maxThreads ? maxThreads : numThreads * 2){
+        int numStarted = 0;
+        for(; numStarted<numThreads; numStarted++){
+            benches[numStarted].numRecords = numRecords;
+            if(pthread_create(&threads[numStarted], NULL, benchMetricsTask, &benches[numStarted]) != 0){
+                break;
+            }
+        }
+        double slowest = 0;
+        for(int i=0; i<numStarted; i++){
+            pthread_join(threads[i], NULL);
+            slowest = benches[i].seconds > slowest ? benches[i].seconds : slowest;
+        }
+        double ns = slowest * 1e9 / numRecords;
+        if(numThreads == 1){
+            recordNs = ns;
+        }
+        char label[32];
+        snprintf(label, sizeof(label), "record (%d thread%s)", numStarted, numStarted == 1 ? "" : "s");
+        printf("%-28s %10.1f ns\n", label, ns);
+        if(numThreads == maxThreads){
+            break;
+        }
+    }
+
+    // Borrow and return books of a small catalog in memory (no journal), each change counted as usual
+    struct catalog catalog;
+    catalogInit(&catalog);
+    int numBooks = 10000;
+    for(int i=0; i<numBooks; i++){
+        struct book book = {0};
+        book.index = i;
+        snprintf(book.title, sizeof(book.title), "Book %d", i);
+        snprintf(book.author, sizeof(book.author), "Author %d", i % 100);
+        strcpy(book.name, "0");
+        book.pub_year = 2000;
+        int row = catalogAppend(&catalog);
+        if(row == -1 || !catalogWrite(&catalog, row, &book)){
+            printf("Out of memory.\n");
+            catalogFree(&catalog);
+            return 0;
+        }
+    }
+    if(!catalogIndexesReady(&catalog)){
+        printf("Out of memory.\n");
+        catalogFree(&catalog);
+        return 0;
+    }
+    int numChanges = numRecords < 1000000 ? numRecords : 1000000;
+    start_time = nowSeconds();
+    for(int i=0; i<numChanges; i++){
+        struct mutation change = {.op = i % 2 == 0 ? OP_BORROW : OP_RETURN, .id = (i / 2) % numBooks};
+        strcpy(change.book.name, "Reader");
+        change.book.date_out = 20000;
+        change.book.date_due = 20007;
+        commitMutation(&catalog, &change);
+    }
+    double changeNs = (nowSeconds() - start_time) * 1e9 / numChanges;
+    printf("%-28s %10.1f ns\n", "borrow/return (in memory)", changeNs);
+    printf("%-28s %10.1f %%\n", "metrics share of change", 100 * recordNs / changeNs);
+    catalogFree(&catalog);
+    return 1;
+}
+
+// Find position of year in year index directory (or where it would go), using binary search
+int yearFind(struct year_index *index, int year){
+    int low = 0, high = index->numYears;
+    while(low < high){
+        int middle = (low + high) / 2;
+        if(index->years[middle].year < year){
+            low = middle + 1;
+        }
+        else{
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Add row to year index, returning 0 if out of memory
+int yearAdd(struct year_index *index, int row, int year){
+    int pos = yearFind(index, year);
+    if(pos == index->numYears || index->years[pos].year != year){      // First book from this year, so add year to directory
+        if(index->numYears == index->maxYears){
+            int newMaxYears = index->maxYears ? index->maxYears * 2 : 64;
+            struct year_list *newYears = realloc(index->years, newMaxYears * sizeof(struct year_list));
+            if(newYears == NULL){
+                return 0;
+            }
+            index->years = newYears;
+            index->maxYears = newMaxYears;
+        }
+        memmove(&index->years[pos+1], &index->years[pos], (index->numYears - pos) * sizeof(struct year_list));
+        memset(&index->years[pos], 0, sizeof(struct year_list));
+        index->years[pos].year = year;
+        index->numYears++;
+    }
+
+    // Add row to year's list (kept in order, new books are added at the end so this is normally an append)
+    struct year_list *list = &index->years[pos];
+    if(list->count == list->capacity){
+        int newCapacity = list->capacity ? list->capacity * 2 : 4;
+        int *newRows = realloc(list->rows, newCapacity * sizeof(int));
+        if(newRows == NULL){
+            return 0;
+        }
+        list->rows = newRows;
+        list->capacity = newCapacity;
+    }
+    int rowPos = list->count;
+    while(rowPos > 0 && list->rows[rowPos-1] > row){
+        rowPos--;
+    }
+    memmove(&list->rows[rowPos+1], &list->rows[rowPos], (list->count - rowPos) * sizeof(int));
+    list->rows[rowPos] = row;
+    list->count++;
+    return 1;
+}
+
+// Remove row from year index
+void yearRemove(struct year_index *index, int row, int year){
+    int pos = yearFind(index, year);
+    if(pos == index->numYears || index->years[pos].year != year){
+        return;
+    }
+    struct year_list *list = &index->years[pos];
+    int rowPos = 0, high = list->count;
+    while(rowPos < high){       // Binary search for row
+        int middle = (rowPos + high) / 2;
+        if(list->rows[middle] < row){
+            rowPos = middle + 1;
+        }
+        else{
+            high = middle;
+        }
+    }
+    if(rowPos < list->count && list->rows[rowPos] == row){
+        memmove(&list->rows[rowPos], &list->rows[rowPos+1], (list->count - rowPos - 1) * sizeof(int));
+        list->count--;
+    }
+    if(list->count == 0){       // No books left from this year, so remove year from directory
+        free(list->rows);
+        memmove(&index->years[pos], &index->years[pos+1], (index->numYears - pos - 1) * sizeof(struct year_list));
+        index->numYears--;
+    }
+}
+
+// Make sure year index has been built (it is built the first time it is needed, then kept up to date by every change), returning 0 if out of memory
+int yearIndexReady(struct catalog *catalog){
+    if(catalog->years.built){
+        return 1;
+    }
+    for(int first=0; first<catalog->numRows; first+=CATALOG_CHUNK_ROWS){       // (only reads ID and year columns)
+        struct catalog_chunk *chunk = catalogChunk(catalog, first);
+        int numRows = catalog->numRows - first < CATALOG_CHUNK_ROWS ? catalog->numRows - first : CATALOG_CHUNK_ROWS;
+        for(int i=0; i<numRows; i++){
+            if(chunk->index[i] != BOOK_DELETED && !yearAdd(&catalog->years, first + i, chunk->pub_year[i])){
+                yearIndexFree(catalog);
+                return 0;
+            }
+        }
+    }
+    catalog->years.built = 1;
+    return 1;
+}
+
+// Update year index for a change to the catalog (called after the change is made, with oldBook NULL for an add and newBook NULL for a delete)
+void yearIndexUpdate(struct catalog *catalog, int row, struct book *oldBook, struct book *newBook){
+    if(!catalog->years.built){
+        return;
+    }
+    if(oldBook != NULL && newBook != NULL && oldBook->pub_year == newBook->pub_year){
+        return;     // Year has not changed
+    }
+    if(oldBook != NULL){
+        yearRemove(&catalog->years, row, oldBook->pub_year);
+    }
+    if(newBook != NULL && !yearAdd(&catalog->years, row, newBook->pub_year)){
+        yearIndexFree(catalog);     // Out of memory, so drop index (rebuilt on next search)
+    }
+}
+
+// Free year index
+void yearIndexFree(struct catalog *catalog){
+    for(int i=0; i<catalog->years.numYears; i++){
+        free(catalog->years.years[i].rows);
+    }
+    free(catalog->years.years);
+    memset(&catalog->years, 0, sizeof(catalog->years));
+}
+
+// Start cursor over books published between fromYear and toYear (inclusive), in year order, returning 0 if out of memory
+int yearCursorStart(struct catalog *catalog, struct year_cursor *cursor, int fromYear, int toYear){
+    if(!yearIndexReady(catalog)){
+        return 0;
+    }
+    cursor->yearPos = yearFind(&catalog->years, fromYear);      // First year in range
+    cursor->rowPos = 0;
+    cursor->toYear = toYear;
+    return 1;
+}
+
+// Get next row from cursor (-1 once there are no more)
+int yearCursorNext(struct catalog *catalog, struct year_cursor *cursor){
+    struct year_index *index = &catalog->years;
+    while(cursor->yearPos < index->numYears && index->years[cursor->yearPos].year <= cursor->toYear){
+        struct year_list *list = &index->years[cursor->yearPos];
+        if(cursor->rowPos < list->count){
+            return list->rows[cursor->rowPos++];
+        }
+        cursor->yearPos++;      // Go to next year
+        cursor->rowPos = 0;
+    }
+    return -1;
+}
+
+// Read publication year, or range of years (e.g. "1950-1970"), from search term
+void parseYearRange(char *term, int *fromYear, int *toYear){
+    char *end;
+    *fromYear = strtol(term, &end, 10);
+    *toYear = *fromYear;
+
+    // Skip separator between years ('-', or an en dash)
+    while(*end == ' '){
+        end++;
+    }
+    if(*end == '-'){
+        end++;
+    }
+    else if(strncmp(end, "\xE2\x80\x93", 3) == 0){
+        end += 3;
+    }
+    else{
+        return;     // Single year
+    }
+    char *second = end;
+    int year = strtol(second, &end, 10);
+    if(end != second){
+        *toYear = year;
+    }
+}
+
+// Check if due index entry a comes before entry b (earlier date due, then lower row)
+int dueBefore(struct due_entry *a, struct due_entry *b){
+    return a->due < b->due || (a->due == b->due && a->row < b->row);
+}
+
+// Move heap entry towards top of heap until it is in order
+void dueSiftUp(struct due_index *index, int pos){
+    struct due_entry entry = index->heap[pos];
+    while(pos > 0){
+        int parent = (pos - 1) / 2;
+        if(!dueBefore(&entry, &index->heap[parent])){
+            break;
+        }
+        index->heap[pos] = index->heap[parent];
+        index->positions[index->heap[pos].row] = pos;
+        pos = parent;
+    }
+    index->heap[pos] = entry;
+    index->positions[entry.row] = pos;
+}
+
+// Move heap entry towards bottom of heap until it is in order
+void dueSiftDown(struct due_index *index, int pos){
+    struct due_entry entry = index->heap[pos];
+    while(1){
+        int child = pos * 2 + 1;
+        if(child >= index->count){
+            break;
+        }
+        if(child + 1 < index->count && dueBefore(&index->heap[child+1], &index->heap[child])){
+            child++;        // Use earlier of the two children
+        }
+        if(!dueBefore(&index->heap[child], &entry)){
+            break;
+        }
+        index->heap[pos] = index->heap[child];
+        index->positions[index->heap[pos].row] = pos;
+        pos = child;
+    }
+    index->heap[pos] = entry;
+    index->positions[entry.row] = pos;
+}
+
+// Add book on loan to due index, returning 0 if out of memory
+int dueAdd(struct due_index *index, int row, int due){
+    if(row >= index->numPositions){     // Make room for row in positions
+        int newNumPositions = index->numPositions ? index->numPositions : CATALOG_CHUNK_ROWS;
+        while(newNumPositions <= row){
+            newNumPositions *= 2;
+        }
+        int *newPositions = realloc(index->positions, newNumPositions * sizeof(int));
+        if(newPositions == NULL){
+            return 0;
+        }
+        for(int i=index->numPositions; i<newNumPositions; i++){
+            newPositions[i] = -1;
+        }
+        index->positions = newPositions;
+        index->numPositions = newNumPositions;
+    }
+    if(index->positions[row] != -1){
+        return 1;       // Already in index
+    }
+    if(index->count == index->capacity){
+        int newCapacity = index->capacity ? index->capacity * 2 : 64;
+        struct due_entry *newHeap = realloc(index->heap, newCapacity * sizeof(struct due_entry));
+        if(newHeap == NULL){
+            return 0;
+        }
+        index->heap = newHeap;
+        index->capacity = newCapacity;
+    }
+    index->heap[index->count].due = due;
+    index->heap[index->count].row = row;
+    index->count++;
+    dueSiftUp(index, index->count-1);
+    return 1;
+}
+
+// Remove book from due index (when it is returned)
+void dueRemove(struct due_index *index, int row){
+    if(row >= index->numPositions || index->positions[row] == -1){
+        return;
+    }
+    int pos = index->positions[row];
+    index->positions[row] = -1;
+    index->count--;
+    if(pos == index->count){
+        return;     // Was last entry
+    }
+
+    // Move last entry into the gap, then put it back in order
+    index->heap[pos] = index->heap[index->count];
+    index->positions[index->heap[pos].row] = pos;
+    if(pos > 0 && dueBefore(&index->heap[pos], &index->heap[(pos-1)/2])){
+        dueSiftUp(index, pos);
+    }
+    else{
+        dueSiftDown(index, pos);
+    }
+}
+
+// Make sure due index has been built (it is built the first time it is needed, then kept up to date by every change), returning 0 if out of memory
+int dueIndexReady(struct catalog *catalog){
+    if(catalog->due.built){
+        return 1;
+    }
+    for(int first=0; first<catalog->numRows; first+=CATALOG_CHUNK_ROWS){       // (only reads ID and date due columns)
+        struct catalog_chunk *chunk = catalogChunk(catalog, first);
+        int numRows = catalog->numRows - first < CATALOG_CHUNK_ROWS ? catalog->numRows - first : CATALOG_CHUNK_ROWS;
+        for(int i=0; i<numRows; i++){
+            if(chunk->index[i] != BOOK_DELETED && chunk->date_due[i] != 0 && !dueAdd(&catalog->due, first + i, chunk->date_due[i])){
+                dueIndexFree(catalog);
+                return 0;
+            }
+        }
+    }
+    catalog->due.built = 1;
+    return 1;
+}
+
+// Update due index for a change to the catalog (called after the change is made, with oldBook NULL for an add and newBook NULL for a delete)
+void dueIndexUpdate(struct catalog *catalog, int row, struct book *oldBook, struct book *newBook){
+    if(!catalog->due.built){
+        return;
+    }
+    int oldDue = oldBook != NULL ? oldBook->date_due : 0;
+    int newDue = newBook != NULL ? newBook->date_due : 0;
+    if(oldDue == newDue){
+        return;     // Date due has not changed
+    }
+    if(oldDue != 0){
+        dueRemove(&catalog->due, row);
+    }
+    if(newDue != 0 && !dueAdd(&catalog->due, row, newBook->date_due)){
+        dueIndexFree(catalog);      // Out of memory, so drop index (rebuilt on next check)
+    }
+}
+
+// Free due index
+void dueIndexFree(struct catalog *catalog){
+    free(catalog->due.heap);
+    free(catalog->due.positions);
+    memset(&catalog->due, 0, sizeof(catalog->due));
+}
+
+// Find rows of books on loan that are due before a time, in order of date due (NULL if out of memory)
+// Only visits the part of the heap that is due before the time, so takes time proportional to the number of books found
+int* findDueBooks(struct catalog *catalog, int before, int *numMatches){
+    *numMatches = 0;
+    if(!dueIndexReady(catalog)){
+        return NULL;
+    }
+    struct due_index *index = &catalog->due;
+    int *matches = malloc((index->count + 1) * sizeof(int));
+    int *frontier = malloc((index->count + 1) * sizeof(int));      // Heap positions that could be next (a small heap of its own)
+    if(matches == NULL || frontier == NULL){
+        free(matches);
+        free(frontier);
+        return NULL;
+    }
+
+    // Take entries from the top of the heap in order, only looking at the children of entries that are taken
+    int numFrontier = 0;
+    if(index->count > 0 && index->heap[0].due < before){
+        frontier[numFrontier++] = 0;
+    }
+    while(numFrontier > 0){
+        int pos = frontier[0];
+        matches[(*numMatches)++] = index->heap[pos].row;
+
+        // Remove it from frontier
+        int last = frontier[--numFrontier];
+        int hole = 0;
+        while(hole * 2 + 1 < numFrontier){
+            int child = hole * 2 + 1;
+            if(child + 1 < numFrontier && dueBefore(&index->heap[frontier[child+1]], &index->heap[frontier[child]])){
+                child++;
+            }
+            if(!dueBefore(&index->heap[frontier[child]], &index->heap[last])){
+                break;
+            }
+            frontier[hole] = frontier[child];
+            hole = child;
+        }
+        if(numFrontier > 0){
+            frontier[hole] = last;
+        }
+
+        // Add its children that are due before the time to frontier
+        for(int child = pos * 2 + 1; child <= pos * 2 + 2 && child < index->count; child++){
+            if(index->heap[child].due >= before){
+                continue;
+            }
+            int slot = numFrontier++;
+            while(slot > 0 && dueBefore(&index->heap[child], &index->heap[frontier[(slot-1)/2]])){
+                frontier[slot] = frontier[(slot-1)/2];
+                slot = (slot - 1) / 2;
+            }
+            frontier[slot] = child;
+        }
+    }
+    free(frontier);
+    return matches;
+}
+
+// Find borrower in patron index (adding them if create is 1), returning NULL if they are not there (or out of memory)
+struct patron_loans* patronFind(struct patron_index *index, uint32_t name, int create){
+    if(index->tableSize == 0 || (create && (index->numPatrons + 1) * 2 > index->tableSize)){
+        if(!create){
+            return NULL;
+        }
+
+        // Double size of hash table (only the entries move, not the rows in them)
+        int newSize = index->tableSize ? index->tableSize * 2 : 1024;
+        struct patron_loans *newPatrons = malloc(newSize * sizeof(struct patron_loans));
+        if(newPatrons == NULL){
+            return NULL;
+        }
+        for(int i=0; i<newSize; i++){
+            newPatrons[i] = (struct patron_loans){STRING_NONE, 0, 0, NULL};
+        }
+        for(int i=0; i<index->tableSize; i++){
+            if(index->patrons[i].name != STRING_NONE){
+                uint32_t slot = (index->patrons[i].name * 2654435761u) & (newSize - 1);
+                while(newPatrons[slot].name != STRING_NONE){
+                    slot = (slot + 1) & (newSize - 1);
+                }
+                newPatrons[slot] = index->patrons[i];
+            }
+        }
+        free(index->patrons);
+        index->patrons = newPatrons;
+        index->tableSize = newSize;
+    }
+
+    // Look up name (linear probing)
+    uint32_t slot = (name * 2654435761u) & (index->tableSize - 1);
+    while(index->patrons[slot].name != name){
+        if(index->patrons[slot].name == STRING_NONE){
+            if(!create){
+                return NULL;
+            }
+            index->patrons[slot] = (struct patron_loans){name, 0, 0, NULL};
+            index->numPatrons++;
+            break;
+        }
+        slot = (slot + 1) & (index->tableSize - 1);
+    }
+    return &index->patrons[slot];
+}
+
+// Add book in row to loans of borrower, returning 0 if out of memory
+int patronAdd(struct patron_index *index, int row, uint32_t name){
+    struct patron_loans *patron = patronFind(index, name, 1);
+    if(patron == NULL){
+        return 0;
+    }
+    if(patron->count == patron->capacity){
+        int newCapacity = patron->capacity ? patron->capacity * 2 : 4;
+        int *newRows = realloc(patron->rows, newCapacity * sizeof(int));
+        if(newRows == NULL){
+            return 0;
+        }
+        patron->rows = newRows;
+        patron->capacity = newCapacity;
+    }
+    patron->rows[patron->count++] = row;
+    return 1;
+}
+
+// Remove book in row from loans of borrower (last loan is moved into its place)
+void patronRemove(struct patron_index *index, int row, uint32_t name){
+    struct patron_loans *patron = patronFind(index, name, 0);
+    if(patron == NULL){
+        return;
+    }
+    for(int i=0; i<patron->count; i++){
+        if(patron->rows[i] == row){
+            patron->rows[i] = patron->rows[--patron->count];
+            return;
+        }
+    }
+}
+
+// Make sure patron index has been built (it is built the first time it is needed, then kept up to date by every change), returning 0 if out of memory
+int patronIndexReady(struct catalog *catalog){
+    if(catalog->patrons.built){
+        return 1;
+    }
+    for(int first=0; first<catalog->numRows; first+=CATALOG_CHUNK_ROWS){       // (only reads names of books that are out)
+        struct catalog_chunk *chunk = catalogChunk(catalog, first);
+        int numRows = catalog->numRows - first < CATALOG_CHUNK_ROWS ? catalog->numRows - first : CATALOG_CHUNK_ROWS;
+        for(int i=0; i<numRows; i++){
+            if(chunk->index[i] != BOOK_DELETED && chunk->date_out[i] != 0 && !patronAdd(&catalog->patrons, first + i, chunk->text[i].name)){
+                patronIndexFree(catalog);
+                return 0;
+            }
+        }
+    }
+    catalog->patrons.built = 1;
+    return 1;
+}
+
+// Update patron index for a change to the catalog (called after the change is made, with oldBook NULL for an add and newBook NULL for a delete)
+void patronIndexUpdate(struct catalog *catalog, int row, struct book *oldBook, struct book *newBook){
+    if(!catalog->patrons.built){
+        return;
+    }
+    int wasOut = oldBook != NULL && oldBook->date_out != 0;
+    int isOut = newBook != NULL && newBook->date_out != 0;
+    if(wasOut && isOut && strcmp(oldBook->name, newBook->name) == 0){
+        return;     // Same person still has it (e.g. an edit)
+    }
+    if(wasOut){
+        patronRemove(&catalog->patrons, row, stringFind(catalog->strings, oldBook->name));
+    }
+    if(isOut && !patronAdd(&catalog->patrons, row, catalogText(catalog, row)->name)){
+        patronIndexFree(catalog);       // Out of memory, so drop index (rebuilt on next lookup)
+    }
+}
+
+// Free patron index
+void patronIndexFree(struct catalog *catalog){
+    for(int i=0; i<catalog->patrons.tableSize; i++){
+        free(catalog->patrons.patrons[i].rows);
+    }
+    free(catalog->patrons.patrons);
+    memset(&catalog->patrons, 0, sizeof(catalog->patrons));
+}
+
+// Find loans of person with given name (NULL if they have nothing out, or out of memory)
+struct patron_loans* patronLoans(struct catalog *catalog, const char *name){
+    if(!patronIndexReady(catalog) || catalog->strings == NULL){
+        return NULL;
+    }
+    uint32_t handle = stringFind(catalog->strings, name);       // (names of books that are out are all in the pool once the index is built)
+    return handle == STRING_NONE ? NULL : patronFind(&catalog->patrons, handle, 0);
+}
+
+// Get number of books person with given name has out
+int patronLoanCount(struct catalog *catalog, const char *name){
+    struct patron_loans *patron = patronLoans(catalog, name);
+    return patron != NULL ? patron->count : 0;
+}
+
+// Get month a date falls in (year*12 + month-1), which picks the history file a loan returned then goes in
+int historyMonth(int date){
+    int year, month, day;
+    dateToCalendar(date, &year, &month, &day);
+    return year * 12 + month - 1;
+}
+
+// Get path of history file for a month ("<file>.history.<yyyymm>"), returning 0 if it is too long (so two months can never share a file)
+int historyFilePath(struct loan_history *history, int month, char *path){
+    int length = snprintf(path, HISTORY_PATH_LENGTH, "%s.%04d%02d", history->path, month / 12, month % 12 + 1);
+    return length >= 0 && length < HISTORY_PATH_LENGTH;
+}
+
+// Open loan history of database file (creating it if needed), dropping any record cut off by a crash, returning NULL if out of memory (or its file names would be too long)
+struct loan_history* historyOpen(char *fileName){
+    if(strlen(fileName) + strlen(".history.yyyymm") >= MAX_PATH_LENGTH){
+        fprintf(stderr, "Name of \"%s\" is too long to keep a loan history.\n", fileName);
+        return NULL;
+    }
+    struct loan_history *history = calloc(1, sizeof(struct loan_history));
+    if(history == NULL){
+        return NULL;
+    }
+    snprintf(history->path, MAX_PATH_LENGTH, "%s.history", fileName);
+    history->fileMonth = -1;
+
+    // Read list of months, then number of last loan from the end of each month's file (loans are numbered in the order they are written, but a month can be written to again if the date is set back)
+    FILE *list = fopen(history->path, "r");
+    if(list != NULL){
+        int yyyymm;
+        while(history->numMonths < HISTORY_MAX_MONTHS && fscanf(list, "%d", &yyyymm) == 1){
+            history->months[history->numMonths++] = yyyymm / 100 * 12 + yyyymm % 100 - 1;
+        }
+        fclose(list);
+    }
+    char path[HISTORY_PATH_LENGTH];
+    unsigned char record[HISTORY_RECORD_SIZE];
+    for(int i=0; i<history->numMonths; i++){
+        FILE *file = historyFilePath(history, history->months[i], path) ? fopen(path, "rb") : NULL;
+        if(file == NULL){
+            continue;
+        }
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        long whole = size - size % HISTORY_RECORD_SIZE;
+        long long loan;
+        const unsigned char *pos = record;
+        if(whole > 0 && fseek(file, whole - HISTORY_RECORD_SIZE, SEEK_SET) == 0 && fread(record, 1, HISTORY_RECORD_SIZE, file) == HISTORY_RECORD_SIZE
+           && getNumber(&pos, record + HISTORY_RECORD_SIZE, &loan, 8) && loan > history->lastLoan){
+            history->lastLoan = loan;
+        }
+        fclose(file);
+        if(whole != size){
+            truncateFile(path, whole);
+        }
+    }
+    return history;
+}
+
+// Write finished loan to end of the history file for the month it came back (added to the list of months if it is the first), returning 1 if successful
+// The OS has it once this returns; historySync puts it on disk before the journal records that would write it again are dropped
+int historyAppend(struct loan_history *history, struct loan_record *record){
+    int month = historyMonth(record->date_returned);
+    if(history->file == NULL || history->fileMonth != month){
+        if(history->file != NULL){
+            syncFile(history->file);
+            fclose(history->file);
+            history->file = NULL;
+        }
+        int known = 0;
+        for(int i=0; i<history->numMonths && !known; i++){
+            known = history->months[i] == month;
+        }
+        if(!known){
+            FILE *list = fopen(history->path, "a");
+            int listed = history->numMonths < HISTORY_MAX_MONTHS && list != NULL && fprintf(list, "%04d%02d\n", month / 12, month % 12 + 1) > 0 && syncFile(list);
+            if(list != NULL){
+                fclose(list);
+            }
+            if(!listed){
+                return 0;
+            }
+            history->months[history->numMonths++] = month;
+        }
+        char path[HISTORY_PATH_LENGTH];
+        if(!historyFilePath(history, month, path) || (history->file = fopen(path, "ab")) == NULL){
+            return 0;
+        }
+        history->fileMonth = month;
+    }
+
+    unsigned char buffer[HISTORY_RECORD_SIZE];
+    unsigned char *pos = buffer;
+    putNumber(&pos, record->loan, 8);
+    putNumber(&pos, record->id, 4);
+    putNumber(&pos, record->date_out, 4);
+    putNumber(&pos, record->date_due, 4);
+    putNumber(&pos, record->date_returned, 4);
+    if(fwrite(buffer, 1, HISTORY_RECORD_SIZE, history->file) != HISTORY_RECORD_SIZE || fflush(history->file) != 0){
+        return 0;
+    }
+    history->lastLoan = record->loan;
+    return 1;
+}
+
+// Make sure every loan written to the history is on disk, returning 1 if successful
+int historySync(struct loan_history *history){
+    return history->file == NULL || syncFile(history->file);
+}
+
+// Close loan history (syncing it to disk first)
+void historyClose(struct loan_history *history){
+    if(history->file != NULL){
+        syncFile(history->file);
+        fclose(history->file);
+    }
+    free(history);
+}
+
+// Read every loan in the history file for a month, in the order they were written (NULL if out of memory, or the file cannot be read)
+struct loan_record* historyLoad(struct loan_history *history, int month, int *numRecords){
+    *numRecords = 0;
+    char path[HISTORY_PATH_LENGTH];
+    struct mapped_file map;
+    if(!historyFilePath(history, month, path) || !mapFile(path, &map)){
+        return NULL;
+    }
+    int count = map.size / HISTORY_RECORD_SIZE;
+    struct loan_record *records = malloc((count + 1) * sizeof(struct loan_record));
+    if(records != NULL){
+        const unsigned char *pos = (const unsigned char*)map.data;
+        const unsigned char *end = pos + (size_t)count * HISTORY_RECORD_SIZE;
+        long long loan, id, date_out, date_due, date_returned;
+        while(getNumber(&pos, end, &loan, 8) && getNumber(&pos, end, &id, 4) && getNumber(&pos, end, &date_out, 4)
+              && getNumber(&pos, end, &date_due, 4) && getNumber(&pos, end, &date_returned, 4)){
+            records[(*numRecords)++] = (struct loan_record){loan, id, date_out, date_due, date_returned};
+        }
+    }
+    unmapFile(&map);
+    return records;
+}
+
+// Find count for a key (adding it if create is 1), returning NULL if it is not there (or out of memory)
+struct loan_count* loanCountFind(struct loan_counts *counts, uint32_t key, int create){
+    if(counts->tableSize == 0 || (create && (counts->count + 1) * 2 > counts->tableSize)){
+        if(!create){
+            return NULL;
+        }
+
+        // Double size of hash table
+        int newSize = counts->tableSize ? counts->tableSize * 2 : 1024;
+        struct loan_count *newSlots = calloc(newSize, sizeof(struct loan_count));
+        if(newSlots == NULL){
+            return NULL;
+        }
+        for(int i=0; i<counts->tableSize; i++){
+            if(counts->slots[i].used){
+                uint32_t slot = (counts->slots[i].key * 2654435761u) & (newSize - 1);
+                while(newSlots[slot].used){
+                    slot = (slot + 1) & (newSize - 1);
+                }
+                newSlots[slot] = counts->slots[i];
+            }
+        }
+        free(counts->slots);
+        counts->slots = newSlots;
+        counts->tableSize = newSize;
+    }
+
+    // Look up key (linear probing)
+    uint32_t slot = (key * 2654435761u) & (counts->tableSize - 1);
+    while(!counts->slots[slot].used || counts->slots[slot].key != key){
+        if(!counts->slots[slot].used){
+            if(!create){
+                return NULL;
+            }
+            counts->slots[slot] = (struct loan_count){key, 1, 0, 0, 0};
+            counts->count++;
+            break;
+        }
+        slot = (slot + 1) & (counts->tableSize - 1);
+    }
+    return &counts->slots[slot];
+}
+
+// Add to count for a key, returning 0 if out of memory
+int loanCountAdd(struct loan_counts *counts, uint32_t key, long long loans, long long returns, long long daysOut){
+    struct loan_count *count = loanCountFind(counts, key, 1);
+    if(count == NULL){
+        return 0;
+    }
+    count->loans += loans;
+    count->returns += returns;
+    count->daysOut += daysOut;
+    return 1;
+}
+
+// Get string handle of an author, which their loans are counted under (STRING_NONE if not in the string pool)
+uint32_t loanAuthor(struct catalog *catalog, const char *author){
+    return catalog->strings != NULL ? stringFind(catalog->strings, author) : STRING_NONE;
+}
+
+// Make sure loan counts have been made (they are made from the history and the books out now the first time they are needed, then kept up to date by every borrow and return), returning 0 if out of memory
+// Past loans are counted under the author their book has now (or not at all if it has been deleted)
+int loanStatsReady(struct catalog *catalog){
+    struct loan_stats *stats = &catalog->loans;
+    if(stats->built){
+        return 1;
+    }
+    if(!idMapReady(catalog)){
+        return 0;
+    }
+    int success = 1;
+    struct loan_history *history = catalog->history;
+    for(int i=0; history != NULL && i<history->numMonths && success; i++){
+        int numRecords;
+        struct loan_record *records = historyLoad(history, history->months[i], &numRecords);
+        if(records == NULL){
+            char path[HISTORY_PATH_LENGTH];
+            historyFilePath(history, history->months[i], path);
+            fprintf(stderr, "Loan history \"%s\" cannot be read, not counted.\n", path);
+            continue;
+        }
+        for(int j=0; j<numRecords && success; j++){
+            struct loan_record *record = &records[j];
+            int daysOut = record->date_returned - record->date_out;
+            int row = catalogFind(catalog, record->id);
+            success = loanCountAdd(&stats->books, record->id, 1, 1, daysOut)
+                && (row == -1 || loanCountAdd(&stats->authors, catalogText(catalog, row)->author, 1, 1, daysOut))
+                && loanCountAdd(&stats->days, record->date_out, 1, 0, 0)
+                && loanCountAdd(&stats->days, record->date_returned, 0, 1, 0);
+        }
+        free(records);
+    }
+    for(int first=0; first<catalog->numRows && success; first+=CATALOG_CHUNK_ROWS){       // (books out now)
+        struct catalog_chunk *chunk = catalogChunk(catalog, first);
+        int numRows = catalog->numRows - first < CATALOG_CHUNK_ROWS ? catalog->numRows - first : CATALOG_CHUNK_ROWS;
+        for(int i=0; i<numRows && success; i++){
+            if(chunk->index[i] != BOOK_DELETED && chunk->date_out[i] != 0){
+                success = loanCountAdd(&stats->books, chunk->index[i], 1, 0, 0)
+                    && loanCountAdd(&stats->authors, chunk->text[i].author, 1, 0, 0)
+                    && loanCountAdd(&stats->days, chunk->date_out[i], 1, 0, 0);
+            }
+        }
+    }
+    if(!success){
+        loanStatsFree(catalog);
+        return 0;
+    }
+    stats->built = 1;
+    return 1;
+}
+
+// Count book being borrowed (sign 1), or stop counting the loan of a book deleted while out (sign -1)
+void loanStatsBorrow(struct catalog *catalog, struct book *book, int sign){
+    struct loan_stats *stats = &catalog->loans;
+    if(!stats->built){
+        return;
+    }
+    uint32_t author = loanAuthor(catalog, book->author);
+    if(!loanCountAdd(&stats->books, book->index, sign, 0, 0) || (author != STRING_NONE && !loanCountAdd(&stats->authors, author, sign, 0, 0))
+       || !loanCountAdd(&stats->days, book->date_out, sign, 0, 0)){
+        loanStatsFree(catalog);     // Out of memory, so drop counts (made again on next report)
+    }
+}
+
+// Move loans of a book (past ones and any it has out now) from one author's counts to another's (toAuthor NULL to take them off fromAuthor only)
+void loanStatsMoveAuthor(struct catalog *catalog, int id, const char *fromAuthor, const char *toAuthor){
+    struct loan_stats *stats = &catalog->loans;
+    struct loan_count *count = stats->built ? loanCountFind(&stats->books, id, 0) : NULL;
+    if(count == NULL){
+        return;     // (never borrowed)
+    }
+    long long loans = count->loans, returns = count->returns, daysOut = count->daysOut;
+    uint32_t from = loanAuthor(catalog, fromAuthor);
+    uint32_t to = toAuthor != NULL ? loanAuthor(catalog, toAuthor) : STRING_NONE;
+    if((from != STRING_NONE && !loanCountAdd(&stats->authors, from, -loans, -returns, -daysOut))
+       || (to != STRING_NONE && !loanCountAdd(&stats->authors, to, loans, returns, daysOut))){
+        loanStatsFree(catalog);     // Out of memory, so drop counts (made again on next report)
+    }
+}
+
+// Record return of book (as it was while out) in the loan history and the loan counts
+// The history only takes loans numbered after its last one, so replaying the journal does not write a loan twice
+void loanReturned(struct catalog *catalog, struct book *book, struct mutation *mutation){
+    struct loan_history *history = catalog->history;
+    if(history != NULL && mutation->loan > history->lastLoan){
+        struct loan_record record = {mutation->loan, book->index, book->date_out, book->date_due, mutation->date_returned};
+        if(!historyAppend(history, &record)){
+            fprintf(stderr, "Loan history cannot be written to, loan %lld not kept.\n", mutation->loan);
+        }
+    }
+
+    struct loan_stats *stats = &catalog->loans;
+    if(!stats->built || mutation->date_returned == 0){      // (returns from before the loan history have no date)
+        return;
+    }
+    uint32_t author = loanAuthor(catalog, book->author);
+    int daysOut = mutation->date_returned - book->date_out;
+    if(!loanCountAdd(&stats->books, book->index, 0, 1, daysOut) || (author != STRING_NONE && !loanCountAdd(&stats->authors, author, 0, 1, daysOut))
+       || !loanCountAdd(&stats->days, mutation->date_returned, 0, 1, 0)){
+        loanStatsFree(catalog);
+    }
+}
+
+// Free loan counts
+void loanStatsFree(struct catalog *catalog){
+    free(catalog->loans.books.slots);
+    free(catalog->loans.authors.slots);
+    free(catalog->loans.days.slots);
+    memset(&catalog->loans, 0, sizeof(catalog->loans));
+}
+
+// Compare two loan counts, most loans first (then lowest key, so ties always come out in the same order) (for qsort)
+int compareLoanCounts(const void *a, const void *b){
+    const struct loan_count *x = a, *y = b;
+    if(x->loans != y->loans){
+        return x->loans > y->loans ? -1 : 1;
+    }
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+// Find the n counts with the most loans, most first, keeping only the best n seen so far in a heap (NULL if out of memory)
+// If catalog is given, keys are book IDs and books that have been deleted are left out
+struct loan_count* loanTop(struct loan_counts *counts, int n, struct catalog *catalog, int *numTop){
+    *numTop = 0;
+    struct loan_count *top = malloc((n + 1) * sizeof(struct loan_count));
+    if(top == NULL){
+        return NULL;
+    }
+
+    // Heap has the worst of the best n at the top, so each count only has to beat it
+    for(int i=0; i<counts->tableSize; i++){
+        struct loan_count *count = &counts->slots[i];
+        if(!count->used || count->loans <= 0 || (catalog != NULL && catalogFind(catalog, count->key) == -1)){
+            continue;
+        }
+        int slot;
+        if(*numTop < n){
+            slot = (*numTop)++;
+            while(slot > 0 && compareLoanCounts(count, &top[(slot-1)/2]) > 0){
+                top[slot] = top[(slot-1)/2];
+                slot = (slot - 1) / 2;
+            }
+        }
+        else if(compareLoanCounts(count, &top[0]) < 0){
+            slot = 0;       // Replace worst, then move it down
+            while(1){
+                int child = slot * 2 + 1;
+                if(child >= n){
+                    break;
+                }
+                if(child + 1 < n && compareLoanCounts(&top[child+1], &top[child]) > 0){
+                    child++;
+                }
+                if(compareLoanCounts(&top[child], count) <= 0){
+                    break;
+                }
+                top[slot] = top[child];
+                slot = child;
+            }
+        }
+        else{
+            continue;
+        }
+        top[slot] = *count;
+    }
+    qsort(top, *numTop, sizeof(struct loan_count), compareLoanCounts);
+    return top;
+}
+
+// Compare two texts ignoring case (for sorting titles/authors)
+int compareFolded(const char *a, const char *b){
+    while(*a != '\0' && toupper((unsigned char)*a) == toupper((unsigned char)*b)){
+        a++;
+        b++;
+    }
+    return toupper((unsigned char)*a) - toupper((unsigned char)*b);
+}
+
+// Get place of book in given row in an order (its text points into the catalog)
+void sortKeyOfRow(struct catalog *catalog, int field, int row, struct sort_key *key){
+    struct catalog_chunk *chunk = catalogChunk(catalog, row);
+    int i = row % CATALOG_CHUNK_ROWS;
+    key->text = field == SORT_TITLE ? chunk->text[i].title : field == SORT_AUTHOR ? stringGet(catalog->strings, chunk->text[i].author) : NULL;
+    key->number = field == SORT_YEAR ? chunk->pub_year[i] : field == SORT_ADDED ? chunk->text[i].date_added : 0;
+    key->id = chunk->index[i];
+}
+
+// Get place of book in an order from its values (e.g. as they were before a change)
+void sortKeyOfBook(int field, struct book *book, struct sort_key *key){
+    key->text = field == SORT_TITLE ? book->title : field == SORT_AUTHOR ? book->author : NULL;
+    key->number = field == SORT_YEAR ? book->pub_year : field == SORT_ADDED ? book->date_added : 0;
+    key->id = book->index;
+}
+
+// Compare places of two books in an order (by title/author ignoring case, or year/date added, then ID)
+int compareSortKeys(const struct sort_key *a, const struct sort_key *b){
+    if(a->text != NULL){
+        int result = compareFolded(a->text, b->text);
+        if(result != 0){
+            return result;
+        }
+    }
+    if(a->number != b->number){
+        return a->number < b->number ? -1 : 1;
+    }
+    return (a->id > b->id) - (a->id < b->id);
+}
+
+// Compare two sort entries (for qsort)
+int compareSortEntries(const void *a, const void *b){
+    return compareSortKeys(&((const struct sort_entry*)a)->key, &((const struct sort_entry*)b)->key);
+}
+
+// Find first place in an order that is not before key, returning its position in block blockNum (blockNum is the number of blocks if every book is before key)
+// skipRow is taken to be at key without reading it (the row of a book being taken out of the order, which may already hold its new values)
+int sortFind(struct catalog *catalog, int field, struct sort_key *key, int skipRow, int *blockNum){
+    struct sort_order *order = &catalog->sorts[field];
+    struct sort_key other;
+
+    // Find first block whose last book is not before key
+    int low = 0, high = order->numBlocks;
+    while(low < high){
+        int middle = (low + high) / 2;
+        struct sort_block *block = order->blocks[middle];
+        int row = block->rows[block->count - 1];
+        if(row != skipRow && (sortKeyOfRow(catalog, field, row, &other), compareSortKeys(&other, key) < 0)){
+            low = middle + 1;
+        }
+        else{
+            high = middle;
+        }
+    }
+    *blockNum = low;
+    if(low == order->numBlocks){
+        return 0;
+    }
+
+    // Find place in that block
+    struct sort_block *block = order->blocks[low];
+    int pos = 0;
+    high = block->count;
+    while(pos < high){
+        int middle = (pos + high) / 2;
+        int row = block->rows[middle];
+        if(row != skipRow && (sortKeyOfRow(catalog, field, row, &other), compareSortKeys(&other, key) < 0)){
+            pos = middle + 1;
+        }
+        else{
+            high = middle;
+        }
+    }
+    return pos;
+}
+
+// Add book in row to an order (at the place its values give it), returning 0 if out of memory
+int sortAdd(struct catalog *catalog, int field, int row){
+    struct sort_order *order = &catalog->sorts[field];
+    struct sort_key key;
+    sortKeyOfRow(catalog, field, row, &key);
+    int blockNum;
+    int pos = sortFind(catalog, field, &key, -1, &blockNum);
+    if(blockNum == order->numBlocks && blockNum > 0){       // After every book, so goes at end of last block
+        blockNum--;
+        pos = order->blocks[blockNum]->count;
+    }
+
+    // Make a block if there are none yet, or split the block in two if it is full (only the rows in it move)
+    if(order->numBlocks == 0 || order->blocks[blockNum]->count == SORT_BLOCK_ROWS){
+        if(order->numBlocks == order->maxBlocks){
+            int newMaxBlocks = order->maxBlocks ? order->maxBlocks * 2 : 64;
+            struct sort_block **newBlocks = realloc(order->blocks, newMaxBlocks * sizeof(struct sort_block*));
+            if(newBlocks == NULL){
+                return 0;
+            }
+            order->blocks = newBlocks;
+            order->maxBlocks = newMaxBlocks;
+        }
+        struct sort_block *newBlock = malloc(sizeof(struct sort_block));
+        if(newBlock == NULL){
+            return 0;
+        }
+        if(order->numBlocks == 0){
+            newBlock->count = 0;
+            order->blocks[0] = newBlock;
+            order->numBlocks = 1;
+            blockNum = 0;
+            pos = 0;
+        }
+        else{       // Second half of full block goes in new block after it
+            struct sort_block *block = order->blocks[blockNum];
+            int half = SORT_BLOCK_ROWS / 2;
+            newBlock->count = SORT_BLOCK_ROWS - half;
+            memcpy(newBlock->rows, &block->rows[half], newBlock->count * sizeof(int));
+            block->count = half;
+            memmove(&order->blocks[blockNum+2], &order->blocks[blockNum+1], (order->numBlocks - blockNum - 1) * sizeof(struct sort_block*));
+            order->blocks[blockNum+1] = newBlock;
+            order->numBlocks++;
+            if(pos > half){
+                blockNum++;
+                pos -= half;
+            }
+        }
+    }
+
+    // Put row in its place in block
+    struct sort_block *block = order->blocks[blockNum];
+    memmove(&block->rows[pos+1], &block->rows[pos], (block->count - pos) * sizeof(int));
+    block->rows[pos] = row;
+    block->count++;
+    return 1;
+}
+
+// Take book in row out of an order, given the place it had (its values before the change)
+void sortRemove(struct catalog *catalog, int field, int row, struct sort_key *key){
+    struct sort_order *order = &catalog->sorts[field];
+    int blockNum;
+    int pos = sortFind(catalog, field, key, row, &blockNum);
+    if(blockNum == order->numBlocks || order->blocks[blockNum]->rows[pos] != row){
+        return;
+    }
+    struct sort_block *block = order->blocks[blockNum];
+    memmove(&block->rows[pos], &block->rows[pos+1], (block->count - pos - 1) * sizeof(int));
+    block->count--;
+    if(block->count == 0){      // Drop empty block
+        free(block);
+        memmove(&order->blocks[blockNum], &order->blocks[blockNum+1], (order->numBlocks - blockNum - 1) * sizeof(struct sort_block*));
+        order->numBlocks--;
+    }
+}
+
+// Make sure an order has been built (it is built the first time it is needed, then kept up to date by every add, edit and delete), returning 0 if out of memory
+int sortOrderReady(struct catalog *catalog, int field){
+    struct sort_order *order = &catalog->sorts[field];
+    if(order->built){
+        return 1;
+    }
+
+    // Sort every book by its place (reading each text once, not on every comparison)
+    struct sort_entry *entries = malloc((catalog->numRows + 1) * sizeof(struct sort_entry));
+    if(entries == NULL){
+        return 0;
+    }
+    int numEntries = 0;
+    for(int first=0; first<catalog->numRows; first+=CATALOG_CHUNK_ROWS){
+        struct catalog_chunk *chunk = catalogChunk(catalog, first);
+        int numRows = catalog->numRows - first < CATALOG_CHUNK_ROWS ? catalog->numRows - first : CATALOG_CHUNK_ROWS;
+        for(int i=0; i<numRows; i++){
+            if(chunk->index[i] != BOOK_DELETED){
+                sortKeyOfRow(catalog, field, first + i, &entries[numEntries].key);
+                entries[numEntries++].row = first + i;
+            }
+        }
+    }
+    qsort(entries, numEntries, sizeof(struct sort_entry), compareSortEntries);
+
+    // Put rows in blocks, leaving room in each for adds
+    int numBlocks = (numEntries + SORT_BUILD_ROWS - 1) / SORT_BUILD_ROWS;
+    order->maxBlocks = numBlocks * 2 > 64 ? numBlocks * 2 : 64;
+    order->blocks = malloc(order->maxBlocks * sizeof(struct sort_block*));
+    if(order->blocks == NULL){
+        free(entries);
+        sortOrderFree(catalog, field);
+        return 0;
+    }
+    for(int i=0; i<numBlocks; i++){
+        struct sort_block *block = malloc(sizeof(struct sort_block));
+        if(block == NULL){
+            free(entries);
+            sortOrderFree(catalog, field);
+            return 0;
+        }
+        block->count = numEntries - i * SORT_BUILD_ROWS < SORT_BUILD_ROWS ? numEntries - i * SORT_BUILD_ROWS : SORT_BUILD_ROWS;
+        for(int j=0; j<block->count; j++){
+            block->rows[j] = entries[i * SORT_BUILD_ROWS + j].row;
+        }
+        order->blocks[order->numBlocks++] = block;
+    }
+    free(entries);
+    order->built = 1;
+    return 1;
+}
+
+// Make sure every order has been built, returning 0 if out of memory
+int sortOrdersReady(struct catalog *catalog){
+    for(int field=0; field<SORT_FIELDS; field++){
+        if(!sortOrderReady(catalog, field)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Update orders for a change to the catalog (called after the change is made, with oldBook NULL for an add and newBook NULL for a delete)
+void sortOrdersUpdate(struct catalog *catalog, int row, struct book *oldBook, struct book *newBook){
+    for(int field=0; field<SORT_FIELDS; field++){
+        if(!catalog->sorts[field].built){
+            continue;
+        }
+        struct sort_key oldKey, newKey;
+        if(oldBook != NULL){
+            sortKeyOfBook(field, oldBook, &oldKey);
+        }
+        if(newBook != NULL){
+            sortKeyOfBook(field, newBook, &newKey);
+        }
+        if(oldBook != NULL && newBook != NULL && compareSortKeys(&oldKey, &newKey) == 0){
+            continue;       // Place has not changed (e.g. a borrow)
+        }
+        if(oldBook != NULL){
+            sortRemove(catalog, field, row, &oldKey);
+        }
+        if(newBook != NULL && !sortAdd(catalog, field, row)){
+            sortOrderFree(catalog, field);      // Out of memory, so drop order (rebuilt on next listing)
+        }
+    }
+}
+
+// Free an order
+void sortOrderFree(struct catalog *catalog, int field){
+    struct sort_order *order = &catalog->sorts[field];
+    for(int i=0; i<order->numBlocks; i++){
+        free(order->blocks[i]);
+    }
+    free(order->blocks);
+    memset(order, 0, sizeof(*order));
+}
+
+// Free every order
+void sortOrdersFree(struct catalog *catalog){
+    for(int field=0; field<SORT_FIELDS; field++){
+        sortOrderFree(catalog, field);
+    }
+}
+
+// Get order from its name (title/author/year/added), returning -1 if there is no such order
+int sortFieldFromName(const char *name){
+    const char *names[SORT_FIELDS] = {"title", "author", "year", "added"};
+    for(int field=0; field<SORT_FIELDS; field++){
+        if(strcmp(name, names[field]) == 0){
+            return field;
+        }
+    }
+    return -1;
+}
+
+// Start cursor at the first book of an order
+void pageCursorStart(struct page_cursor *cursor, int field){
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->field = field;
+}
+
+// Write cursor as text (hex digits of its order and the place of the last book read), so clients can hand it back without reading it
+void pageCursorEncode(struct page_cursor *cursor, char *text){
+    unsigned char buffer[PAGE_CURSOR_LENGTH / 2];
+    unsigned char *pos = buffer;
+    putNumber(&pos, cursor->field, 1);
+    putNumber(&pos, cursor->number, 4);
+    putNumber(&pos, cursor->id, 4);
+    putText(&pos, cursor->text);
+    for(unsigned char *byte = buffer; byte < pos; byte++){
+        text += sprintf(text, "%02x", *byte);
+    }
+}
+
+// Read cursor written by pageCursorEncode, returning 0 if it is not a valid cursor
+int pageCursorDecode(const char *text, struct page_cursor *cursor){
+    unsigned char buffer[PAGE_CURSOR_LENGTH / 2];
+    size_t length = strlen(text);
+    if(length % 2 != 0 || length >= PAGE_CURSOR_LENGTH){
+        return 0;
+    }
+    for(size_t i=0; i<length/2; i++){
+        unsigned value;
+        if(!isxdigit((unsigned char)text[2*i]) || !isxdigit((unsigned char)text[2*i+1]) || sscanf(&text[2*i], "%2x", &value) != 1){
+            return 0;
+        }
+        buffer[i] = value;
+    }
+    const unsigned char *pos = buffer, *end = buffer + length/2;
+    long long field, number, id;
+    if(!getNumber(&pos, end, &field, 1) || field >= SORT_FIELDS || !getNumber(&pos, end, &number, 4) || !getNumber(&pos, end, &id, 4)
+       || !getText(&pos, end, cursor->text) || pos != end){
+        return 0;
+    }
+    cursor->field = field;
+    cursor->number = number;
+    cursor->id = id;
+    cursor->started = 1;
+    return 1;
+}
+
+// Get rows of the next page of up to size books from a cursor, moving it on to the last of them (more is set to 1 if books come after them)
+// Finds where the page starts in time proportional to log of the number of books, then reads only the page (NULL if out of memory)
+int* sortPage(struct catalog *catalog, struct page_cursor *cursor, int size, int *numRows, int *more){
+    *numRows = 0;
+    *more = 0;
+    int field = cursor->field;
+    int *rows = malloc((size + 1) * sizeof(int));
+    if(rows == NULL || !sortOrderReady(catalog, field)){
+        free(rows);
+        return NULL;
+    }
+    struct sort_order *order = &catalog->sorts[field];
+    int blockNum = 0, pos = 0;
+    if(cursor->started){
+        struct sort_key after = {field <= SORT_AUTHOR ? cursor->text : NULL, cursor->number, cursor->id + 1};       // First place after last book read (no other book can have a place between, as IDs are whole numbers)
+        pos = sortFind(catalog, field, &after, -1, &blockNum);
+    }
+    while(blockNum < order->numBlocks && *numRows < size){
+        struct sort_block *block = order->blocks[blockNum];
+        while(pos < block->count && *numRows < size){
+            rows[(*numRows)++] = block->rows[pos++];
+        }
+        if(pos == block->count){
+            blockNum++;
+            pos = 0;
+        }
+    }
+    *more = blockNum < order->numBlocks;
+
+    // Move cursor on to last book of page
+    if(*numRows > 0){
+        struct sort_key key;
+        sortKeyOfRow(catalog, field, rows[*numRows - 1], &key);
+        snprintf(cursor->text, sizeof(cursor->text), "%s", key.text != NULL ? key.text : "");
+        cursor->number = key.number;
+        cursor->id = key.id;
+        cursor->started = 1;
+    }
+    return rows;
+}
+
+// Compare two rows (for qsort)
+int compareRows(const void *a, const void *b){
+    return *(const int*)a - *(const int*)b;
+}
+
+// Compare two due entries, soonest due first (for qsort)
+int compareDueEntries(const void *a, const void *b){
+    struct due_entry *x = (struct due_entry*)a, *y = (struct due_entry*)b;
+    return dueBefore(x, y) ? -1 : dueBefore(y, x);
+}
+
+// Find rows of every book out, soonest due (most overdue) first, by going through every book (NULL if out of memory)
+// Uses no index, so it can read a view of the catalog (see catalogShare), which has none
+int* scanLoans(struct catalog *catalog, int *numMatches){
+    *numMatches = 0;
+    struct due_entry *loans = malloc((catalog->numRows + 1) * sizeof(struct due_entry));
+    int *rows = malloc((catalog->numRows + 1) * sizeof(int));
+    if(loans == NULL || rows == NULL){
+        free(loans);
+        free(rows);
+        return NULL;
+    }
+    for(int first=0; first<catalog->numRows; first+=CATALOG_CHUNK_ROWS){       // (reads only the date columns of each chunk)
+        struct catalog_chunk *chunk = catalogChunk(catalog, first);
+        int count = catalog->numRows - first < CATALOG_CHUNK_ROWS ? catalog->numRows - first : CATALOG_CHUNK_ROWS;
+        for(int i=0; i<count; i++){
+            if(chunk->date_out[i] != 0 && chunk->index[i] != BOOK_DELETED){
+                loans[*numMatches].due = chunk->date_due[i];
+                loans[*numMatches].row = first + i;
+                (*numMatches)++;
+            }
+        }
+    }
+    qsort(loans, *numMatches, sizeof(struct due_entry), compareDueEntries);
+    for(int i=0; i<*numMatches; i++){
+        rows[i] = loans[i].row;
+    }
+    free(loans);
+    return rows;
+}
+
+// Find rows of books person with given name has out that are due before a time (0 for all of them), in order (NULL if out of memory)
+// Only looks at that person's loans, so takes time proportional to the number of books they have out
+int* findPatronBooks(struct catalog *catalog, const char *name, int before, int *numMatches){
+    *numMatches = 0;
+    if(!patronIndexReady(catalog)){
+        return NULL;
+    }
+    struct patron_loans *patron = patronLoans(catalog, name);
+    int count = patron != NULL ? patron->count : 0;
+    int *matches = malloc((count + 1) * sizeof(int));
+    if(matches == NULL){
+        return NULL;
+    }
+    for(int i=0; i<count; i++){
+        int row = patron->rows[i];
+        if(before == 0 || catalogChunk(catalog, row)->date_due[row % CATALOG_CHUNK_ROWS] < before){
+            matches[(*numMatches)++] = row;
+        }
+    }
+    qsort(matches, *numMatches, sizeof(int), compareRows);
+    return matches;
+}
+
+// Read query from text (e.g. "title:night & year:1950-1970 | author:austen & out"), returning NULL if it is valid, or what is wrong with it
+// Predicates are title:text, author:text (containing text, ignoring case), year:yyyy or year:yyyy-yyyy, available, out and overdue
+const char* parseQuery(char *text, int current_date, struct query *query){
+    query->numAlternatives = 0;
+    query->current_date = current_date;
+    char *alternative = text;
+    while(alternative != NULL){
+        char *bar = strchr(alternative, '|');
+        if(bar != NULL){
+            *bar = '\0';
+        }
+        if(query->numAlternatives == QUERY_MAX_ALTERNATIVES){
+            return "too many alternatives";
+        }
+        struct conjunction *conjunction = &query->alternatives[query->numAlternatives++];
+        conjunction->numPredicates = 0;
+
+        // Read each predicate of alternative
+        char *item = alternative;
+        while(item != NULL){
+            char *ampersand = strchr(item, '&');
+            if(ampersand != NULL){
+                *ampersand = '\0';
+            }
+            while(*item == ' '){        // Trim spaces
+                item++;
+            }
+            size_t length = strlen(item);
+            while(length > 0 && item[length-1] == ' '){
+                item[--length] = '\0';
+            }
+            if(conjunction->numPredicates == QUERY_MAX_PREDICATES){
+                return "too many predicates";
+            }
+            struct predicate *predicate = &conjunction->predicates[conjunction->numPredicates++];
+            char *value = strchr(item, ':');
+            if(value != NULL){
+                *value++ = '\0';
+                while(*value == ' '){
+                    value++;
+                }
+            }
+            for(char *pos = item; *pos != '\0'; pos++){
+                *pos = tolower((unsigned char)*pos);
+            }
+            if((strcmp(item, "title") == 0 || strcmp(item, "author") == 0) && value != NULL){
+                if(strlen(value) > 50){
+                    return "text longer than 50 chars";
+                }
+                predicate->kind = item[0] == 't' ? PRED_TITLE : PRED_AUTHOR;
+                predicate->textLength = strlen(value);
+                for(size_t i=0; i<=predicate->textLength; i++){     // Upper-case text, as in searchBooks
+                    predicate->text[i] = toupper((unsigned char)value[i]);
+                }
+            }
+            else if(strcmp(item, "year") == 0 && value != NULL && isdigit((unsigned char)*value)){
+                predicate->kind = PRED_YEAR;
+                parseYearRange(value, &predicate->fromYear, &predicate->toYear);
+            }
+            else if(value == NULL && strcmp(item, "available") == 0){
+                predicate->kind = PRED_AVAILABLE;
+            }
+            else if(value == NULL && strcmp(item, "out") == 0){
+                predicate->kind = PRED_OUT;
+            }
+            else if(value == NULL && strcmp(item, "overdue") == 0){
+                predicate->kind = PRED_OVERDUE;
+            }
+            else{
+                return "unknown predicate (use title:text/author:text/year:yyyy[-yyyy]/available/out/overdue)";
+            }
+            item = ampersand != NULL ? ampersand + 1 : NULL;
+        }
+        alternative = bar != NULL ? bar + 1 : NULL;
+    }
+    return NULL;
+}
+
+// Write predicate as it would be given in a query
+void describePredicate(struct predicate *predicate, char *buffer, size_t size){
+    switch(predicate->kind){
+        case PRED_TITLE:
+        case PRED_AUTHOR:
+            snprintf(buffer, size, "%s:%s", predicate->kind == PRED_TITLE ? "title" : "author", predicate->text);
+            break;
+        case PRED_YEAR:
+            snprintf(buffer, size, "year:%d-%d", predicate->fromYear, predicate->toYear);
+            break;
+        default:
+            snprintf(buffer, size, "%s", predicate->kind == PRED_AVAILABLE ? "available" : predicate->kind == PRED_OUT ? "out" : "overdue");
+            break;
+    }
+}
+
+// Estimate number of rows trigram index gives for term (length of the shortest posting list of its trigrams, which is at least the number of candidates)
+long long trigramEstimate(struct trigram_index *index, const char *term){
+    uint32_t trigrams[64];
+    int numTrigrams = getTrigrams(term, trigrams);
+    long long estimate = LLONG_MAX;
+    for(int i=0; i<numTrigrams; i++){
+        struct posting_list *list = trigramList(index, trigrams[i], 0);
+        long long count = list != NULL ? list->count : 0;
+        if(count < estimate){
+            estimate = count;
+        }
+    }
+    return estimate;
+}
+
+// Count rows year index gives for a range of years
+long long yearEstimate(struct catalog *catalog, int fromYear, int toYear){
+    struct year_index *index = &catalog->years;
+    long long count = 0;
+    for(int pos = yearFind(index, fromYear); pos < index->numYears && index->years[pos].year <= toYear; pos++){
+        count += index->years[pos].count;
+    }
+    return count;
+}
+
+// Pick access path for an alternative: the one expected to give the fewest rows (a scan gives every book, and is used if no predicate has an index)
+void planConjunction(struct catalog *catalog, struct conjunction *conjunction, struct query_plan *plan){
+    memset(plan, 0, sizeof(*plan));
+    plan->path = PATH_SCAN;
+    plan->driver = -1;
+    plan->estimate = catalog->numRows - catalog->numFree;
+    for(int i=0; i<conjunction->numPredicates; i++){
+        struct predicate *predicate = &conjunction->predicates[i];
+        long long estimate;
+        int path;
+        if((predicate->kind == PRED_TITLE || predicate->kind == PRED_AUTHOR) && predicate->textLength >= 3 && searchIndexReady(catalog)){
+            path = predicate->kind == PRED_TITLE ? PATH_TITLE_INDEX : PATH_AUTHOR_INDEX;
+            estimate = trigramEstimate(path == PATH_TITLE_INDEX ? &catalog->search.title : &catalog->search.author, predicate->text);
+        }
+        else if(predicate->kind == PRED_YEAR && yearIndexReady(catalog)){
+            path = PATH_YEAR_INDEX;
+            estimate = yearEstimate(catalog, predicate->fromYear, predicate->toYear);
+        }
+        else if((predicate->kind == PRED_OUT || predicate->kind == PRED_OVERDUE) && dueIndexReady(catalog)){
+            path = PATH_DUE_INDEX;
+            estimate = catalog->due.count;      // (every book on loan; overdue ones are taken from the top of the heap)
+        }
+        else{
+            continue;       // No index for predicate
+        }
+        if(estimate < plan->estimate){
+            plan->path = path;
+            plan->driver = i;
+            plan->estimate = estimate;
+        }
+    }
+}
+
+// Check if book in given row matches every predicate of an alternative
+int rowMatches(struct catalog *catalog, int row, struct conjunction *conjunction, int current_date){
+    struct catalog_chunk *chunk = catalogChunk(catalog, row);
+    int i = row % CATALOG_CHUNK_ROWS;
+    if(chunk->index[i] == BOOK_DELETED){
+        return 0;
+    }
+    for(int j=0; j<conjunction->numPredicates; j++){
+        struct predicate *predicate = &conjunction->predicates[j];
+        int match;
+        switch(predicate->kind){
+            case PRED_TITLE:
+                match = containsIgnoreCase(chunk->text[i].title, predicate->text, predicate->textLength);
+                break;
+            case PRED_AUTHOR:
+                match = containsIgnoreCase(stringGet(catalog->strings, chunk->text[i].author), predicate->text, predicate->textLength);
+                break;
+            case PRED_YEAR:
+                match = chunk->pub_year[i] >= predicate->fromYear && chunk->pub_year[i] <= predicate->toYear;
+                break;
+            case PRED_AVAILABLE:
+                match = chunk->date_out[i] == 0;
+                break;
+            case PRED_OUT:
+                match = chunk->date_out[i] != 0;
+                break;
+            default:        // PRED_OVERDUE
+                match = chunk->date_due[i] != 0 && chunk->date_due[i] < current_date;
+                break;
+        }
+        if(!match){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Plan and run one alternative of a query, returning matching rows in the order the access path gives them (NULL if out of memory)
+int* runConjunction(struct catalog *catalog, struct query *query, struct conjunction *conjunction, struct query_plan *plan, int *numMatches){
+    double start = nowSeconds();
+    planConjunction(catalog, conjunction, plan);
+    struct predicate *driver = plan->driver >= 0 ? &conjunction->predicates[plan->driver] : NULL;
+    int *rows = NULL, numRows = 0;
+    *numMatches = 0;
+
+    // Get rows from access path
+    switch(plan->path){
+        case PATH_TITLE_INDEX:
+        case PATH_AUTHOR_INDEX:
+            rows = trigramCandidates(plan->path == PATH_TITLE_INDEX ? &catalog->search.title : &catalog->search.author, driver->text, &numRows);
+            break;
+        case PATH_YEAR_INDEX: ;
+            struct year_cursor cursor;
+            int row;
+            rows = malloc((plan->estimate + 1) * sizeof(int));
+            if(rows != NULL && yearCursorStart(catalog, &cursor, driver->fromYear, driver->toYear)){
+                while((row = yearCursorNext(catalog, &cursor)) != -1){
+                    rows[numRows++] = row;
+                }
+            }
+            break;
+        case PATH_DUE_INDEX:
+            rows = findDueBooks(catalog, driver->kind == PRED_OVERDUE ? query->current_date : INT_MAX, &numRows);
+            break;
+        default:        // PATH_SCAN (rows are checked as they are read, below)
+            rows = malloc((catalog->numRows ? catalog->numRows : 1) * sizeof(int));
+            break;
+    }
+    if(rows == NULL){
+        return NULL;
+    }
+
+    // Keep rows that match every predicate (the driving one too, as index rows are only candidates)
+    int count = 0;
+    if(plan->path == PATH_SCAN){
+        for(int row=0; row<catalog->numRows; row++){
+            if(rowMatches(catalog, row, conjunction, query->current_date)){
+                rows[count++] = row;
+            }
+        }
+        numRows = catalog->numRows;
+    }
+    else{
+        for(int i=0; i<numRows; i++){
+            if(rowMatches(catalog, rows[i], conjunction, query->current_date)){
+                rows[count++] = rows[i];
+            }
+        }
+    }
+    plan->examined = numRows;
+    plan->matched = count;
+    plan->seconds = nowSeconds() - start;
+    *numMatches = count;
+    return rows;
+}
+
+// Run query, filling in the plan of each alternative, returning matching rows (NULL if out of memory)
+// One alternative gives rows in the order its access path does (e.g. year order from the year index); several give them in row order, each row once
+int* runQuery(struct catalog *catalog, struct query *query, struct query_plan *plans, int *numMatches){
+    *numMatches = 0;
+    if(query->numAlternatives == 1){
+        return runConjunction(catalog, query, &query->alternatives[0], &plans[0], numMatches);
+    }
+    int *matches = NULL;
+    int count = 0;
+    for(int i=0; i<query->numAlternatives; i++){
+        int numRows;
+        int *rows = runConjunction(catalog, query, &query->alternatives[i], &plans[i], &numRows);
+        int *newMatches = rows != NULL ? realloc(matches, (count + numRows + 1) * sizeof(int)) : NULL;
+        if(newMatches == NULL){
+            free(rows);
+            free(matches);
+            return NULL;
+        }
+        matches = newMatches;
+        memcpy(matches + count, rows, numRows * sizeof(int));
+        count += numRows;
+        free(rows);
+    }
+
+    // Sort, then drop rows matched by more than one alternative
+    qsort(matches, count, sizeof(int), compareRows);
+    int kept = 0;
+    for(int i=0; i<count; i++){
+        if(kept == 0 || matches[kept-1] != matches[i]){
+            matches[kept++] = matches[i];
+        }
+    }
+    *numMatches = kept;
+    return matches;
+}
+
+// Get name of access path (as shown by explain)
+const char* accessPathName(int path){
+    static const char *names[] = {"scan", "title_index", "author_index", "year_index", "due_index"};
+    return names[path];
+}
+
+// Write plan of each alternative of a query that has been run, one line each:
+// plan,<alternative>,<access path>,<predicate it uses>,<rows expected>,<rows examined>,<rows matched>,<seconds>
+void explainQuery(FILE *out, struct query *query, struct query_plan *plans){
+    for(int i=0; i<query->numAlternatives; i++){
+        char driver[64] = "";
+        if(plans[i].driver >= 0){
+            describePredicate(&query->alternatives[i].predicates[plans[i].driver], driver, sizeof(driver));
+        }
+        fprintf(out, "plan,%d,%s,%s,%lld,%lld,%d,%.6f\n", i+1, accessPathName(plans[i].path), driver, plans[i].estimate, plans[i].examined, plans[i].matched, plans[i].seconds);
+    }
+}
+
+int getDate(void){
+    system("cls");      // Clear screen
+
+    // Get current date (from computer's time)
+    int current_date = dateToday();
+
+    // Check that is correct date
+    char choice;
+    char dateString[DATE_LENGTH];
+    do{
+        printf("Todays date is: %s\nIs this correct? (y/n)\n", date_to_string(current_date, dateString));
+        fflush(stdin);
+        scanf("%c", &choice);
+    } while(!(choice=='y' || choice=='n'));      // Ensure user picks one of the options
+
+    printf("\n");
+
+    if(choice == 'n'){      // If date not correct
+        int newDay, newMonth, newYear;
+        char newDate[11];
+        do{
+            // Get dd/mm/yyyy data from user
+            do{
+                printf("Day (dd): ");
+                fflush(stdin); scanf("%d", &newDay);
+            } while(!(newDay>=1 && newDay <= 31));
+            do{
+                printf("Month (mm): ");
+                fflush(stdin); scanf("%d", &newMonth);
+            } while(!(newMonth>=1 && newMonth <= 12));
+            do{
+                printf("Year (yyyy): ");
+                fflush(stdin); scanf("%d", &newYear);
+            } while(!(newYear>=2023 && newYear < 2038));
+
+            // Store new dd//mm/yyyy, making sure right # digits used
+            snprintf(newDate, 11, "%.2d/%.2d/%.4d", newDay, newMonth, newYear);
+
+        } while(!string_to_date(newDate, &current_date));      // Repeat until date is valid (e.g. not 31/02)
+        printf("\n");
+    }
+    return current_date;        // Return current date
+}
+
+// Start text writer (text is kept in its buffer, and written to out in one go when the buffer fills or is flushed)
+void writerInit(struct text_writer *writer, FILE *out){
+    writer->out = out;
+    writer->length = 0;
+}
+
+// Write everything in text writer's buffer to its file
+void writerFlush(struct text_writer *writer){
+    if(writer->length > 0){
+        fwrite(writer->data, 1, writer->length, writer->out);
+        writer->length = 0;
+    }
+    fflush(writer->out);
+}
+
+// Add all data for book in given row to text writer (one formatted write per book, read straight from the catalog's columns)
+void writerBook(struct text_writer *writer, struct catalog *catalog, int row){
+    if(writer->length + WRITER_MAX_ENTRY > WRITER_BUFFER_SIZE){
+        writerFlush(writer);
+    }
+    struct catalog_chunk *chunk = catalogChunk(catalog, row);
+    int i = row % CATALOG_CHUNK_ROWS;
+    char dateString[DATE_LENGTH];
+    int length = snprintf(writer->data + writer->length, WRITER_MAX_ENTRY, "Book %d\nTitle: %s\nAuthor: %s\nPublication year: %d\nDate added: %s\nStatus: %s\n\n",
+        chunk->index[i]+1, chunk->text[i].title, stringGet(catalog->strings, chunk->text[i].author), chunk->pub_year[i],
+        date_to_string(chunk->text[i].date_added, dateString), chunk->date_out[i] != 0 ? "Out" : "Available");       // (book is out if it has a date out)
+    writer->length += length < WRITER_MAX_ENTRY ? length : WRITER_MAX_ENTRY - 1;
+}
+
+void printBooks(struct catalog *catalog){
+    system("cls");
+
+    // Ask user what to sort by
+    char choice;
+    printf("What do you want to sort by?\n");
+    printf("[t] Title\n[a] Author\n[p] Publication year\n[d] Date added\n\n");
+    do{
+        fflush(stdin);
+        scanf("%c", &choice);
+    } while(!(choice=='t' || choice=='a' || choice=='p' || choice=='d'));      // Ensure user picks one of the options
+
+    // Print a page of books at a time, in that order, until user goes back or there are no more
+    struct text_writer *writer = malloc(sizeof(struct text_writer));
+    struct page_cursor cursor;
+    pageCursorStart(&cursor, choice == 't' ? SORT_TITLE : choice == 'a' ? SORT_AUTHOR : choice == 'p' ? SORT_YEAR : SORT_ADDED);
+    int page = 0, more = 1;
+    char input = 'n';
+    while(input == 'n' && more){
+        system("cls");
+        int numRows;
+        double start = nowSeconds();
+        int *rows = writer != NULL ? sortPage(catalog, &cursor, PAGE_DEFAULT_BOOKS, &numRows, &more) : NULL;
+        metricsRecord(METRIC_REPORT, start, rows != NULL);
+        if(rows == NULL){
+            printf("Out of memory.\n\n");
+            more = 0;
+        }
+        else{
+            writerInit(writer, stdout);
+            for(int i=0; i<numRows; i++){
+                writerBook(writer, catalog, rows[i]);
+            }
+            writerFlush(writer);
+            free(rows);
+            printf("Page %d%s\n\n", ++page, more ? "" : " (last)");
+        }
+
+        // Allow user to see next page, or return to main menu
+        printf(more ? "[n] Next page\n[q] Go back\n" : "[q] Go back\n");
+        do{
+            fflush(stdin);
+            input = getchar();
+        } while(input != 'q' && !(input == 'n' && more));
+    }
+    free(writer);
+}
+
+// Ask user for index of a book until they give one that is in the catalog, returning its row
+int askForBook(struct catalog *catalog, char *prompt){
+    int index, row;
+    do{
+        printf("%s", prompt);
+        fflush(stdin);
+        scanf("%d", &index);
+        row = catalogFind(catalog, index - 1);      // Subtract 1 to get book ID
+    } while(row == -1);     // Ensure book exists
+    printf("\n");
+    return row;
+}
+
+// Convert calendar date to day number (days since 1/1/1970, counting back from there for earlier dates)
+int dateFromCalendar(int year, int month, int day){
+    // Count from 1/3/0000, so leap day is the last day of each year (years are grouped into 400 year cycles of 146097 days)
+    year -= month <= 2;
+    int cycle = (year >= 0 ? year : year - 399) / 400;
+    int yearOfCycle = year - cycle * 400;
+    int dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    int dayOfCycle = yearOfCycle * 365 + yearOfCycle / 4 - yearOfCycle / 100 + dayOfYear;
+    return cycle * 146097 + dayOfCycle - 719468;        // (719468 days from 1/3/0000 to 1/1/1970)
+}
+
+// Convert day number to calendar date (reverse of dateFromCalendar)
+void dateToCalendar(int date, int *year, int *month, int *day){
+    date += 719468;
+    int cycle = (date >= 0 ? date : date - 146096) / 146097;
+    int dayOfCycle = date - cycle * 146097;
+    int yearOfCycle = (dayOfCycle - dayOfCycle / 1460 + dayOfCycle / 36524 - dayOfCycle / 146096) / 365;
+    int dayOfYear = dayOfCycle - (365 * yearOfCycle + yearOfCycle / 4 - yearOfCycle / 100);
+    int monthFromMarch = (5 * dayOfYear + 2) / 153;
+    *day = dayOfYear - (153 * monthFromMarch + 2) / 5 + 1;
+    *month = monthFromMarch < 10 ? monthFromMarch + 3 : monthFromMarch - 9;
+    *year = cycle * 400 + yearOfCycle + (*month <= 2);
+}
+
+// Get today's date (from computer's time) as day number
+int dateToday(void){
+    time_t seconds = time(NULL);
+    struct tm local;
+#ifdef _WIN32
+    localtime_s(&local, &seconds);
+#else
+    localtime_r(&seconds, &local);
+#endif
+    return dateFromCalendar(local.tm_year + 1900, local.tm_mon + 1, local.tm_mday);
+}
+
+// Read dd/mm/yyyy date into day number, returning 0 if it is not a real date
+int string_to_date(const char *stringFormatted, int *date){
+    // Split date into numbers (1-2 digit day and month, 4 digit year)
+    int parts[3] = {0};
+    const char *pos = stringFormatted;
+    for(int i=0; i<3; i++){
+        int maxDigits = (i == 2) ? 4 : 2, digits = 0;
+        while(digits < maxDigits && *pos >= '0' && *pos <= '9'){
+            parts[i] = parts[i]*10 + (*pos++ - '0');
+            digits++;
+        }
+        if(digits == 0 || (i == 2 && digits != 4) || *pos != (i == 2 ? '\0' : '/')){
+            return 0;
+        }
+        pos++;
+    }
+
+    // Check date exists (convert to day number and back, and check it is the same, so 31/02 is not accepted)
+    int converted = dateFromCalendar(parts[2], parts[1], parts[0]);
+    int year, month, day;
+    dateToCalendar(converted, &year, &month, &day);
+    if(parts[1] < 1 || parts[1] > 12 || day != parts[0] || month != parts[1] || year != parts[2]){
+        return 0;
+    }
+    *date = converted;
+    return 1;
+}
+
+// Write day number as dd/mm/yyyy into buffer (at least DATE_LENGTH chars), returning buffer so it can be printed straight away
+char* date_to_string(int date, char *buffer){
+    int year, month, day;
+    dateToCalendar(date, &year, &month, &day);
+    year = year < 0 ? 0 : year > 9999 ? 9999 : year;        // (only 4 digits fit)
+    buffer[0] = '0' + day / 10;
+    buffer[1] = '0' + day % 10;
+    buffer[2] = '/';
+    buffer[3] = '0' + month / 10;
+    buffer[4] = '0' + month % 10;
+    buffer[5] = '/';
+    buffer[6] = '0' + year / 1000;
+    buffer[7] = '0' + year / 100 % 10;
+    buffer[8] = '0' + year / 10 % 10;
+    buffer[9] = '0' + year % 10;
+    buffer[10] = '\0';
+    return buffer;
+}
+
+// Get local time minus UTC at a moment, in seconds (from the C library's time zone data)
+long localOffset(long long seconds){
+    time_t moment = seconds;
+    struct tm local;
+#ifdef _WIN32
+    localtime_s(&local, &moment);
+#else
+    localtime_r(&moment, &local);
+#endif
+    long long localSeconds = (long long)dateFromCalendar(local.tm_year + 1900, local.tm_mon + 1, local.tm_mday) * DATE_SECONDS_PER_DAY + local.tm_hour*3600 + local.tm_min*60 + local.tm_sec;
+    return localSeconds - seconds;
+}
+
+// Set up cache of time zone offsets (each thread converting dates to/from seconds has its own)
+void dateCacheInit(struct date_cache *cache){
+    for(int i=0; i<DATE_CACHE_SIZE; i++){
+        cache->day[i] = INT_MIN;
+    }
+}
+
+// Get local time minus UTC at a moment, in seconds, only asking the C library about each day once
+long dateOffset(struct date_cache *cache, long long seconds){
+    long long utcDay = seconds >= 0 ? seconds / DATE_SECONDS_PER_DAY : (seconds - DATE_SECONDS_PER_DAY + 1) / DATE_SECONDS_PER_DAY;
+    int slot = utcDay & (DATE_CACHE_SIZE - 1);
+    if(cache->day[slot] != utcDay){
+        // Offset is the same all day unless the clocks change during it (then each moment of that day is looked up)
+        long long start = utcDay * DATE_SECONDS_PER_DAY;
+        long startOffset = localOffset(start);
+        long endOffset = localOffset(start + DATE_SECONDS_PER_DAY - 1);
+        cache->day[slot] = utcDay;
+        cache->offset[slot] = startOffset == endOffset ? startOffset : DATE_OFFSET_VARIES;
+    }
+    return cache->offset[slot] != DATE_OFFSET_VARIES ? cache->offset[slot] : localOffset(seconds);
+}
+
+// Convert time in seconds (as stored in database file) to the local day it falls on (0 stays as 0, meaning not set)
+int dateFromSeconds(struct date_cache *cache, long long seconds){
+    if(seconds == 0){
+        return 0;
+    }
+    long long local = seconds + dateOffset(cache, seconds);
+    return local >= 0 ? local / DATE_SECONDS_PER_DAY : (local - DATE_SECONDS_PER_DAY + 1) / DATE_SECONDS_PER_DAY;
+}
+
+// Convert day number to time in seconds (midday local time, well away from any change of clocks), for database file
+long long dateToSeconds(struct date_cache *cache, int date){
+    if(date == 0){
+        return 0;
+    }
+    long long midday = (long long)date * DATE_SECONDS_PER_DAY + DATE_SECONDS_PER_DAY / 2;       // Midday if local time was UTC
+    return midday - dateOffset(cache, midday - dateOffset(cache, midday));
+}
+
+void addBook(struct catalog *catalog, int current_date){
+    system("cls");
+
+    // Get ID for new book
+    int new_index = catalogNewId(catalog);
+    if(new_index == -1){
+        printf("Book cannot be added.\n");
+        return;
+    }
+
+    // User input for title (takes max 50 chars)
+    char new_title[51];
+    printf("Title (max 50 chars, cannot include ','): ");
+    fflush(stdin);
+    fgets(new_title,51,stdin);
+    int size = strlen(new_title);
+    new_title[size-1]='\0';     // Remove '\n' from end of string
+
+    // User input for author (takes max 50 chars)
+    char new_author[51];
+    printf("Author (max 50 chars, cannot include ','): ");
+    fflush(stdin);
+    fgets(new_author,51,stdin);
+    size = strlen(new_author);
+    new_author[size-1]='\0';     // Remove '\n' from end of string
+
+    // Get max year for publication date (current year)
+    int maxYear, month, day;
+    dateToCalendar(current_date, &maxYear, &month, &day);
+
+    // Ask user for publication year
+    int new_pub_year;
+    do{
+        printf("Publication year (minimum 0 AD): ");
+        fflush(stdin); scanf("%d", &new_pub_year);        // Read max of 50 chars
+    } while(!(new_pub_year > 0 && new_pub_year < maxYear));     // Check within range (0-current year)
+
+    // Set other variables
+    struct mutation new_book;
+    new_book.op = OP_ADD;
+    new_book.id = new_index;
+    new_book.book.index = new_index;
+    strcpy(new_book.book.title, new_title);
+    strcpy(new_book.book.author, new_author);
+    new_book.book.pub_year = new_pub_year;
+    new_book.book.date_added = current_date;      // Set date added to be today's date
+    new_book.book.date_out = 0;       // Set date out to be blank
+    new_book.book.date_due = 0;       // Set date due to be blank
+    strcpy(new_book.book.name, "0");      // Set name to be blank
+
+    // Add book to catalog (in the row of a deleted book, or at the end)
+    if(!commitMutation(catalog, &new_book)){
+        printf("Book cannot be added.\n");
+    }
+}
+
+void deleteBook(struct catalog *catalog){
+    // Get book to be deleted
+    struct book book;
+    catalogRead(catalog, askForBook(catalog, "Index to delete: "), &book);
+
+    // Print book info
+    printf("Title: %s\n", book.title);
+    printf("Author: %s\n", book.author);
+    printf("Publication year: %d\n", book.pub_year);
+    printf("\n");
+
+    // Check this is the right book
+    printf("Delete this book? (permanent) [y/n]\n");
+    char choice;
+    do{
+        fflush(stdin);
+        scanf("%c", &choice);
+    } while(!(choice=='y' || choice=='n'));      // Ensure user picks one of the options
+
+    // If index is correct
+    if(choice == 'y'){
+        struct mutation deletion = {.op = OP_DELETE, .id = book.index};
+        if(!commitMutation(catalog, &deletion)){     // Remove book (no other book's index changes)
+            printf("Book cannot be deleted.\n");
+        }
+    }
+    printf("\n");
+}
+
+void editBook(struct catalog *catalog, int current_date){
+    // Get book to edit from user
+    int row = askForBook(catalog, "Index to edit: ");
+    struct book book;
+
     // Set editing variable (repeat until user quits)
     int editing = 1;
     while(editing){
 
-        system("cls");
-        // Print book info
-        printf("Title: %s\n", books[index_to_edit].title);
-        printf("Author: %s\n", books[index_to_edit].author);
-        printf("Publication year: %d\n", books[index_to_edit].pub_year);
-        printf("\n");
+        system("cls");
+        catalogRead(catalog, row, &book);       // (again after each edit)
+        // Print book info
+        printf("Title: %s\n", book.title);
+        printf("Author: %s\n", book.author);
+        printf("Publication year: %d\n", book.pub_year);
+        printf("\n");
+
+        // Get user input for what to edit
+        char choice;
+        printf("What do you want to edit?\n");
+        printf("[t] Title\n[a] Author\n[p] Publication year\n[q] Stop editing\n");
+        do{
+            fflush(stdin);
+            scanf("%c", &choice);
+        } while(!(choice=='t' || choice=='a' || choice=='p' || choice=='q'));      // Ensure user picks one of the options
+        printf("\n");
+
+        int size;
+        struct mutation edit = {.op = OP_EDIT, .id = book.index, .book = book};        // Start with current values
+        switch(choice){
+
+            // Let user set title to new value
+            case 't': ;
+                char new_title[51];
+                printf("Title (max 50 chars, cannot include ','): ");
+                fflush(stdin);
+                fgets(new_title,51,stdin);
+
+                size = strlen(new_title);
+                new_title[size-1]='\0';     // remove '\n' from end of string
+
+                strcpy(edit.book.title, new_title);      // Set new value
+                break;
+
+            // Let user set author to new value
+            case 'a': ;
+                char new_author[51];
+                printf("Author (max 50 chars, cannot include ','): ");
+                fflush(stdin);
+                fgets(new_author,51,stdin);
+
+                size = strlen(new_author);
+                new_author[size-1]='\0';     // remove '\n' from end of string
+
+                strcpy(edit.book.author, new_author);      // Set new value
+
+                break;
+
+            // Let user set publication year to new value
+            case 'p': ;
+                int maxYear, month, day;
+                dateToCalendar(current_date, &maxYear, &month, &day);
+                int new_pub_year;
+                do{
+                    printf("Publication year (minimum 0AD): ");
+                    fflush(stdin); scanf("%d", &new_pub_year);        // Read max of 50 chars
+                } while(!(new_pub_year > 0 && new_pub_year < maxYear));     // Check value in range (0-current year)
+
+                edit.book.pub_year = new_pub_year;      // Set new value
+                break;
+
+            // Let user stop editing
+            case 'q': ;
+                editing = 0;
+                break;
+        }
+        if(editing && !commitMutation(catalog, &edit)){        // Set values in catalog
+            printf("Book cannot be edited.\n");
+        }
+        printf("\n");
+    }
+}
+
+void saveFile(char* fileName, struct catalog *catalog){
+    system("cls");      // Clear screen
+    printf("Saving file, do not close...\n");       // Tell user not to close program
+
+    char path[SHARD_PATH_LENGTH];
+    if(shardPath(fileName, 0, catalog->numShards, path) && !fileExists(path)){      // Check if file can be opened
+        printf("Data file cannot be found. New file will be created.\n");      // Tell user file cannot be found
+    }
+
+    long long saves = catalog->journal != NULL ? catalog->journal->stats.saves : 0;
+    int saved = writeDatabase(fileName, catalog);
+
+    if(saved){
+        printf("File saved. You can now close the program.\n");       // Tell user they can exit
+        if(catalog->journal != NULL && catalog->journal->stats.saves > saves){      // (nothing is written if the database file already has every change)
+            printf("(%.1f KB written in %.3f s; %lld saves this session)\n", catalog->journal->stats.lastBytes/1024.0, catalog->journal->stats.lastSeconds, catalog->journal->stats.saves);
+        }
+    }
+    else if(catalog->journal != NULL){
+        printf("File cannot be saved. Changes are kept in the journal and will be recovered on next start.\n");
+    }
+    else{
+        printf("File cannot be saved.\n");
+    }
+}
+
+// Write every change to database file (folding journal into it, or writing whole catalog if there is no journal), returning 1 if successful
+int writeDatabase(char *fileName, struct catalog *catalog){
+    int saved;
+    if(catalog->journal != NULL){
+        journalWaitForCompaction(catalog->journal);
+        if(catalog->journal->records == 0 && !fileExists(catalog->journal->oldPath)){      // Database file already has every change
+            saved = 1;
+        }
+        else{
+            saved = compactJournal(catalog, 0);     // Fold journal into database file
+        }
+    }
+    else{       // No journal, so write whole catalog to temp file(s) then swap them in
+        double start = nowSeconds();
+        struct catalog books;
+        saved = catalogCopy(catalog, &books) && writeShards(fileName, &books, catalog->numShards, NULL, NULL);
+        catalogFree(&books);
+        metricsRecord(METRIC_SAVE, start, saved);
+    }
+    return saved;
+}
+
+void borrowBook(struct catalog *catalog, int current_date){
+    // Get book to be borrowed
+    struct book book;
+    catalogRead(catalog, askForBook(catalog, "Index to borrow: "), &book);
+
+    if(book.date_out == 0){       // If the book is not currently out
+        system("cls");      // Clear screen
+
+        // Get user's name
+        char name[51];
+        int size;
+        printf("Full name (max 50 chars, cannot include ','): ");
+        fflush(stdin);
+        fgets(name,51,stdin);
+
+        size = strlen(name);        // Get rid of \n from end of string
+        name[size-1]='\0';      // Get rid of \n from end of string
+
+        // Check they do not have too many books out already
+        int numLoans = patronLoanCount(catalog, name);
+        if(numLoans >= PATRON_MAX_LOANS){
+            printf("\n%s already has %d books out (max %d)\n\n[q] Go back\n", name, numLoans, PATRON_MAX_LOANS);
+            char input;
+            do{
+                fflush(stdin);
+                input = getchar();
+            } while(input != 'q');
+            return;
+        }
+
+        struct mutation loan = {.op = OP_BORROW, .id = book.index};
+        strcpy(loan.book.name, name);      // Copy name to change
+        loan.book.date_out = current_date;     // Add date out (current date) to change
+        loan.book.date_due = current_date + 7;        // Add date due (7 days form current date) to change
+
+        // Tell user if book successfully borrowed
+        printf("\n");
+        if(commitMutation(catalog, &loan)){
+            printf("Book successfully borrowed\n\n");
+        }
+        else{
+            printf("Book cannot be borrowed\n\n");
+        }
+    }
+    else{       // If book already out, tell user
+        printf("This book is already out\n\n");
+    }
+
+    // Allow user to go back to menu
+    printf("[q] Go back\n");
+    char input;
+    do{
+        fflush(stdin);
+        input = getchar();
+    } while(input != 'q');
+}
+
+void returnBook(struct catalog *catalog, int current_date){
+    // Get book to be returned
+    struct book book;
+    catalogRead(catalog, askForBook(catalog, "Index to return: "), &book);
+
+    if(book.date_out != 0){
+        system("cls");
+
+        struct mutation loan = {.op = OP_RETURN, .id = book.index};
+        loan.date_returned = current_date;
+        if(commitMutation(catalog, &loan)){
+            printf("Book successfully returned\n\n");
+        }
+        else{
+            printf("Book cannot be returned\n\n");
+        }
+    }
+    else{
+        printf("This book is not currently out\n\n");
+    }
+
+    printf("[q] Go back\n");
+    char input;
+    do{
+        fflush(stdin);
+        input = getchar();
+    } while(input != 'q');
+}
+
+void searchBooks(struct catalog *catalog, int current_date){
+    system("cls");      // Clear screen
+
+    // Ask user what to search by
+    char choice;
+    printf("What do you want to search by?\n");
+    printf("[t] Title\n[a] Author\n[p] Publication year (or range, e.g. 1950-1970)\n[q] Query (e.g. title:night & year:1950-1970 | author:austen & out)\n\n");
+    do{
+        fflush(stdin);
+        scanf("%c", &choice);
+    } while(!(choice=='t' || choice=='a' || choice=='p' || choice=='q'));      // Ensure user picks one of the options
+    printf("\n");
+
+    // Ask user for search term
+    char term[256];
+    printf(choice == 'q' ? "Query: " : "Search term (max 50 chars): ");
+    fflush(stdin);
+    fgets(term, choice == 'q' ? (int)sizeof(term) : 51, stdin);
+    term[strcspn(term, "\n")] = '\0';     // Remove '\n' from string
+    printf("\n");
+
+    // Turn search term into a query with one predicate (title/author contains term, or year in range)
+    char text[256 + 8];
+    snprintf(text, sizeof(text), "%s%s", choice == 't' ? "title:" : choice == 'a' ? "author:" : choice == 'p' ? "year:" : "", term);
+    struct query query;
+    struct query_plan plans[QUERY_MAX_ALTERNATIVES];
+    const char *error = parseQuery(text, current_date, &query);
+
+    // Print matching books to user (in year order for a year search)
+    system("cls");
+    int numMatches = 0;
+    double start = nowSeconds();
+    int *matches = error == NULL ? runQuery(catalog, &query, plans, &numMatches) : NULL;
+    metricsRecord(choice == 'q' ? METRIC_QUERY : METRIC_SEARCH, start, matches != NULL);
+    if(error != NULL){
+        printf("Query cannot be read: %s.\n", error);
+    }
+    else if(matches == NULL){
+        printf("Out of memory.\n");
+    }
+    else{
+        printf("Matching books: \n");
+        for(int i=0; i<numMatches; i++){
+            struct book book;
+            catalogRead(catalog, matches[i], &book);
+
+            // Print relevant information about book
+            printf("Book %d:\t%s, \t%s, \t%d, \t%s\n", book.index+1, book.title, book.author, book.pub_year, book.date_out != 0 ? "OUT" : "AVAILABLE");
+        }
+
+        // Nothing has title/author containing term, so show the closest ones (allowing a few typos), closest first
+        if(numMatches == 0 && (choice == 't' || choice == 'a')){
+            int numClosest;
+            start = nowSeconds();
+            struct fuzzy_match *closest = fuzzyFindBooks(catalog, choice == 't' ? FIELD_TITLE : FIELD_AUTHOR, query.alternatives[0].predicates[0].text, FUZZY_DEFAULT_RESULTS, &numClosest);
+            metricsRecord(METRIC_FUZZY, start, closest != NULL);
+            if(closest != NULL && numClosest > 0){
+                printf("No exact matches. Closest matches:\n");
+                for(int i=0; i<numClosest; i++){
+                    struct book book;
+                    catalogRead(catalog, closest[i].row, &book);
+                    printf("Book %d:\t%s, \t%s, \t%d, \t%s\n", book.index+1, book.title, book.author, book.pub_year, book.date_out != 0 ? "OUT" : "AVAILABLE");
+                }
+            }
+            free(closest);
+        }
+
+        // Show how query was run (access path and time of each alternative)
+        if(choice == 'q'){
+            printf("\n%d books found.\n", numMatches);
+            for(int i=0; i<query.numAlternatives; i++){
+                char driver[64] = "";
+                if(plans[i].driver >= 0){
+                    describePredicate(&query.alternatives[i].predicates[plans[i].driver], driver, sizeof(driver));
+                }
+                printf("Plan %d: %s %s, %lld rows examined, %d matched, %.3f ms\n", i+1, accessPathName(plans[i].path), driver, plans[i].examined, plans[i].matched, plans[i].seconds * 1000);
+            }
+        }
+    }
+    free(matches);
+    printf("\n");
+
+    // Give user options
+    printf("[b] Borrow book \n[r] Return a book \n[e] Edit a book \n[d] Delete a book \n[s] Search again \n[q] Stop searching\n");
+    do{
+        fflush(stdin);
+        scanf("%c", &choice);
+    } while(!(choice == 'b' || choice == 'r' || choice=='e' || choice=='d' || choice=='s' || choice=='q'));      // Ensure user picks one of the options
+
+    printf("\n");
+
+    // Run related function/end searching
+    switch(choice){
+        case 'b':
+            borrowBook(catalog, current_date);
+            break;
+        case 'r':
+            returnBook(catalog, current_date);
+            break;
+        case 'e':
+            editBook(catalog, current_date);
+            break;
+        case 'd':
+            deleteBook(catalog);
+            break;
+        case 's':
+            searchBooks(catalog, current_date);
+            break;
+        case 'q':
+            break;
+    }
+}
+
+void checkBooks(struct catalog *catalog, int current_date){
+    system("cls");
+
+    // Print all books where time between date due < current date (over due), most overdue first
+    int numOverdue;
+    double start = nowSeconds();
+    int *overdue = findDueBooks(catalog, current_date, &numOverdue);
+    metricsRecord(METRIC_CHECK, start, overdue != NULL);
+    printf("Currently overdue books:\n");
+    for(int i=0; i<numOverdue; i++){        // Go through every overdue book
+        struct book book;
+        catalogRead(catalog, overdue[i], &book);
+        printf("%d. %s, %s, %d days overdue\n", book.index+1, book.title, book.name, current_date-book.date_due);       // Print information, including # days overdue
+    }
+    free(overdue);
+
+    printf("\n");
+
+    // Allow user to see books due soon, books one person has out, most borrowed books, or go back to main menu
+    printf("[n] Books due in the next N days\n[p] Books one person has out\n[t] Most borrowed books and authors\n[q] Go back\n");
+    char input;
+    do{
+        fflush(stdin);
+        input = getchar();
+    } while(input != 'n' && input != 'p' && input != 't' && input != 'q');
+
+    if(input == 't'){
+        // Print books and authors taken out most (from the loan counts, so no history is read)
+        start = nowSeconds();
+        int numBooks = 0, numAuthors = 0;
+        struct loan_count *books = loanStatsReady(catalog) ? loanTop(&catalog->loans.books, LOAN_TOP_DEFAULT, catalog, &numBooks) : NULL;
+        struct loan_count *authors = loanStatsReady(catalog) ? loanTop(&catalog->loans.authors, LOAN_TOP_DEFAULT, NULL, &numAuthors) : NULL;
+        metricsRecord(METRIC_REPORT, start, books != NULL && authors != NULL);
+        printf("\nMost borrowed books:\n");
+        for(int i=0; i<numBooks; i++){
+            struct book book;
+            catalogRead(catalog, catalogFind(catalog, books[i].key), &book);
+            printf("%d. %s, %s, %lld loans\n", book.index+1, book.title, book.author, books[i].loans);
+        }
+        printf("\nMost borrowed authors:\n");
+        for(int i=0; i<numAuthors; i++){
+            printf("%s, %lld loans\n", stringGet(catalog->strings, authors[i].key), authors[i].loans);
+        }
+        free(books);
+        free(authors);
+
+        printf("\n");
+        printf("[q] Go back\n");
+        do{
+            fflush(stdin);
+            input = getchar();
+        } while(input != 'q');
+    }
+
+    if(input == 'p'){
+        // Get person's name
+        char name[51];
+        printf("\nFull name: ");
+        fflush(stdin);
+        fgets(name,51,stdin);
+        name[strcspn(name, "\n")]='\0';     // Get rid of \n from end of string
+        printf("\n");
+
+        // Print their books, in index order, with the overdue ones marked
+        int numLoans;
+        start = nowSeconds();
+        int *loans = findPatronBooks(catalog, name, 0, &numLoans);
+        metricsRecord(METRIC_CHECK, start, loans != NULL);
+        printf("Books out to %s (%d of max %d):\n", name, numLoans, PATRON_MAX_LOANS);
+        for(int i=0; i<numLoans; i++){
+            struct book book;
+            catalogRead(catalog, loans[i], &book);
+            char date_due[DATE_LENGTH];
+            if(book.date_due < current_date){
+                printf("%d. %s, %d days overdue\n", book.index+1, book.title, current_date-book.date_due);
+            }
+            else{
+                printf("%d. %s, due %s\n", book.index+1, book.title, date_to_string(book.date_due, date_due));
+            }
+        }
+        free(loans);
+
+        printf("\n");
+        printf("[q] Go back\n");
+        do{
+            fflush(stdin);
+            input = getchar();
+        } while(input != 'q');
+    }
+
+    if(input == 'n'){
+        // Get number of days
+        int days;
+        do{
+            printf("\nNumber of days: ");
+            fflush(stdin);
+            scanf("%d", &days);
+        } while(days < 0);
+        printf("\n");
+
+        // Print books due between now and then, soonest first (findDueBooks also returns overdue books, which come first and are skipped)
+        int numDue;
+        start = nowSeconds();
+        int *due = findDueBooks(catalog, current_date + days, &numDue);
+        metricsRecord(METRIC_CHECK, start, due != NULL);
+        printf("Books due in the next %d days:\n", days);
+        for(int i=0; i<numDue; i++){
+            struct book book;
+            catalogRead(catalog, due[i], &book);
+            if(book.date_due >= current_date){
+                char date_due[DATE_LENGTH];
+                printf("%d. %s, %s, due %s\n", book.index+1, book.title, book.name, date_to_string(book.date_due, date_due));
+            }
+        }
+        free(due);
+
+        printf("\n");
+        printf("[q] Go back\n");
+        do{
+            fflush(stdin);
+            input = getchar();
+        } while(input != 'q');
+    }
+}
+
+// Split line into comma separated fields (the last field gets the rest of the line, commas and all), returning number of fields
+int splitFields(char *line, char **fields, int maxFields){
+    int numFields = 0;
+    fields[numFields++] = line;
+    while(numFields < maxFields){
+        char *comma = strchr(line, ',');
+        if(comma == NULL){
+            break;
+        }
+        *comma = '\0';
+        line = comma + 1;
+        fields[numFields++] = line;
+    }
+    return numFields;
+}
+
+// Read whole number from field, returning 0 if it is not one
+int parseField(char *field, int *value){
+    char *end;
+    long number = strtol(field, &end, 10);
+    if(end == field || *end != '\0' || number < INT_MIN || number > INT_MAX){
+        return 0;
+    }
+    *value = number;
+    return 1;
+}
+
+// Check text field fits in a book (max 50 chars, no ',' as database file is comma delimited)
+int textFieldValid(char *field){
+    return strlen(field) <= 50 && strchr(field, ',') == NULL;
+}
+
+// Find row of book from user-facing index in field (-1 if there is no such book)
+int batchFindBook(struct catalog *catalog, char *field){
+    int index;
+    if(!parseField(field, &index)){
+        return -1;
+    }
+    return catalogFind(catalog, index - 1);
+}
 
-        // Get user input for what to edit
-        char choice;
-        printf("What do you want to edit?\n");
-        printf("[t] Title\n[a] Author\n[p] Publication year\n[q] Stop editing\n");
-        do{
-            fflush(stdin);
-            scanf("%c", &choice);
-        } while(!(choice=='t' || choice=='a' || choice=='p' || choice=='q'));      // Ensure user picks one of the options
-        printf("\n");
+// Write "ok" result line, returning 1
+int batchOk(FILE *out){
+    fprintf(out, "ok\n");
+    return 1;
+}
 
-        int size;
-        switch(choice){
+// Write "error" result line with reason, returning 0
+int batchError(FILE *out, const char *message){
+    fprintf(out, "error,%s\n", message);
+    return 0;
+}
 
-            // Let user set title to new value
-            case 't': ;
-                char new_title[51];
-                printf("Title (max 50 chars, cannot include ','): ");
-                fflush(stdin);
-                fgets(new_title,51,stdin);
+// Write book in given row as a result line (used by search results)
+void batchWriteBook(FILE *out, struct catalog *catalog, int row){
+    struct catalog_chunk *chunk = catalogChunk(catalog, row);
+    int i = row % CATALOG_CHUNK_ROWS;
+    fprintf(out, "book,%d,%s,%s,%d,%s\n", chunk->index[i]+1, chunk->text[i].title, stringGet(catalog->strings, chunk->text[i].author), chunk->pub_year[i], chunk->date_out[i] != 0 ? "OUT" : "AVAILABLE");
+}
+
+// Write loan of book in given row as a result line (used by overdue/due checks)
+void batchWriteLoan(FILE *out, struct catalog *catalog, int row, int current_date){
+    struct catalog_chunk *chunk = catalogChunk(catalog, row);
+    int i = row % CATALOG_CHUNK_ROWS;
+    int date_due = chunk->date_due[i];
+    char due[DATE_LENGTH];
+    fprintf(out, "loan,%d,%s,%s,%s,%d\n", chunk->index[i]+1, chunk->text[i].title, stringGet(catalog->strings, chunk->text[i].name), date_to_string(date_due, due),
+        date_due < current_date ? current_date-date_due : 0);     // (last field is # days overdue)
+}
+
+// Check if batch command changes the catalog (add/edit/delete/borrow/return)
+int batchIsChange(char *command){
+    return strcmp(command, "add") == 0 || strcmp(command, "edit") == 0 || strcmp(command, "delete") == 0 || strcmp(command, "borrow") == 0 || strcmp(command, "return") == 0;
+}
+
+// Check if batch command reads the whole catalog (list/report), so the server runs it on a view of the catalog instead of holding up changes
+int batchIsReport(char *command){
+    return strcmp(command, "list") == 0 || strcmp(command, "report") == 0;
+}
+
+// Build change for a batch command that changes the catalog, checking it against the catalog as it is now, returning NULL if it is valid (or the reason it is not)
+const char* batchPrepare(struct catalog *catalog, char **fields, int numFields, int current_date, struct mutation *mutation){
+    char *command = fields[0];
+    memset(mutation, 0, sizeof(*mutation));
+    int row, value = 0;
+
+    // add,title,author,pub_year
+    if(strcmp(command, "add") == 0){
+        if(numFields != 4 || !textFieldValid(fields[1]) || !textFieldValid(fields[2]) || !parseField(fields[3], &mutation->book.pub_year)){
+            return "usage: add,title,author,pub_year";
+        }
+        mutation->op = OP_ADD;
+        mutation->id = catalogNewId(catalog);
+        if(mutation->id == -1){
+            return "out of memory";
+        }
+        mutation->book.index = mutation->id;
+        strcpy(mutation->book.title, fields[1]);
+        strcpy(mutation->book.author, fields[2]);
+        mutation->book.date_added = current_date;
+        strcpy(mutation->book.name, "0");
+        return NULL;
+    }
+
+    // edit,index,title,author,pub_year (empty fields are left as they are)
+    if(strcmp(command, "edit") == 0){
+        if(numFields != 5 || !textFieldValid(fields[2]) || !textFieldValid(fields[3]) || (fields[4][0] != '\0' && !parseField(fields[4], &value))){
+            return "usage: edit,index,title,author,pub_year";
+        }
+        if((row = batchFindBook(catalog, fields[1])) == -1){
+            return "no such book";
+        }
+        mutation->op = OP_EDIT;
+        catalogRead(catalog, row, &mutation->book);     // Start with current values
+        mutation->id = mutation->book.index;
+        if(fields[2][0] != '\0'){
+            strcpy(mutation->book.title, fields[2]);
+        }
+        if(fields[3][0] != '\0'){
+            strcpy(mutation->book.author, fields[3]);
+        }
+        if(fields[4][0] != '\0'){
+            mutation->book.pub_year = value;
+        }
+        return NULL;
+    }
+
+    // delete,index / borrow,index,name / return,index
+    int isBorrow = strcmp(command, "borrow") == 0;
+    if(numFields != (isBorrow ? 3 : 2) || (isBorrow && !textFieldValid(fields[2]))){
+        return isBorrow ? "usage: borrow,index,name" : command[0] == 'd' ? "usage: delete,index" : "usage: return,index";
+    }
+    if((row = batchFindBook(catalog, fields[1])) == -1){
+        return "no such book";
+    }
+    struct catalog_chunk *chunk = catalogChunk(catalog, row);
+    int date_out = chunk->date_out[row % CATALOG_CHUNK_ROWS];
+    mutation->id = chunk->index[row % CATALOG_CHUNK_ROWS];
+    if(command[0] == 'd'){
+        mutation->op = OP_DELETE;
+    }
+    else if(isBorrow){
+        if(date_out != 0){
+            return "book is already out";
+        }
+        if(patronLoanCount(catalog, fields[2]) >= PATRON_MAX_LOANS){
+            return "too many books out";
+        }
+        mutation->op = OP_BORROW;
+        strcpy(mutation->book.name, fields[2]);
+        mutation->book.date_out = current_date;
+        mutation->book.date_due = current_date + 7;      // Due in 7 days, as in borrowBook
+    }
+    else{
+        if(date_out == 0){
+            return "book is not out";
+        }
+        mutation->op = OP_RETURN;
+        mutation->date_returned = current_date;
+    }
+    return NULL;
+}
+
+// Write result of a batch change, returning 1 if it was made
+int batchChangeResult(FILE *out, struct mutation *mutation, int success){
+    if(!success){
+        return batchError(out, "change cannot be made");
+    }
+    if(mutation->op == OP_ADD){
+        fprintf(out, "ok,%d\n", mutation->id+1);        // Index of new book
+        return 1;
+    }
+    return batchOk(out);
+}
+
+// Run a batch command that does not change the catalog (search/fuzzy/query/explain/loans/overdue/due/list/report/page/popular/usage/history/saves/stats/count/date), writing its result to out, returning 1 if it worked
+int batchQuery(struct catalog *catalog, char **fields, int numFields, FILE *out, int *current_date){
+    char *command = fields[0];
+    int row;
+
+    // author,name (books by exactly that author)
+    if(strcmp(command, "author") == 0){
+        if(numFields != 2){
+            return batchError(out, "usage: author,name");
+        }
+        int numMatches;
+        int *matches = findBooksByAuthor(catalog, fields[1], &numMatches);
+        if(matches == NULL){
+            return batchError(out, "out of memory");
+        }
+        for(int i=0; i<numMatches; i++){
+            batchWriteBook(out, catalog, matches[i]);
+        }
+        free(matches);
+        fprintf(out, "ok,%d\n", numMatches);
+        return 1;
+    }
+
+    // search,t|a|p,term
+    if(strcmp(command, "search") == 0){
+        char *field = fields[1];
+        if(numFields != 3 || fields[2][0] == '\0' || strlen(fields[2]) > 50 || !(strcmp(field, "t") == 0 || strcmp(field, "a") == 0 || strcmp(field, "p") == 0)){
+            return batchError(out, "usage: search,t|a|p,term");
+        }
+        int numMatches = 0;
+        if(field[0] == 'p'){
+            int fromYear, toYear;
+            struct year_cursor cursor;
+            parseYearRange(fields[2], &fromYear, &toYear);
+            if(!yearCursorStart(catalog, &cursor, fromYear, toYear)){
+                return batchError(out, "out of memory");
+            }
+            while((row = yearCursorNext(catalog, &cursor)) != -1){
+                batchWriteBook(out, catalog, row);
+                numMatches++;
+            }
+        }
+        else{
+            for(char *pos = fields[2]; *pos != '\0'; pos++){       // Upper-case term, as in searchBooks
+                *pos = toupper((unsigned char)*pos);
+            }
+            int *matches = findBooks(catalog, field[0] == 't' ? FIELD_TITLE : FIELD_AUTHOR, fields[2], &numMatches);
+            if(matches == NULL){
+                return batchError(out, "out of memory");
+            }
+            for(int i=0; i<numMatches; i++){
+                batchWriteBook(out, catalog, matches[i]);
+            }
+            free(matches);
+        }
+        fprintf(out, "ok,%d\n", numMatches);
+        return 1;
+    }
+
+    // fuzzy,t|a,term[,k] (up to k books, 10 by default, whose title/author is closest to term, allowing a few typos, closest first)
+    if(strcmp(command, "fuzzy") == 0){
+        int k = FUZZY_DEFAULT_RESULTS;
+        if(numFields < 3 || numFields > 4 || strlen(fields[2]) > 50 || !(strcmp(fields[1], "t") == 0 || strcmp(fields[1], "a") == 0)
+           || (numFields == 4 && (!parseField(fields[3], &k) || k < 1 || k > FUZZY_MAX_RESULTS))){
+            return batchError(out, "usage: fuzzy,t|a,term[,k]");
+        }
+        for(char *pos = fields[2]; *pos != '\0'; pos++){       // Upper-case term, as in searchBooks
+            *pos = toupper((unsigned char)*pos);
+        }
+        int numMatches;
+        struct fuzzy_match *matches = fuzzyFindBooks(catalog, fields[1][0] == 't' ? FIELD_TITLE : FIELD_AUTHOR, fields[2], k, &numMatches);
+        if(matches == NULL){
+            return batchError(out, "out of memory");
+        }
+        for(int i=0; i<numMatches; i++){
+            batchWriteBook(out, catalog, matches[i].row);
+        }
+        free(matches);
+        fprintf(out, "ok,%d\n", numMatches);
+        return 1;
+    }
+
+    // query,expression (books matching every predicate of any alternative), or explain,expression (runs query and gives the plan of each alternative instead of the books)
+    if(strcmp(command, "query") == 0 || strcmp(command, "explain") == 0){
+        if(numFields != 2){
+            return batchError(out, "usage: query|explain,expression");
+        }
+        struct query query;
+        struct query_plan plans[QUERY_MAX_ALTERNATIVES];
+        const char *error = parseQuery(fields[1], *current_date, &query);
+        if(error != NULL){
+            return batchError(out, error);
+        }
+        int numMatches;
+        double start = nowSeconds();
+        int *matches = runQuery(catalog, &query, plans, &numMatches);
+        double seconds = nowSeconds() - start;
+        if(matches == NULL){
+            return batchError(out, "out of memory");
+        }
+        if(command[0] == 'q'){
+            for(int i=0; i<numMatches; i++){
+                batchWriteBook(out, catalog, matches[i]);
+            }
+            fprintf(out, "ok,%d\n", numMatches);
+        }
+        else{
+            explainQuery(out, &query, plans);
+            fprintf(out, "ok,%d,%.6f\n", numMatches, seconds);
+        }
+        free(matches);
+        return 1;
+    }
+
+    // loans,name (books a person has out), or overdue,name (books a person has out that are overdue)
+    if(strcmp(command, "loans") == 0 || (strcmp(command, "overdue") == 0 && numFields == 2)){
+        if(numFields != 2){
+            return batchError(out, "usage: loans,name");
+        }
+        int numLoans;
+        int *loans = findPatronBooks(catalog, fields[1], command[0] == 'o' ? *current_date : 0, &numLoans);
+        if(loans == NULL){
+            return batchError(out, "out of memory");
+        }
+        for(int i=0; i<numLoans; i++){
+            batchWriteLoan(out, catalog, loans[i], *current_date);
+        }
+        free(loans);
+        fprintf(out, "ok,%d\n", numLoans);
+        return 1;
+    }
+
+    // overdue (books due before current date), or due,days (books due before then, including overdue ones)
+    if(strcmp(command, "overdue") == 0 || strcmp(command, "due") == 0){
+        int days = 0;
+        if(command[0] == 'd' && (numFields != 2 || !parseField(fields[1], &days) || days < 0)){
+            return batchError(out, "usage: due,days");
+        }
+        if(command[0] == 'o' && numFields != 1){
+            return batchError(out, "usage: overdue[,name]");
+        }
+        int numDue;
+        int *due = findDueBooks(catalog, *current_date + days, &numDue);
+        if(due == NULL){
+            return batchError(out, "out of memory");
+        }
+        for(int i=0; i<numDue; i++){
+            batchWriteLoan(out, catalog, due[i], *current_date);
+        }
+        free(due);
+        fprintf(out, "ok,%d\n", numDue);
+        return 1;
+    }
+
+    // list (every book), or report (every book out, most overdue first)
+    if(strcmp(command, "list") == 0){
+        int numBooks = 0;
+        for(row=0; row<catalog->numRows; row++){
+            if(catalogId(catalog, row) != BOOK_DELETED){
+                batchWriteBook(out, catalog, row);
+                numBooks++;
+            }
+        }
+        fprintf(out, "ok,%d\n", numBooks);
+        return 1;
+    }
+    if(strcmp(command, "report") == 0){
+        int numLoans;
+        int *loans = scanLoans(catalog, &numLoans);
+        if(loans == NULL){
+            return batchError(out, "out of memory");
+        }
+        for(int i=0; i<numLoans; i++){
+            batchWriteLoan(out, catalog, loans[i], *current_date);
+        }
+        free(loans);
+        fprintf(out, "ok,%d\n", numLoans);
+        return 1;
+    }
+
+    // page,title|author|year|added[,size[,cursor]] (next page of books in that order, 20 by default, after the cursor given with the last page; ok line gives the cursor for the next one, if there are more books)
+    if(strcmp(command, "page") == 0){
+        int field = numFields >= 2 ? sortFieldFromName(fields[1]) : -1, size = PAGE_DEFAULT_BOOKS;
+        struct page_cursor cursor;
+        if(field == -1 || numFields > 4 || (numFields >= 3 && fields[2][0] != '\0' && (!parseField(fields[2], &size) || size < 1 || size > PAGE_MAX_BOOKS))){
+            return batchError(out, "usage: page,title|author|year|added[,size[,cursor]]");
+        }
+        pageCursorStart(&cursor, field);
+        if(numFields == 4 && (!pageCursorDecode(fields[3], &cursor) || cursor.field != field)){
+            return batchError(out, "not a cursor for that order");
+        }
+        int numRows, more;
+        int *rows = sortPage(catalog, &cursor, size, &numRows, &more);
+        if(rows == NULL){
+            return batchError(out, "out of memory");
+        }
+        for(int i=0; i<numRows; i++){
+            batchWriteBook(out, catalog, rows[i]);
+        }
+        free(rows);
+        char next[PAGE_CURSOR_LENGTH] = "";
+        if(more){
+            pageCursorEncode(&cursor, next);
+        }
+        fprintf(out, "ok,%d%s%s\n", numRows, more ? "," : "", next);
+        return 1;
+    }
+
+    // popular,books|authors[,n] (n books/authors taken out most, 10 by default, with times out, times returned and mean days out of those returned)
+    if(strcmp(command, "popular") == 0){
+        int n = LOAN_TOP_DEFAULT;
+        int byBook = numFields >= 2 && strcmp(fields[1], "books") == 0;
+        if(numFields < 2 || numFields > 3 || !(byBook || strcmp(fields[1], "authors") == 0)
+           || (numFields == 3 && (!parseField(fields[2], &n) || n < 1 || n > LOAN_TOP_MAX))){
+            return batchError(out, "usage: popular,books|authors[,n]");
+        }
+        int numTop;
+        struct loan_count *top = loanStatsReady(catalog) ? loanTop(byBook ? &catalog->loans.books : &catalog->loans.authors, n, byBook ? catalog : NULL, &numTop) : NULL;
+        if(top == NULL){
+            return batchError(out, "out of memory");
+        }
+        for(int i=0; i<numTop; i++){
+            double meanDays = top[i].returns > 0 ? (double)top[i].daysOut / top[i].returns : 0;
+            if(byBook){
+                row = catalogFind(catalog, top[i].key);
+                fprintf(out, "top,%d,%s,%s,%lld,%lld,%.1f\n", top[i].key+1, catalogText(catalog, row)->title, stringGet(catalog->strings, catalogText(catalog, row)->author), top[i].loans, top[i].returns, meanDays);
+            }
+            else{
+                fprintf(out, "top,%s,%lld,%lld,%.1f\n", stringGet(catalog->strings, top[i].key), top[i].loans, top[i].returns, meanDays);
+            }
+        }
+        free(top);
+        fprintf(out, "ok,%d\n", numTop);
+        return 1;
+    }
+
+    // usage,from,to (for each day from one date to another: books taken out, books returned, books out at end of day, and that as a percentage of the books in the catalog now)
+    if(strcmp(command, "usage") == 0){
+        int from, to;
+        if(numFields != 3 || !string_to_date(fields[1], &from) || !string_to_date(fields[2], &to) || to < from || to - from >= LOAN_USAGE_MAX_DAYS){
+            return batchError(out, "usage: usage,dd/mm/yyyy,dd/mm/yyyy");
+        }
+        if(!loanStatsReady(catalog)){
+            return batchError(out, "out of memory");
+        }
+        struct loan_counts *days = &catalog->loans.days;
+        long long booksOut = 0;     // (out at start of first day: taken out before it, less returned before it)
+        for(int i=0; i<days->tableSize; i++){
+            if(days->slots[i].used && (int)days->slots[i].key < from){
+                booksOut += days->slots[i].loans - days->slots[i].returns;
+            }
+        }
+        int numBooks = catalog->numRows - catalog->numFree;
+        char date[DATE_LENGTH];
+        for(int day=from; day<=to; day++){
+            struct loan_count *count = loanCountFind(days, day, 0);
+            long long loans = count != NULL ? count->loans : 0, returns = count != NULL ? count->returns : 0;
+            booksOut += loans - returns;
+            fprintf(out, "day,%s,%lld,%lld,%lld,%.1f\n", date_to_string(day, date), loans, returns, booksOut, numBooks > 0 ? booksOut * 100.0 / numBooks : 0);
+        }
+        fprintf(out, "ok,%d\n", to - from + 1);
+        return 1;
+    }
+
+    // history,index[,from,to] (past loans of a book, optionally only those returned between two dates, which reads only the history files for those months)
+    if(strcmp(command, "history") == 0){
+        int from = INT_MIN, to = INT_MAX;
+        if(!(numFields == 2 || (numFields == 4 && string_to_date(fields[2], &from) && string_to_date(fields[3], &to)))){
+            return batchError(out, "usage: history,index[,dd/mm/yyyy,dd/mm/yyyy]");
+        }
+        if((row = batchFindBook(catalog, fields[1])) == -1){
+            return batchError(out, "no such book");
+        }
+        int id = catalogId(catalog, row), numLoans = 0;
+        struct loan_history *history = catalog->history;
+        for(int i=0; history != NULL && i<history->numMonths; i++){
+            int month = history->months[i];
+            if((from != INT_MIN && month < historyMonth(from)) || (to != INT_MAX && month > historyMonth(to))){
+                continue;
+            }
+            int numRecords;
+            struct loan_record *records = historyLoad(history, month, &numRecords);
+            for(int j=0; j<numRecords; j++){
+                struct loan_record *record = &records[j];
+                if(record->id == id && record->date_returned >= from && record->date_returned <= to){
+                    char date_out[DATE_LENGTH], date_due[DATE_LENGTH], date_returned[DATE_LENGTH];
+                    fprintf(out, "past,%d,%s,%s,%s,%d\n", id+1, date_to_string(record->date_out, date_out), date_to_string(record->date_due, date_due), date_to_string(record->date_returned, date_returned),
+                        record->date_returned > record->date_due ? record->date_returned - record->date_due : 0);       // (last field is # days late)
+                    numLoans++;
+                }
+            }
+            free(records);
+        }
+        fprintf(out, "ok,%d\n", numLoans);
+        return 1;
+    }
+
+    // saves (checkpoints done since start: number saved, number failed, time and bytes of last one, total bytes, and how long changes were held up to start last one)
+    if(strcmp(command, "saves") == 0){
+        struct save_stats stats = {0};
+        if(catalog->journal != NULL){
+            pthread_mutex_lock(&catalog->journal->lock);
+            stats = catalog->journal->stats;
+            pthread_mutex_unlock(&catalog->journal->lock);
+        }
+        fprintf(out, "ok,%lld,%lld,%.6f,%lld,%lld,%.6f\n", stats.saves, stats.failures, stats.lastSeconds, stats.lastBytes, stats.totalBytes, stats.lastPauseSeconds);
+        return 1;
+    }
+
+    // stats (a stat line for each kind of operation since start: name, count, number failed, then mean, p50, p90, p99, p99.9 and max latency in microseconds)
+    if(strcmp(command, "stats") == 0){
+        if(!metricsWrite(out)){
+            return batchError(out, "out of memory");
+        }
+        fprintf(out, "ok,%d\n", METRIC_OPS);
+        return 1;
+    }
+
+    // count (number of books, and index the next book added will get)
+    if(strcmp(command, "count") == 0){
+        fprintf(out, "ok,%d,%d\n", catalog->numRows - catalog->numFree, catalogNewId(catalog)+1);
+        return 1;
+    }
+
+    // date,dd/mm/yyyy (sets date used for adds/loans/checks, which is today by default)
+    if(strcmp(command, "date") == 0){
+        if(numFields != 2 || !string_to_date(fields[1], current_date)){
+            return batchError(out, "usage: date,dd/mm/yyyy");
+        }
+        return batchOk(out);
+    }
+
+    return batchError(out, "unknown command");
+}
+
+// Get kind of operation a search/check command is counted as in the metrics (-1 if it is not counted)
+int batchMetric(char *command){
+    if(strcmp(command, "search") == 0 || strcmp(command, "author") == 0){
+        return METRIC_SEARCH;
+    }
+    if(strcmp(command, "fuzzy") == 0){
+        return METRIC_FUZZY;
+    }
+    if(strcmp(command, "query") == 0 || strcmp(command, "explain") == 0){
+        return METRIC_QUERY;
+    }
+    if(strcmp(command, "overdue") == 0 || strcmp(command, "due") == 0 || strcmp(command, "loans") == 0){
+        return METRIC_CHECK;
+    }
+    if(batchIsReport(command) || strcmp(command, "page") == 0 || strcmp(command, "popular") == 0 || strcmp(command, "usage") == 0 || strcmp(command, "history") == 0){
+        return METRIC_REPORT;
+    }
+    return -1;
+}
+
+// Run a search/check command, counting it (and how long it took) in the metrics
+int batchTimedQuery(struct catalog *catalog, char **fields, int numFields, FILE *out, int *current_date){
+    int metric = batchMetric(fields[0]);
+    double start = nowSeconds();
+    int success = batchQuery(catalog, fields, numFields, out, current_date);
+    if(metric != -1){
+        metricsRecord(metric, start, success);
+    }
+    return success;
+}
+
+// Run one batch command, writing its result to out
+// Every command ends with an "ok" line (with the number of result lines for searches/checks, or the index of an added book) or an "error" line, returning 1 if it worked
+int batchCommand(struct catalog *catalog, char *line, FILE *out, int *current_date){
+    char *fields[6];
+    int numFields = splitFields(line, fields, 6);
+    if(!batchIsChange(fields[0])){
+        return batchTimedQuery(catalog, fields, numFields, out, current_date);
+    }
+    struct mutation mutation;
+    const char *error = batchPrepare(catalog, fields, numFields, *current_date, &mutation);
+    if(error != NULL){
+        return batchError(out, error);
+    }
+    return batchChangeResult(out, &mutation, commitMutation(catalog, &mutation));
+}
+
+// Run batch of commands (one per line) from file (stdin if NULL), writing results to file (stdout if NULL), with one save at the end
+// Returns 1 if every command worked and the database file was saved
+int runBatch(char *fileName, char *inName, char *outName){
+    FILE *in = inName != NULL ? fopen(inName, "r") : stdin;
+    FILE *out = outName != NULL ? fopen(outName, "w") : stdout;
+    if(in == NULL || out == NULL){
+        fprintf(stderr, "Batch file cannot be opened.\n");
+        return 0;
+    }
+    static char outBuffer[1 << 16];
+    setvbuf(out, outBuffer, _IOFBF, sizeof(outBuffer));     // Results are written in large blocks, not line by line
+
+    // Read catalog, and replay journal (changes are still journaled, so a crash part way through loses nothing)
+    struct catalog catalog;
+    struct load_stats load_stats;
+    catalogInit(&catalog);
+    if(!loadCatalog(fileName, &catalog, &load_stats)){
+        fprintf(stderr, "Database file, \"%s\", cannot be found.\n", fileName);
+        return 0;
+    }
+    catalog.journal = journalOpen(fileName, &catalog);
+
+    int current_date = dateToday();
+    char line[256];
+    int numErrors = 0;
+    while(fgets(line, sizeof(line), in) != NULL){
+        size_t length = strlen(line);
+        if(length == sizeof(line) - 1 && line[length-1] != '\n'){       // Line too long, so skip rest of it
+            int c;
+            while((c = fgetc(in)) != EOF && c != '\n');
+            batchError(out, "line too long");
+            numErrors++;
+            continue;
+        }
+        while(length > 0 && (line[length-1] == '\n' || line[length-1] == '\r')){
+            line[--length] = '\0';
+        }
+        if(length == 0 || line[0] == '#'){      // Skip blank lines and comments
+            continue;
+        }
+        if(!batchCommand(&catalog, line, out, &current_date)){
+            numErrors++;
+        }
+    }
+
+    // Save once at end of batch
+    int saved = writeDatabase(fileName, &catalog);
+    fprintf(out, saved ? "saved\n" : "error,database file cannot be saved\n");
+    if(catalog.journal != NULL){
+        journalClose(catalog.journal);
+    }
+    catalogFree(&catalog);
+    if(in != stdin){
+        fclose(in);
+    }
+    if(out != stdout){
+        fclose(out);
+    }
+    else{
+        fflush(out);
+    }
+    return saved && numErrors == 0;
+}
+
+// Hash book's title, author and year, ignoring case (FNV-1a, 64 bit)
+uint64_t importHash(const char *title, const char *author, int pub_year){
+    uint64_t hash = 14695981039346656037ULL;
+    const char *texts[2] = {title, author};
+    for(int i=0; i<2; i++){
+        for(const char *text = texts[i]; *text != '\0'; text++){
+            hash = (hash ^ (unsigned char)toupper((unsigned char)*text)) * 1099511628211ULL;
+        }
+        hash = (hash ^ 0xff) * 1099511628211ULL;     // (so "ab","c" and "a","bc" differ)
+    }
+    return (hash ^ (uint32_t)pub_year) * 1099511628211ULL;
+}
+
+// Check if two texts are the same, ignoring case
+int importSameText(const char *a, const char *b){
+    for(; *a != '\0' && toupper((unsigned char)*a) == toupper((unsigned char)*b); a++, b++);
+    return *a == '\0' && *b == '\0';
+}
+
+// Add book's hash and ID to set (growing it once half full), returning 0 if out of memory
+int importSetAdd(struct import_set *set, uint64_t hash, int id){
+    if((set->count + 1) * 2 > set->numSlots){
+        int numSlots = set->numSlots > 0 ? set->numSlots * 2 : 1024;
+        struct import_entry *entries = malloc(numSlots * sizeof(struct import_entry));
+        if(entries == NULL){
+            return 0;
+        }
+        for(int i=0; i<numSlots; i++){
+            entries[i].id = -1;
+        }
+        for(int i=0; i<set->numSlots; i++){     // Move every book to its slot in the bigger table
+            if(set->entries[i].id != -1){
+                int slot = set->entries[i].hash & (numSlots - 1);
+                while(entries[slot].id != -1){
+                    slot = (slot + 1) & (numSlots - 1);
+                }
+                entries[slot] = set->entries[i];
+            }
+        }
+        free(set->entries);
+        set->entries = entries;
+        set->numSlots = numSlots;
+    }
+    int slot = hash & (set->numSlots - 1);
+    while(set->entries[slot].id != -1){
+        slot = (slot + 1) & (set->numSlots - 1);        // Linear probing
+    }
+    set->entries[slot].hash = hash;
+    set->entries[slot].id = id;
+    set->count++;
+    return 1;
+}
+
+// Put every book in catalog in (empty) set, returning 0 if out of memory
+int importSetReady(struct import_set *set, struct catalog *catalog){
+    for(int row=0; row<catalog->numRows; row++){
+        if(catalogId(catalog, row) == BOOK_DELETED){
+            continue;
+        }
+        struct book book;
+        catalogRead(catalog, row, &book);
+        if(!importSetAdd(set, importHash(book.title, book.author, book.pub_year), book.index)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Check if book is already in catalog, or in batch being built (books with IDs from firstBatchId on), comparing the books themselves wherever the hash matches
+int importSetFind(struct import_set *set, struct catalog *catalog, struct mutation *batch, int firstBatchId, struct book *book, uint64_t hash){
+    if(set->numSlots == 0){
+        return 0;
+    }
+    for(int slot = hash & (set->numSlots - 1); set->entries[slot].id != -1; slot = (slot + 1) & (set->numSlots - 1)){
+        if(set->entries[slot].hash != hash){
+            continue;
+        }
+        int id = set->entries[slot].id;
+        struct book other;
+        if(id >= firstBatchId){
+            other = batch[id - firstBatchId].book;
+        }
+        else{
+            catalogRead(catalog, catalogFind(catalog, id), &other);
+        }
+        if(other.pub_year == book->pub_year && importSameText(other.title, book->title) && importSameText(other.author, book->author)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Add batch of books to catalog, with one journal write and sync for all of them, returning 1 if successful
+int importCommit(struct catalog *catalog, struct mutation *batch, int numBatch){
+    double start = nowSeconds();
+    int success = catalog->journal == NULL || journalAppendBatch(catalog->journal, batch, numBatch);
+    for(int i=0; i<numBatch && success; i++){
+        success = applyMutation(catalog, &batch[i]);
+    }
+
+    // Fold journal back into database file once it gets long, as commitMutation does
+    struct journal *journal = catalog->journal;
+    if(success && journal != NULL && journal->records >= JOURNAL_COMPACT_RECORDS && !journalCompacting(journal)){
+        compactJournal(catalog, 1);
+    }
+    metricsRecord(METRIC_IMPORT, start, success);
+    return success;
+}
+
+// Add every book in an external CSV file (title,author,pub_year lines, with an optional header line) that is not already in the catalog, batchBooks at a time
+// Invalid lines are skipped (the first few are reported). Returns 0 if the file cannot be read, or a batch cannot be added (earlier batches are kept)
+int importBooks(struct catalog *catalog, char *importName, int batchBooks, int current_date, struct import_stats *stats){
+    double start_time = nowSeconds();
+    memset(stats, 0, sizeof(*stats));
+    FILE *file = fopen(importName, "rb");
+    char *buffer = malloc(IMPORT_BUFFER_SIZE + 1);
+    struct mutation *batch = malloc(batchBooks * sizeof(struct mutation));
+    struct import_set set = {0};
+    int success = file != NULL && buffer != NULL && batch != NULL && idMapReady(catalog) && importSetReady(&set, catalog);
+    if(file == NULL){
+        fprintf(stderr, "Import file, \"%s\", cannot be opened.\n", importName);
+    }
+    else if(!success){
+        fprintf(stderr, "Out of memory.\n");
+    }
+
+    // Read file a buffer at a time, keeping any line cut off at the end of the buffer for the next read
+    size_t kept = 0;
+    int skipping = 0;       // Set to 1 while skipping rest of a line too long for buffer
+    int numBatch = 0, firstBatchId = catalog->nextId;
+    while(success){
+        size_t numRead = fread(buffer + kept, 1, IMPORT_BUFFER_SIZE - kept, file);
+        size_t size = kept + numRead;
+        int atEnd = numRead == 0;
+        char *line = buffer, *end = buffer + size;
+        kept = 0;
+        while(line < end && success){
+            char *newline = memchr(line, '\n', end - line);
+            if(newline == NULL && !atEnd){
+                if(line == buffer && size == IMPORT_BUFFER_SIZE){      // Whole buffer is one line
+                    skipping = 1;
+                    break;
+                }
+                kept = end - line;      // Rest of line is in next read
+                memmove(buffer, line, kept);
+                break;
+            }
+            char *lineEnd = newline != NULL ? newline : end;
+            *lineEnd = '\0';
+            char *next = lineEnd + 1;
+            if(skipping){       // (end of a line too long for buffer)
+                skipping = 0;
+                line = next;
+                stats->lines++;
+                stats->invalid++;
+                if(stats->invalid <= IMPORT_MAX_REPORTED_ERRORS){
+                    fprintf(stderr, "Skipped line %lld of \"%s\": too long\n", stats->lines, importName);
+                }
+                continue;
+            }
+            stats->lines++;
+            size_t length = lineEnd - line;
+            while(length > 0 && line[length-1] == '\r'){
+                line[--length] = '\0';
+            }
+
+            // Check line is a valid book (same rules as add), skipping blank lines, comments and a header line
+            char *fields[4];
+            struct mutation *mutation = &batch[numBatch];
+            const char *error = NULL;
+            if(length == 0 || line[0] == '#' || (stats->lines == 1 && importSameText(line, "title,author,pub_year"))){
+                line = next;
+                continue;
+            }
+            if(splitFields(line, fields, 4) != 3){
+                error = "not title,author,pub_year";
+            }
+            else if(!textFieldValid(fields[0]) || !textFieldValid(fields[1])){
+                error = "title/author longer than 50 chars";
+            }
+            else if(!parseField(fields[2], &mutation->book.pub_year)){
+                error = "pub_year is not a number";
+            }
+            line = next;
+            if(error != NULL){
+                stats->invalid++;
+                if(stats->invalid <= IMPORT_MAX_REPORTED_ERRORS){
+                    fprintf(stderr, "Skipped line %lld of \"%s\": %s\n", stats->lines, importName, error);
+                }
+                continue;
+            }
+            strcpy(mutation->book.title, fields[0]);
+            strcpy(mutation->book.author, fields[1]);
+
+            // Skip book if it is already in catalog (or earlier in file), otherwise give it the next ID and add it to batch
+            uint64_t hash = importHash(mutation->book.title, mutation->book.author, mutation->book.pub_year);
+            if(importSetFind(&set, catalog, batch, firstBatchId, &mutation->book, hash)){
+                stats->duplicates++;
+                continue;
+            }
+            mutation->op = OP_ADD;
+            mutation->id = firstBatchId + numBatch;
+            mutation->book.index = mutation->id;
+            mutation->book.date_added = current_date;
+            mutation->book.date_out = 0;
+            mutation->book.date_due = 0;
+            strcpy(mutation->book.name, "0");
+            if(!importSetAdd(&set, hash, mutation->id)){
+                fprintf(stderr, "Out of memory.\n");
+                success = 0;
+                break;
+            }
+            numBatch++;
+
+            // Add batch once it is full
+            if(numBatch == batchBooks){
+                if(!(success = importCommit(catalog, batch, numBatch))){
+                    break;
+                }
+                stats->added += numBatch;
+                stats->batches++;
+                numBatch = 0;
+                firstBatchId = catalog->nextId;
+            }
+        }
+        if(atEnd){
+            break;
+        }
+    }
+    if(skipping){       // (file ends part way through a line too long for buffer)
+        stats->lines++;
+        stats->invalid++;
+    }
+
+    // Add last (part) batch
+    if(success && numBatch > 0){
+        success = importCommit(catalog, batch, numBatch);
+        if(success){
+            stats->added += numBatch;
+            stats->batches++;
+        }
+    }
+    if(file != NULL && ferror(file)){
+        fprintf(stderr, "Import file, \"%s\", cannot be read.\n", importName);
+        success = 0;
+    }
+    if(!success && stats->added > 0){
+        fprintf(stderr, "Import stopped after %lld books were added.\n", stats->added);
+    }
+    if(file != NULL){
+        fclose(file);
+    }
+    free(set.entries);
+    free(buffer);
+    free(batch);
+    stats->seconds = nowSeconds() - start_time;
+    return success;
+}
+
+// Import books from an external CSV file into database file (batchBooks per journal sync), then save, returning 1 if successful
+int runImport(char *fileName, char *importName, int batchBooks){
+    struct catalog catalog;
+    struct load_stats load_stats;
+    catalogInit(&catalog);
+    if(!loadCatalog(fileName, &catalog, &load_stats)){
+        fprintf(stderr, "Database file, \"%s\", cannot be found.\n", fileName);
+        return 0;
+    }
+    catalog.journal = journalOpen(fileName, &catalog);
+    if(catalog.journal == NULL){
+        fprintf(stderr, "Journal file cannot be opened. Books will only be saved at the end.\n");
+    }
 
-                size = strlen(new_title);
-                new_title[size-1]='\0';     // remove '\n' from end of string
+    struct import_stats stats;
+    int imported = importBooks(&catalog, importName, batchBooks > 0 ? batchBooks : IMPORT_BATCH_BOOKS, dateToday(), &stats);
+    printf("%lld lines read: %lld books added, %lld already in catalog, %lld invalid (%d batches, %.3f s, %.0f books/s).\n", stats.lines, stats.added, stats.duplicates,
+        stats.invalid, stats.batches, stats.seconds, stats.added / (stats.seconds > 0 ? stats.seconds : 1e-9));
 
-                strcpy(books[index_to_edit].title, new_title);      // Set value in list of structs
-                break;
+    int saved = writeDatabase(fileName, &catalog);
+    if(!saved){
+        fprintf(stderr, "Database file, \"%s\", cannot be saved.\n", fileName);
+    }
+    if(catalog.journal != NULL){
+        journalClose(catalog.journal);
+    }
+    catalogFree(&catalog);
+    return imported && saved;
+}
 
-            // Let user set author to new value
-            case 'a': ;
-                char new_author[51];
-                printf("Author (max 50 chars, cannot include ','): ");
-                fflush(stdin);
-                fgets(new_author,51,stdin);
+// Get next number from benchmark random number generator (xorshift64*, so catalogs are the same on every machine)
+uint64_t benchRandom(uint64_t *state){
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
 
-                size = strlen(new_author);
-                new_author[size-1]='\0';     // remove '\n' from end of string
+// Pick a number from 0 to n-1, with low numbers much more likely (roughly Zipf), as a few authors/words/borrowers are far more common than the rest
+int benchSkewed(uint64_t *state, int n){
+    double uniform = (benchRandom(state) >> 11) * (1.0 / 9007199254740992.0);     // 0 to 1
+    int pick = (int)exp(uniform * log(n + 1.0)) - 1;
+    return pick < n ? pick : n - 1;
+}
 
-                strcpy(books[index_to_edit].author, new_author);      // Set value in list of structs
+// Write synthetic catalog of numRows books to database file (the same for the same number of rows), returning 1 if successful
+int benchGenerate(char *fileName, int numRows){
+    static const char *words[] = {"The", "Night", "Garden", "Of", "Shadow", "River", "Silent", "House", "Last", "Winter", "Secret", "City", "Stone",
+        "Light", "Dark", "Lost", "Queen", "War", "Fire", "Summer", "Journey", "Home", "Blood", "Sea", "Moon", "Golden", "Empire", "Forest", "Glass", "Dream"};
+    static const char *firstNames[] = {"James", "Mary", "John", "Anna", "Peter", "Helen", "David", "Sarah", "Robert", "Emily",
+        "Michael", "Laura", "Thomas", "Grace", "Daniel", "Alice", "George", "Clara", "Henry", "Ruth"};
+    static const char *surnames[] = {"Anderson", "Bell", "Rowling", "Lee", "Carter", "Harding", "Dickens", "Wilson", "Manning", "Foster",
+        "Austen", "Hughes", "Morrison", "Tolkien", "Shelley", "Bronte", "Orwell", "Woolf", "Hardy", "Eliot",
+        "Christie", "Murdoch", "Atwood", "Ishiguro", "Mantel", "Pratchett", "Gaiman", "Banks", "Lessing", "Smith",
+        "Forster", "Greene", "Waugh", "Amis", "Barnes", "McEwan", "Rushdie", "Zadie", "Byatt", "Carey"};
+    int numWords = sizeof(words) / sizeof(words[0]);
+    int numAuthors = 20 * 26 * 40;      // First name, initial, surname
+    int numBorrowers = numRows / 50 > 100 ? numRows / 50 : 100;
 
-                break;
+    FILE *fout = fopen(fileName, "wb");
+    if(fout == NULL){
+        return 0;
+    }
+    static char buffer[1 << 20];
+    setvbuf(fout, buffer, _IOFBF, sizeof(buffer));
+    int success = fprintf(fout, "index,title,author,pub_year,date_added,date_out,date_due,name\n") > 0;
 
-            // Let user set publication year to new value
-            case 'p': ;
-                time_t seconds=time(NULL);
-                struct tm* current_time=localtime(&seconds);
-                int maxYear = current_time->tm_year + 1900;
-                int new_pub_year;
-                do{
-                    printf("Publication year (minimum 0AD): ");
-                    fflush(stdin); scanf("%d", &new_pub_year);        // Read max of 50 chars
-                } while(!(new_pub_year > 0 && new_pub_year < maxYear));     // Check value in range (0-current year)
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for(int i=0; i<numRows && success; i++){
+        // Title of 2-4 words (common words much more likely)
+        char title[51] = "";
+        int numTitleWords = 2 + benchRandom(&state) % 3;
+        for(int j=0; j<numTitleWords; j++){
+            size_t length = strlen(title);
+            snprintf(title + length, sizeof(title) - length, "%s%s", j ? " " : "", words[benchSkewed(&state, numWords)]);
+        }
 
-                books[index_to_edit].pub_year = new_pub_year;      // Set value in list of structs
-                break;
+        // Author (a few authors have written most of the books)
+        int author = benchSkewed(&state, numAuthors);
+        char authorName[51];
+        snprintf(authorName, sizeof(authorName), "%s %c. %s", firstNames[author % 20], 'A' + (author / 20) % 26, surnames[author / 520]);
 
-            // Let user stop editing
-            case 'q': ;
-                editing = 0;
-                break;
+        // Publication year (recent years much more likely), date added, and loan (8% out, most of them overdue)
+        int pub_year = 2024 - benchSkewed(&state, 400);
+        long long date_added = BENCH_NOW - (long long)(benchRandom(&state) % (3 * 365)) * 86400;
+        long long date_out = 0, date_due = 0;
+        char name[51] = "0";
+        if(benchRandom(&state) % 100 < 8){
+            date_out = BENCH_NOW - (long long)(benchRandom(&state) % 30) * 86400;
+            date_due = date_out + 7 * 86400;
+            snprintf(name, sizeof(name), "Borrower %d", benchSkewed(&state, numBorrowers));
         }
-        printf("\n");
+        success = fprintf(fout, "%d,%s,%s,%d,%lld,%lld,%lld,%s\n", i, title, authorName, pub_year, date_added, date_out, date_due, name) > 0;
     }
+    return (fclose(fout) == 0) && success;
 }
 
-void saveFile(char* fileName, struct book *books, int numRows){
-    system("cls");      // Clear screen
-    printf("Saving file, do not close...\n");       // Tell user not to close program
+// Add a benchmark result
+void benchRecord(struct bench_result *results, int *numResults, const char *name, int rows, int ops, double seconds){
+    if(*numResults < BENCH_MAX_RESULTS){
+        struct bench_result *result = &results[(*numResults)++];
+        snprintf(result->name, sizeof(result->name), "%s", name);
+        result->rows = rows;
+        result->ops = ops;
+        result->seconds = seconds;
+    }
+}
 
-    FILE* fin;      // Make pointer
-    if(!(fin = fopen(fileName, "r"))){      // Check if file can be opened
-        printf("Data file cannot be found. New file will be created.\n");      // Tell user file cannot be found
+// Run every benchmark on a synthetic catalog of numRows books, adding results
+int benchScale(int numRows, struct bench_result *results, int *numResults){
+    char fileName[MAX_PATH_LENGTH];
+    snprintf(fileName, sizeof(fileName), "bench-%d.txt", numRows);
+    fprintf(stderr, "Benchmarking %d books...\n", numRows);
+
+    // Generate catalog
+    double start = nowSeconds();
+    if(!benchGenerate(fileName, numRows)){
+        fprintf(stderr, "Benchmark file \"%s\" cannot be written.\n", fileName);
+        return 0;
     }
-    fin = fopen(fileName, "w+");        // Open/make new file
+    benchRecord(results, numResults, "generate", numRows, numRows, nowSeconds() - start);
 
-    fprintf(fin, "index,title,author,pub_year,date_added,date_out,date_due,name\n");        // Add column titles
+    // Load (csvToStructs)
+    struct catalog catalog;
+    struct load_stats stats;
+    catalogInit(&catalog);
+    start = nowSeconds();
+    int success = csvToStructs(fileName, &catalog, &stats);
+    benchRecord(results, numResults, "load", numRows, numRows, nowSeconds() - start);
 
-    // Write rows to txt file in CSV format
-    for(int i=0; i<numRows; i++){
+    // Save (saveFile without a journal: whole catalog to temp file, swapped in)
+    start = nowSeconds();
+    success = success && writeDatabase(fileName, &catalog);
+    benchRecord(results, numResults, "save", numRows, numRows, nowSeconds() - start);
 
-        // Replace any ',' with '.' as CSV is comma delimited in title/author/name
-        int pos = 0;        // Start at first char
-        while(books[i].title[pos] != '\0'){     // Read until end of string
-            if(books[i].title[pos] == ','){     // If char is ','
-                books[i].title[pos] = '.';      // Replace with '.'
-            }
-            pos += 1;       // Go to next char
+    // Save split into shard files (every shard, then only one changed shard, as a fold with few changes does), then load them back in parallel
+    unsigned char dirty[BENCH_SHARDS] = {1};
+    for(int all=1; all>=0 && success; all--){
+        start = nowSeconds();
+        success = writeShards(fileName, &catalog, BENCH_SHARDS, all ? NULL : dirty, NULL);
+        benchRecord(results, numResults, all ? "save_sharded" : "save_one_shard", numRows, numRows, nowSeconds() - start);
+    }
+    if(success){
+        char paths[BENCH_SHARDS][SHARD_PATH_LENGTH];
+        char *fileNames[BENCH_SHARDS];
+        for(int i=0; i<BENCH_SHARDS; i++){
+            shardPath(fileName, i, BENCH_SHARDS, paths[i]);
+            fileNames[i] = paths[i];
         }
-        pos = 0;        // Start at first char
-        while(books[i].author[pos] != '\0'){     // Read until end of string
-            if(books[i].author[pos] == ','){     // If char is ','
-                books[i].author[pos] = '.';      // Replace with '.'
-            }
-            pos += 1;       // Go to next char
+        struct catalog sharded;
+        catalogInit(&sharded);
+        start = nowSeconds();
+        success = csvFilesToStructs(fileNames, BENCH_SHARDS, &sharded, &stats) && sharded.numRows == catalog.numRows;
+        benchRecord(results, numResults, "load_sharded", numRows, numRows, nowSeconds() - start);
+        catalogFree(&sharded);
+        for(int i=0; i<BENCH_SHARDS; i++){
+            remove(paths[i]);
         }
-        pos = 0;        // Start at first char
-        while(books[i].name[pos] != '\0'){     // Read until end of string
-            if(books[i].name[pos] == ','){     // If char is ','
-                books[i].name[pos] = '.';      // Replace with '.'
-            }
-            pos += 1;       // Go to next char
+    }
+
+    // Copy taken when a save starts (while changes wait): sharing chunks, then copying every book as saves used to
+    struct catalog copy;
+    for(int shared=1; shared>=0 && success; shared--){
+        start = nowSeconds();
+        for(int i=0; i<BENCH_SCANS && success; i++){
+            success = shared ? catalogShare(&catalog, &copy) : catalogCopy(&catalog, &copy);
+            catalogFree(&copy);
         }
+        benchRecord(results, numResults, shared ? "save_pause_shared" : "save_pause_copied", numRows, BENCH_SCANS, nowSeconds() - start);
+    }
 
-        // Write row to file
-        fprintf(fin,"%d,%s,%s,%d,%d,%d,%d,%s\n",books[i].index,books[i].title,books[i].author,books[i].pub_year,books[i].date_added,books[i].date_out,books[i].date_due,books[i].name);
+    // Build every index (done once, the first time each is used)
+    start = nowSeconds();
+    success = success && catalogIndexesReady(&catalog);
+    benchRecord(results, numResults, "index_build", numRows, numRows, nowSeconds() - start);
+    if(!success){
+        fprintf(stderr, "Benchmark catalog cannot be loaded/saved (out of memory?).\n");
+        catalogFree(&catalog);
+        remove(fileName);
+        return 0;
     }
 
-    fclose(fin);        // Close file
-    printf("File saved. You can now close the program.\n");       // Tell user they can exit
-}
+    // Title/author/year searches (searchBooks), with terms chosen the same way as the catalog
+    static const char *titleTerms[] = {"NIGHT", "GARDEN", "SILENT RIVER", "WINTER", "GLASS", "EMPIRE", "DREAM", "GOLDEN MOON"};
+    static const char *authorTerms[] = {"ROWLING", "AUSTEN", "JAMES A.", "ORWELL", "CAREY", "HELEN", "BRONTE", "SMITH"};
+    int numMatches, numSearches = BENCH_SEARCHES;
+    long long found = 0;
+    for(int field=0; field<2; field++){
+        start = nowSeconds();
+        for(int i=0; i<numSearches; i++){
+            char term[51];
+            snprintf(term, sizeof(term), "%s", field == 0 ? titleTerms[i % 8] : authorTerms[i % 8]);
+            int *matches = findBooks(&catalog, field == 0 ? FIELD_TITLE : FIELD_AUTHOR, term, &numMatches);
+            found += numMatches;
+            free(matches);
+        }
+        benchRecord(results, numResults, field == 0 ? "search_title" : "search_author", numRows, numSearches, nowSeconds() - start);
+    }
+    start = nowSeconds();
+    for(int i=0; i<numSearches; i++){
+        struct year_cursor cursor;
+        int fromYear = 1900 + (i * 37) % 120;
+        yearCursorStart(&catalog, &cursor, fromYear, i % 2 ? fromYear : fromYear + 10);     // Single years and decades
+        while(yearCursorNext(&catalog, &cursor) != -1){
+            found++;
+        }
+    }
+    benchRecord(results, numResults, "search_year", numRows, numSearches, nowSeconds() - start);
 
-void borrowBook(struct book *books, int *numRows, time_t current_date){
-    // Get index for book to be borrowed
-    int index_to_borrow;
-    do{
-        printf("Index to borrow: ");        // Ask user for input
-        fflush(stdin);      // // Clear stdin
-        scanf("%d", &index_to_borrow);       // Get value
-        index_to_borrow -= 1;       // Subtract 1 to get index in list
-    } while(!(index_to_borrow>=0 && index_to_borrow<*numRows));     // Ensure in range
-    printf("\n");
+    // Typo-tolerant searches (fuzzy,t|a,term), top 10 of each, with misspelt terms
+    static const char *fuzzyTerms[] = {"SILNET RIVER", "ROWLNIG", "GARDNE", "AUSTIN", "WINTRE NIGHT", "ORWEL", "GOLDNE MOON", "BRONTY"};
+    start = nowSeconds();
+    for(int i=0; i<numSearches; i++){
+        char term[51];
+        snprintf(term, sizeof(term), "%s", fuzzyTerms[i % 8]);
+        struct fuzzy_match *closest = fuzzyFindBooks(&catalog, i % 2 ? FIELD_AUTHOR : FIELD_TITLE, term, FUZZY_DEFAULT_RESULTS, &numMatches);
+        found += numMatches;
+        free(closest);
+    }
+    benchRecord(results, numResults, "search_fuzzy", numRows, numSearches, nowSeconds() - start);
 
-    if(books[index_to_borrow].date_out == 0){       // If the book is not currently out
-        system("cls");      // Clear screen
+    // Queries with several predicates (query,expression), each alternative read through the access path the planner picks
+    static const char *queries[] = {"title:night & year:1950-1970", "author:austen & out", "year:2001 & available | title:golden moon", "overdue & author:orwell"};
+    start = nowSeconds();
+    for(int i=0; i<numSearches; i++){
+        char text[64];
+        struct query query;
+        struct query_plan plans[QUERY_MAX_ALTERNATIVES];
+        snprintf(text, sizeof(text), "%s", queries[i % 4]);
+        parseQuery(text, BENCH_NOW / DATE_SECONDS_PER_DAY, &query);
+        int *matches = runQuery(&catalog, &query, plans, &numMatches);
+        found += numMatches;
+        free(matches);
+    }
+    benchRecord(results, numResults, "query", numRows, numSearches, nowSeconds() - start);
 
-        // Get user's name
-        char name[51];
-        int size;
-        printf("Full name (max 50 chars, cannot include ','): ");
-        fflush(stdin);
-        fgets(name,51,stdin);
+    // Overdue check (checkBooks)
+    start = nowSeconds();
+    for(int i=0; i<BENCH_CHECKS; i++){
+        int *overdue = findDueBooks(&catalog, BENCH_NOW / DATE_SECONDS_PER_DAY, &numMatches);
+        found += numMatches;
+        free(overdue);
+    }
+    benchRecord(results, numResults, "overdue", numRows, BENCH_CHECKS, nowSeconds() - start);
 
-        size = strlen(name);        // Get rid of \n from end of string
-        name[size-1]='\0';      // Get rid of \n from end of string
+    // Overdue check for one borrower (loans,name), over borrowers with many and few loans
+    start = nowSeconds();
+    for(int i=0; i<numSearches; i++){
+        char name[51];
+        snprintf(name, sizeof(name), "Borrower %d", (i * 7919) % (numRows / 50 > 100 ? numRows / 50 : 100));     // (numbers given out by benchGenerate)
+        int *loans = findPatronBooks(&catalog, name, BENCH_NOW / DATE_SECONDS_PER_DAY, &numMatches);
+        found += numMatches;
+        free(loans);
+    }
+    benchRecord(results, numResults, "patron_overdue", numRows, numSearches, nowSeconds() - start);
 
-        strcpy(books[index_to_borrow].name, name);      // Copy name to list of structs
-        books[index_to_borrow].date_out = current_date;     // Add date out (current date) to list of structs
-        books[index_to_borrow].date_due = current_date + 60*60*24*7;        // Add date due (7 days form current date) to list of structs
+    // Page of books in title order (page,title), each starting after a book spread through the catalog, as a cursor from an earlier page would
+    start = nowSeconds();
+    for(int i=0; i<numSearches; i++){
+        struct page_cursor cursor;
+        struct sort_key key;
+        int more;
+        pageCursorStart(&cursor, SORT_TITLE);
+        sortKeyOfRow(&catalog, SORT_TITLE, (int)(((long long)i * 7919) % catalog.numRows), &key);
+        snprintf(cursor.text, sizeof(cursor.text), "%s", key.text);
+        cursor.id = key.id;
+        cursor.started = 1;
+        int *rows = sortPage(&catalog, &cursor, PAGE_DEFAULT_BOOKS, &numMatches, &more);
+        found += numMatches;
+        free(rows);
+    }
+    benchRecord(results, numResults, "page_title", numRows, numSearches, nowSeconds() - start);
 
-        // Tell user book successfully borrowed
-        printf("\n");
-        printf("Book successfully borrowed\n\n");
+    // Full scan (books from 1950-1970 that are out) over the catalog's columns, then over a copy laid out as an array of book structures, as the catalog used to be
+    start = nowSeconds();
+    for(int scan=0; scan<BENCH_SCANS; scan++){
+        for(int first=0; first<catalog.numRows; first+=CATALOG_CHUNK_ROWS){
+            struct catalog_chunk *chunk = catalogChunk(&catalog, first);
+            int chunkRows = catalog.numRows - first < CATALOG_CHUNK_ROWS ? catalog.numRows - first : CATALOG_CHUNK_ROWS;
+            for(int i=0; i<chunkRows; i++){
+                found += chunk->index[i] != BOOK_DELETED && chunk->pub_year[i] >= 1950 && chunk->pub_year[i] <= 1970 && chunk->date_out[i] != 0;
+            }
+        }
     }
-    else{       // If book already out, tell user
-        printf("This book is already out\n\n");
+    benchRecord(results, numResults, "scan_columns", numRows, BENCH_SCANS, nowSeconds() - start);
+    struct book *books = malloc((size_t)catalog.numRows * sizeof(struct book));
+    if(books != NULL){
+        for(int i=0; i<catalog.numRows; i++){
+            catalogRead(&catalog, i, &books[i]);
+        }
+        start = nowSeconds();
+        for(int scan=0; scan<BENCH_SCANS; scan++){
+            for(int i=0; i<catalog.numRows; i++){
+                found += books[i].index != BOOK_DELETED && books[i].pub_year >= 1950 && books[i].pub_year <= 1970 && books[i].date_out != 0;
+            }
+        }
+        benchRecord(results, numResults, "scan_structs", numRows, BENCH_SCANS, nowSeconds() - start);
+        free(books);
+    }
+    else{
+        fprintf(stderr, "Not enough memory to copy catalog, so scan_structs is skipped.\n");
     }
 
-    // Allow user to go back to menu
-    printf("[q] Go back\n");
-    char input;
-    do{
-        fflush(stdin);
-        input = getchar();
-    } while(input != 'q');
-}
-
-void returnBook(struct book *books, int *numRows){
-    // Get index for book to be returned
-    int index_to_return;
-    do{
-        printf("Index to return: ");
-        fflush(stdin); scanf("%d", &index_to_return);
-        index_to_return -= 1;
-    } while(!(index_to_return>=0 && index_to_return<*numRows));     // Ensure in range
-    printf("\n");
+    // Delete (deleteBook), spread over the catalog
+    uint64_t state = 12345;
+    int numDeletes = numRows < BENCH_DELETES ? numRows : BENCH_DELETES;
+    start = nowSeconds();
+    for(int i=0; i<numDeletes; i++){
+        struct mutation deletion = {.op = OP_DELETE, .id = (int)(benchRandom(&state) % numRows)};
+        commitMutation(&catalog, &deletion);        // (fails for the odd ID already deleted, as a delete of a missing book would)
+    }
+    benchRecord(results, numResults, "delete", numRows, numDeletes, nowSeconds() - start);
 
-    if(books[index_to_return].date_out != 0){
-        system("cls");
+    fprintf(stderr, "(%lld results found)\n", found);     // (used, so searches cannot be optimised away)
+    catalogFree(&catalog);
+    remove(fileName);
+    return 1;
+}
 
-        strcpy(books[index_to_return].name, "0");
-        books[index_to_return].date_out = 0;
-        books[index_to_return].date_due = 0;
-        printf("Book successfully returned\n\n");
+// Run benchmark suite at each number of rows in scales (comma separated), printing results as JSON, and compare to baseline results file (if not NULL)
+// Returns 1 if every benchmark ran and none are more than BENCH_REGRESSION_RATIO times slower than the baseline
+int runBenchmarks(char *scales, char *baselineName){
+    struct bench_result results[BENCH_MAX_RESULTS];
+    int numResults = 0;
+    int success = 1;
+    for(char *pos = scales; *pos != '\0' && success; ){
+        char *end;
+        long numRows = strtol(pos, &end, 10);
+        if(end == pos || numRows <= 0 || numRows > INT_MAX / 2){
+            fprintf(stderr, "Invalid number of rows \"%s\".\n", pos);
+            return 0;
+        }
+        success = benchScale(numRows, results, &numResults);
+        pos = *end == ',' ? end + 1 : end;
     }
-    else{
-        printf("This book is not currently out\n\n");
+
+    // Print results as JSON (one result per line, so the file can be used as a baseline)
+    printf("{\"benchmarks\": [\n");
+    for(int i=0; i<numResults; i++){
+        printf("  {\"name\": \"%s\", \"rows\": %d, \"ops\": %d, \"seconds\": %.6f, \"ops_per_second\": %.1f}%s\n", results[i].name, results[i].rows, results[i].ops,
+            results[i].seconds, results[i].ops / (results[i].seconds > 0 ? results[i].seconds : 1e-9), i < numResults-1 ? "," : "");
     }
+    printf("]}\n");
 
-    printf("[q] Go back\n");
-    char input;
-    do{
-        fflush(stdin);
-        input = getchar();
-    } while(input != 'q');
+    // Compare to baseline
+    if(baselineName != NULL){
+        FILE *fin = fopen(baselineName, "r");
+        if(fin == NULL){
+            fprintf(stderr, "Baseline file \"%s\" cannot be read.\n", baselineName);
+            return 0;
+        }
+        char line[256];
+        int numRegressions = 0;
+        while(fgets(line, sizeof(line), fin) != NULL){
+            struct bench_result baseline;
+            if(sscanf(line, " {\"name\": \"%31[^\"]\", \"rows\": %d, \"ops\": %d, \"seconds\": %lf", baseline.name, &baseline.rows, &baseline.ops, &baseline.seconds) != 4){
+                continue;
+            }
+            for(int i=0; i<numResults; i++){
+                if(strcmp(results[i].name, baseline.name) != 0 || results[i].rows != baseline.rows || baseline.ops <= 0 || results[i].ops <= 0){
+                    continue;
+                }
+                double before = baseline.seconds / baseline.ops, after = results[i].seconds / results[i].ops;     // Time per op
+                if(after > before * BENCH_REGRESSION_RATIO && results[i].seconds - baseline.seconds > BENCH_MIN_DIFFERENCE){
+                    fprintf(stderr, "REGRESSION: %s at %d rows took %.6f s (baseline %.6f s, %+.0f%%)\n", results[i].name, results[i].rows, results[i].seconds, baseline.seconds, (after / before - 1) * 100);
+                    numRegressions++;
+                }
+            }
+        }
+        fclose(fin);
+        fprintf(stderr, "%d regressions against \"%s\".\n", numRegressions, baselineName);
+        success = success && numRegressions == 0;
+    }
+    return success;
 }
 
-void searchBooks(struct book *books, int *numRows, time_t current_date){
-    system("cls");      // Clear screen
+#ifndef _WIN32
+// Server (daemon mode): clients connect over a Unix domain socket and send batch commands, one per line, answered by a pool of worker threads
+// Searches run side by side under a shared lock. A change locks its book first, so checking it (e.g. that a book is not out) and making it happen as one step
 
-    // Ask user what to search by
-    char choice;
-    printf("What do you want to search by?\n");
-    printf("[t] Title\n[a] Author\n[p] Publication year\n\n");
-    do{
-        fflush(stdin);
-        scanf("%c", &choice);
-    } while(!(choice=='t' || choice=='a' || choice=='p'));      // Ensure user picks one of the options
-    printf("\n");
+static volatile sig_atomic_t serverStopping = 0;       // Set by SIGINT/SIGTERM
+static int serverWakeFd = -1;       // Write end of dispatcher's wake pipe
 
-    // Ask user for search term
-    char term[51];
-    printf("Search term (max 50 chars): ");
-    fflush(stdin);
-    fgets(term,51,stdin);
+// Signal handler to stop server
+void serverSignal(int signal){
+    (void)signal;
+    serverStopping = 1;
+    if(serverWakeFd != -1){
+        char byte = 0;
+        ssize_t written = write(serverWakeFd, &byte, 1);       // Wake dispatcher
+        (void)written;
+    }
+}
+
+// Write whole buffer to socket, returning 0 if it cannot be written
+int writeAll(int fd, const char *data, size_t size){
+    while(size > 0){
+        ssize_t written = write(fd, data, size);
+        if(written < 0 && errno == EINTR){
+            continue;
+        }
+        if(written <= 0){
+            return 0;
+        }
+        data += written;
+        size -= written;
+    }
+    return 1;
+}
 
-    // Remove '\n' from string
-    int size = strlen(term);
-    term[size-1]='\0';
+// Run one command from a client, writing its result to out
+void serverCommand(struct server *server, struct connection *connection, char *line, FILE *out){
+    struct catalog *catalog = server->catalog;
+    char *fields[6];
+    int numFields = splitFields(line, fields, 6);
 
-    printf("\n");
+    // Reports read a view of the catalog as it is now (sharing its chunks, which changes then copy before writing), so they see one point in time
+    // but only hold up changes while the view is made, not while they run
+    struct catalog view;
+    if(batchIsReport(fields[0])){
+        pthread_rwlock_rdlock(&server->lock);
+        int shared = catalogShare(catalog, &view);
+        pthread_rwlock_unlock(&server->lock);
+        if(shared){
+            batchTimedQuery(&view, fields, numFields, out, &connection->current_date);
+            catalogFree(&view);
+        }
+        else{
+            batchError(out, "out of memory");
+        }
+        return;
+    }
 
-    // Convert search term to all upper-case (to normalise casing, allowing non-case-sensitive search)
-    for(int i=0; i<size; i++){
-        term[i] = toupper(term[i]);
+    // Searches and checks share the catalog with each other
+    if(!batchIsChange(fields[0])){
+        pthread_rwlock_rdlock(&server->lock);
+        batchTimedQuery(catalog, fields, numFields, out, &connection->current_date);
+        pthread_rwlock_unlock(&server->lock);
+        return;
     }
 
+    // Adds take catalog to themselves (the new book's ID must not be given out twice)
+    struct mutation mutation;
+    const char *error;
+    int success = 0;
+    if(strcmp(fields[0], "add") == 0){
+        pthread_rwlock_wrlock(&server->lock);
+        if((error = batchPrepare(catalog, fields, numFields, connection->current_date, &mutation)) == NULL){
+            success = commitMutation(catalog, &mutation);
+            catalogIndexesReady(catalog);       // (e.g. after deletes compact the catalog)
+        }
+        pthread_rwlock_unlock(&server->lock);
+    }
 
-    // Print matching books to user
-    system("cls");
-    char temp[51];
-    printf("Matching books: \n");
+    // Other changes lock their book, check the change against it alongside other clients, then take the catalog to themselves only to make it
+    else{
+        int index;
+        pthread_mutex_t *recordLock = &server->recordLocks[(numFields > 1 && parseField(fields[1], &index) ? (unsigned)index : 0) % SERVER_RECORD_LOCKS];
+        pthread_mutex_lock(recordLock);
+        pthread_rwlock_rdlock(&server->lock);
+        error = batchPrepare(catalog, fields, numFields, connection->current_date, &mutation);
+        pthread_rwlock_unlock(&server->lock);
+        if(error == NULL){      // (book cannot change in between, as every change to it holds its lock)
+            pthread_rwlock_wrlock(&server->lock);
+            success = commitMutation(catalog, &mutation);
+            catalogIndexesReady(catalog);
+            pthread_rwlock_unlock(&server->lock);
+        }
+        pthread_mutex_unlock(recordLock);
+    }
+    if(error != NULL){
+        batchError(out, error);
+    }
+    else{
+        batchChangeResult(out, &mutation, success);
+    }
+}
 
-    switch(choice){
+// Worker thread: takes a client with data waiting, runs every whole command it has sent, then hands it back to the dispatcher
+void* serverWorker(void *argument){
+    struct server *server = argument;
+    while(1){
+        // Wait for a client
+        pthread_mutex_lock(&server->queueLock);
+        while(server->queueCount == 0 && !server->stopping){
+            pthread_cond_wait(&server->queueWake, &server->queueLock);
+        }
+        if(server->queueCount == 0){        // Stopping
+            pthread_mutex_unlock(&server->queueLock);
+            return NULL;
+        }
+        struct connection *connection = server->queue[server->queueStart];
+        server->queueStart = (server->queueStart + 1) % SERVER_MAX_CLIENTS;
+        server->queueCount--;
+        pthread_mutex_unlock(&server->queueLock);
 
-        // Search by title
-        case 't': ;
-            for(int i=0; i<*numRows; i++){      // Go through every book
+        // Read what client has sent
+        ssize_t numRead = read(connection->fd, connection->buffer + connection->length, SERVER_BUFFER_SIZE - connection->length);
+        int open = numRead > 0 || (numRead < 0 && errno == EINTR);
+        if(numRead > 0){
+            connection->length += numRead;
 
-                // Convert value to all upper-case (to normalise casing, allowing non-case-sensitive search)
-                strcpy(temp, books[i].title);
-                for(int i=0; i<50; i++){
-                    temp[i] = toupper(temp[i]);
+            // Run every whole line, collecting results to send in one write
+            char *results = NULL;
+            size_t resultsSize = 0;
+            FILE *out = open_memstream(&results, &resultsSize);
+            char *start = connection->buffer;
+            char *end = connection->buffer + connection->length;
+            char *newline;
+            while(out != NULL && (newline = memchr(start, '\n', end - start)) != NULL){
+                *newline = '\0';
+                if(newline > start && newline[-1] == '\r'){
+                    newline[-1] = '\0';
                 }
-
-                if(strstr(temp, term) != NULL){     // Check if it contains search term
-                    // Print relevant information about book
-                    printf("Book %d: ", books[i].index+1);
-                    printf("%s, ", books[i].title);
-                    printf("%s, ", books[i].author);
-                    printf("%d, ", books[i].pub_year);
-                    if(books[i].date_out != 0){
-                        printf("(OUT)\n");
-                    }
-                    else{
-                        printf("(AVAILABLE)\n");
-                    }
+                if(*start != '\0' && *start != '#'){
+                    serverCommand(server, connection, start, out);
+                    __atomic_add_fetch(&server->requests, 1, __ATOMIC_RELAXED);
                 }
+                start = newline + 1;
             }
-            break;
+            if(start == connection->buffer && connection->length == SERVER_BUFFER_SIZE){        // Buffer full without a whole line
+                batchError(out, "line too long");
+                start = end;
+            }
+            connection->length = end - start;
+            memmove(connection->buffer, start, connection->length);
+            if(out == NULL || fclose(out) != 0 || !writeAll(connection->fd, results, resultsSize)){
+                open = 0;
+            }
+            free(results);
+        }
 
-        // Search by author
-        case 'a': ;
-            for(int i=0; i<*numRows; i++){      // Go through every book
+        // Hand client back to dispatcher (to wait for more), or close it
+        if(open){
+            pthread_mutex_lock(&server->queueLock);
+            server->returned[server->numReturned++] = connection;
+            pthread_mutex_unlock(&server->queueLock);
+            char byte = 0;
+            ssize_t written = write(server->wakePipe[1], &byte, 1);
+            (void)written;
+        }
+        else{
+            close(connection->fd);
+            free(connection);
+            __atomic_sub_fetch(&server->numClients, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
 
-                // Convert value to all upper-case (to normalise casing, allowing non-case-sensitive search)
-                strcpy(temp, books[i].author);
-                for(int i=0; i<50; i++){
-                    temp[i] = toupper(temp[i]);
-                }
+// Run server on Unix domain socket until stopped by SIGINT/SIGTERM, then save catalog, returning 1 if successful
+int runServer(char *fileName, char *socketPath){
+    struct server server;
+    memset(&server, 0, sizeof(server));
+    struct catalog catalog;
+    struct load_stats load_stats;
+    catalogInit(&catalog);
+    if(!loadCatalog(fileName, &catalog, &load_stats)){
+        fprintf(stderr, "Database file, \"%s\", cannot be found.\n", fileName);
+        return 0;
+    }
+    catalog.journal = journalOpen(fileName, &catalog);
+    if(!catalogIndexesReady(&catalog)){
+        fprintf(stderr, "Out of memory building indexes.\n");
+        catalogFree(&catalog);
+        return 0;
+    }
+    server.catalog = &catalog;
 
-                if(strstr(temp, term) != NULL){     // Check if it contains search term
-                    // Print relevant information about book
-                    printf("Book %d:\t", books[i].index+1);
-                    printf("%s, \t", books[i].title);
-                    printf("%s, \t", books[i].author);
-                    printf("%d, \t", books[i].pub_year);
-                    if(books[i].date_out != 0){
-                        printf("OUT\n");
-                    }
-                    else{
-                        printf("AVAILABLE\n");
-                    }
-                }
+    // Listen on socket
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketPath);
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath);     // (left behind if server was killed)
+    if(listenFd < 0 || bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, 128) != 0 || pipe(server.wakePipe) != 0){
+        fprintf(stderr, "Socket \"%s\" cannot be opened.\n", socketPath);
+        if(listenFd >= 0){
+            close(listenFd);
+        }
+        catalogFree(&catalog);
+        return 0;
+    }
+
+    // Start workers
+    pthread_rwlockattr_t lockAttributes;
+    pthread_rwlockattr_init(&lockAttributes);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&lockAttributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);      // Changes are not starved by a steady stream of searches
+#endif
+    pthread_rwlock_init(&server.lock, &lockAttributes);
+    pthread_rwlockattr_destroy(&lockAttributes);
+    for(int i=0; i<SERVER_RECORD_LOCKS; i++){
+        pthread_mutex_init(&server.recordLocks[i], NULL);
+    }
+    pthread_mutex_init(&server.queueLock, NULL);
+    pthread_cond_init(&server.queueWake, NULL);
+    int numWorkers = cpuCount() < 4 ? 4 : cpuCount() > SERVER_MAX_WORKERS ? SERVER_MAX_WORKERS : cpuCount();
+    for(int i=0; i<numWorkers; i++){
+        if(pthread_create(&server.workers[server.numWorkers], NULL, serverWorker, &server) == 0){
+            server.numWorkers++;
+        }
+    }
+    serverWakeFd = server.wakePipe[1];
+    signal(SIGINT, serverSignal);
+    signal(SIGTERM, serverSignal);
+    signal(SIGPIPE, SIG_IGN);       // (clients that go away are noticed by failed writes instead)
+    fprintf(stderr, "Serving %d books on \"%s\" with %d workers.\n", catalog.numRows - catalog.numFree, socketPath, server.numWorkers);
+
+    // Dispatcher: wait for new clients, and for data from clients not being served, handing clients with data to the workers
+    struct connection *waiting[SERVER_MAX_CLIENTS];
+    struct pollfd polls[SERVER_MAX_CLIENTS + 2];
+    int numWaiting = 0;
+    while(!serverStopping){
+        polls[0].fd = listenFd;
+        polls[0].events = __atomic_load_n(&server.numClients, __ATOMIC_RELAXED) < SERVER_MAX_CLIENTS ? POLLIN : 0;       // (stop accepting when full)
+        polls[1].fd = server.wakePipe[0];
+        polls[1].events = POLLIN;
+        for(int i=0; i<numWaiting; i++){
+            polls[i+2].fd = waiting[i]->fd;
+            polls[i+2].events = POLLIN;
+        }
+        if(poll(polls, numWaiting + 2, -1) < 0){
+            if(errno == EINTR){
+                continue;
             }
             break;
+        }
 
-        // Search by publication year
-        case 'p': ;
-            for(int i=0; i<*numRows; i++){      // Go through every book
-                if(books[i].pub_year ==  atoi(term)){     // Check if it contains search term
-                    // Print relevant information about book
-                    printf("Book %d:\t", books[i].index+1);
-                    printf("%s, \t", books[i].title);
-                    printf("%s, \t", books[i].author);
-                    printf("%d, \t", books[i].pub_year);
-                    if(books[i].date_out != 0){
-                        printf("OUT\n");
-                    }
-                    else{
-                        printf("AVAILABLE\n");
-                    }
-                }
+        // Hand clients with data (or that have closed) to workers
+        pthread_mutex_lock(&server.queueLock);
+        int numKept = 0;
+        for(int i=0; i<numWaiting; i++){
+            if(polls[i+2].revents != 0){
+                server.queue[(server.queueStart + server.queueCount) % SERVER_MAX_CLIENTS] = waiting[i];
+                server.queueCount++;
+                pthread_cond_signal(&server.queueWake);
             }
-            break;
+            else{
+                waiting[numKept++] = waiting[i];
+            }
+        }
+        numWaiting = numKept;
+
+        // Take back clients workers have finished with
+        if(polls[1].revents != 0){
+            char bytes[256];
+            ssize_t numRead = read(server.wakePipe[0], bytes, sizeof(bytes));
+            (void)numRead;
+        }
+        for(int i=0; i<server.numReturned; i++){
+            waiting[numWaiting++] = server.returned[i];
+        }
+        server.numReturned = 0;
+        pthread_mutex_unlock(&server.queueLock);
+
+        // Accept new client
+        if(polls[0].revents & POLLIN){
+            int fd = accept(listenFd, NULL, NULL);
+            struct connection *connection = fd >= 0 ? malloc(sizeof(struct connection)) : NULL;
+            if(connection != NULL){
+                connection->fd = fd;
+                connection->length = 0;
+                connection->current_date = dateToday();
+                waiting[numWaiting++] = connection;
+                __atomic_add_fetch(&server.numClients, 1, __ATOMIC_RELAXED);
+            }
+            else if(fd >= 0){
+                close(fd);
+            }
+        }
     }
-    printf("\n");
 
-    // Give user options
-    printf("[b] Borrow book \n[r] Return a book \n[e] Edit a book \n[d] Delete a book \n[s] Search again \n[q] Stop searching\n");
-    do{
-        fflush(stdin);
-        scanf("%c", &choice);
-    } while(!(choice == 'b' || choice == 'r' || choice=='e' || choice=='d' || choice=='s' || choice=='q'));      // Ensure user picks one of the options
+    // Stop workers, close clients, then save
+    pthread_mutex_lock(&server.queueLock);
+    server.stopping = 1;
+    pthread_cond_broadcast(&server.queueWake);
+    pthread_mutex_unlock(&server.queueLock);
+    for(int i=0; i<server.numWorkers; i++){
+        pthread_join(server.workers[i], NULL);
+    }
+    for(int i=0; i<numWaiting; i++){
+        close(waiting[i]->fd);
+        free(waiting[i]);
+    }
+    for(int i=0; i<server.numReturned; i++){
+        close(server.returned[i]->fd);
+        free(server.returned[i]);
+    }
+    close(listenFd);
+    unlink(socketPath);
+    serverWakeFd = -1;
+    close(server.wakePipe[0]);
+    close(server.wakePipe[1]);
 
-    printf("\n");
+    int saved = writeDatabase(fileName, &catalog);
+    fprintf(stderr, "%lld requests served. %s\n", server.requests, saved ? "Database file saved." : "Database file cannot be saved.");
+    if(catalog.journal != NULL){
+        journalClose(catalog.journal);
+    }
+    catalogFree(&catalog);
+    pthread_rwlock_destroy(&server.lock);
+    return saved;
+}
 
-    // Run related function/end searching
-    switch(choice){
-        case 'b':
-            borrowBook(books, numRows, current_date);
-            break;
-        case 'r':
-            returnBook(books, numRows);
-            break;
-        case 'e':
-            editBook(books, numRows, current_date);
-            break;
-        case 'd':
-            deleteBook(books, numRows);
-            break;
-        case 's':
-            searchBooks(books, numRows, current_date);
-            break;
-        case 'q':
+// Connect to server socket, returning socket (-1 if it cannot be reached)
+int serverConnect(char *socketPath){
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketPath);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd >= 0 && connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send one command to server and read its whole result (up to the "ok"/"error" line), returning 0 if connection failed
+int serverRequest(int fd, const char *command, char *buffer, size_t bufferSize, size_t *length){
+    if(!writeAll(fd, command, strlen(command))){
+        return 0;
+    }
+    *length = 0;
+    size_t lineStart = 0;
+    while(1){
+        // Look for last line of result in what has been read so far
+        for(size_t i=lineStart; i<*length; i++){
+            if(buffer[i] == '\n'){
+                if(strncmp(buffer + lineStart, "ok", 2) == 0 || strncmp(buffer + lineStart, "error", 5) == 0){
+                    return 1;
+                }
+                lineStart = i + 1;
+            }
+        }
+        if(*length == bufferSize){     // Result bigger than buffer, so only the end of it is kept
+            memmove(buffer, buffer + lineStart, *length - lineStart);
+            *length -= lineStart;
+            lineStart = 0;
+            if(*length == bufferSize){
+                *length = 0;
+            }
+        }
+        ssize_t numRead = read(fd, buffer + *length, bufferSize - *length);
+        if(numRead <= 0){
+            return 0;
+        }
+        *length += numRead;
+    }
+}
+
+// Load test client thread: sends a mix of searches, checks and loans as fast as the server answers, recording the time each takes
+void* loadTestClient(void *argument){
+    struct load_client *client = argument;
+    static const char *authorTerms[] = {"ing", "son", "ell", "row", "ter", "man", "lee", "ard"};
+    char command[128];
+    char buffer[1 << 16];
+    size_t length;
+    unsigned seed = client->seed;
+    int fd = serverConnect(client->socketPath);
+    if(fd < 0){
+        client->failed = 1;
+        return NULL;
+    }
+    while(nowSeconds() < client->endTime){
+        int choice = rand_r(&seed) % 20;
+        int index = rand_r(&seed) % (client->numBooks > 0 ? client->numBooks : 1) + 1;
+        if(client->reporter){       // Whole catalog, over and over
+            snprintf(command, sizeof(command), "list\n");
+        }
+        else if(choice == 0){        // 5% borrow
+            snprintf(command, sizeof(command), "borrow,%d,Load test %d-%d\n", index, client->number, index % 100);     // (spread over many borrowers, so few reach the loan limit)
+        }
+        else if(choice == 1){       // 5% return
+            snprintf(command, sizeof(command), "return,%d\n", index);
+        }
+        else if(choice < 10){       // 40% title search
+            snprintf(command, sizeof(command), "search,t,%d\n", rand_r(&seed) % 10000);
+        }
+        else if(choice < 16){       // 30% author search
+            snprintf(command, sizeof(command), "search,a,%s\n", authorTerms[rand_r(&seed) % (sizeof(authorTerms) / sizeof(authorTerms[0]))]);
+        }
+        else if(choice < 19){       // 15% year search
+            snprintf(command, sizeof(command), "search,p,%d\n", 1900 + rand_r(&seed) % 125);
+        }
+        else{       // 5% overdue check
+            snprintf(command, sizeof(command), "overdue\n");
+        }
+        double start = nowSeconds();
+        if(!serverRequest(fd, command, buffer, sizeof(buffer), &length)){
+            client->failed = 1;
             break;
+        }
+        double latency = nowSeconds() - start;
+        if(client->reporter){
+            continue;
+        }
+        if(client->numLatencies == client->maxLatencies){
+            int newMaxLatencies = client->maxLatencies ? client->maxLatencies * 2 : 4096;
+            double *newLatencies = realloc(client->latencies, newMaxLatencies * sizeof(double));
+            if(newLatencies == NULL){
+                client->failed = 1;
+                break;
+            }
+            client->latencies = newLatencies;
+            client->maxLatencies = newMaxLatencies;
+        }
+        client->latencies[client->numLatencies++] = latency;
     }
+    close(fd);
+    return NULL;
 }
 
-void checkBooks(struct book *books, int *numRows, time_t current_date){
-    system("cls");
+// Compare two doubles (for qsort)
+int compareDoubles(const void *a, const void *b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
 
-    // Print all books where time between date due < current date (over due)
-    printf("Currently overdue books:\n");
-    for(int i=0; i<*numRows; i++){      // Go through every book
-        if(books[i].date_due != 0 && books[i].date_due < current_date){     // If date due < current date (overdue)
-            printf("%d. %s, %s, %d days overdue\n", i+1, books[i].title, books[i].name, (current_date-books[i].date_due)/(60*60*24));       // Print information, including # days overdue
+// Run load test against a running server: for 1, 2, 4... up to maxClients clients, report throughput and p50/p99 latency, returning 1 if successful
+int runLoadTest(char *socketPath, int maxClients, double seconds, int numReporters){
+    // Find how many books there are, so clients borrow/return real ones
+    char buffer[256];
+    size_t length;
+    int fd = serverConnect(socketPath);
+    if(fd < 0 || !serverRequest(fd, "count\n", buffer, sizeof(buffer) - 1, &length)){
+        fprintf(stderr, "Server on \"%s\" cannot be reached.\n", socketPath);
+        if(fd >= 0){
+            close(fd);
         }
+        return 0;
     }
+    close(fd);
+    buffer[length] = '\0';
+    int numBooks = 0, nextIndex = 0;
+    sscanf(buffer, "ok,%d,%d", &numBooks, &nextIndex);
 
-    printf("\n");
+    printf("clients,requests,seconds,requests_per_second,p50_ms,p99_ms\n");
+    int success = 1;
+    for(int numClients=1; numClients<=maxClients && success; numClients*=2){
+        int numThreads = numClients + numReporters;     // (reporters run alongside the timed clients, to show how much long reports slow them down)
+        struct load_client *clients = calloc(numThreads, sizeof(struct load_client));
+        pthread_t *threads = malloc(numThreads * sizeof(pthread_t));
+        double start = nowSeconds();
+        int numStarted = 0;
+        for(int i=0; i<numThreads && clients != NULL && threads != NULL; i++){
+            clients[i].socketPath = socketPath;
+            clients[i].number = i;
+            clients[i].seed = 12345 + i;
+            clients[i].numBooks = nextIndex - 1;
+            clients[i].endTime = start + seconds;
+            clients[i].reporter = i >= numClients;
+            if(pthread_create(&threads[i], NULL, loadTestClient, &clients[i]) != 0){
+                break;
+            }
+            numStarted++;
+        }
+        for(int i=0; i<numStarted; i++){
+            pthread_join(threads[i], NULL);
+        }
+        double elapsed = nowSeconds() - start;
 
-    // Allow user to go back to main menu
-    printf("[q] Go back\n");
-    char input;
-    do{
-        fflush(stdin);
-        input = getchar();
-    } while(input != 'q');
+        // Put every latency together to find percentiles
+        long long numRequests = 0;
+        for(int i=0; i<numStarted; i++){
+            numRequests += clients[i].numLatencies;
+            success = success && !clients[i].failed;
+        }
+        double *latencies = malloc((numRequests ? numRequests : 1) * sizeof(double));
+        if(latencies != NULL && numStarted == numThreads && numRequests > 0){
+            long long pos = 0;
+            for(int i=0; i<numStarted; i++){
+                memcpy(latencies + pos, clients[i].latencies, clients[i].numLatencies * sizeof(double));
+                pos += clients[i].numLatencies;
+            }
+            qsort(latencies, numRequests, sizeof(double), compareDoubles);
+            printf("%d,%lld,%.2f,%.0f,%.3f,%.3f\n", numClients, numRequests, elapsed, numRequests / elapsed,
+                latencies[numRequests / 2] * 1000, latencies[numRequests * 99 / 100] * 1000);
+            fflush(stdout);
+        }
+        else{
+            success = 0;
+        }
+        for(int i=0; i<numStarted; i++){
+            free(clients[i].latencies);
+        }
+        free(latencies);
+        free(clients);
+        free(threads);
+    }
+    if(!success){
+        fprintf(stderr, "Load test failed (server went away or out of memory).\n");
+    }
+    return success;
 }
+#endif